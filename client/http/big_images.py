@@ -88,6 +88,17 @@ class http_client():
     # print(data)
     # TODO: read and parse (and merge) the result
 
+  def send_tiled_inference(self, path):
+    # upload the whole image, the server splits it in tiles and merges the
+    # detections of all tiles
+    headers = {'Content-Type': 'image/jpg'}
+    with open(path, 'rb') as f:
+      body = f.read()
+    conn = http.client.HTTPConnection(self.ip+":"+self.port)
+    conn.request('POST','/inference/tiled', body, headers)
+    res = conn.getresponse()
+    return json.loads(res.read().decode('utf-8'))
+
   def send_inference_mp(self,patch_list):
     worker = partial(send_inference_wrap, http_client=self)
     self.pool.map(worker,patch_list)
@@ -115,6 +126,13 @@ class App():
     self.client.send_inference_mp(patch_list=patch_list)
     print(timer()-start)
 
+  def run_tiled(self, name, ext):
+    start = timer()
+    res = self.client.send_tiled_inference(
+        os.path.join(self.splitbase.srcpath, name + ext))
+    print(len(res['predictions']))
+    print(timer()-start)
+
 if __name__ == '__main__':
     # srcpath: path to image folder
     # ip & port
@@ -239,9 +239,9 @@ class async_http_worker
   }
 
  private:
-  http::response<http::string_body> error_message(beast_basic_request& req,
-                                                  http::status status,
-                                                  beast::string_view why) {
+  beast_basic_response error_message(beast_basic_request& req,
+                                     http::status status,
+                                     beast::string_view why) {
     beast_basic_response res{status, req.version()};
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
     res.set(http::field::content_type, "text/html");
@@ -416,7 +416,8 @@ class async_inference_worker {
         auto data = body.data();
         int size = body.size();
         // run the blob
-        auto detection_out = Ie->run_detection(data, size);
+        detection_result detection_out;
+        Ie->run_detection(data, size, detection_out);
         // push to resq
         resq->push(std::make_shared<inference_output>(
             std::move(sock), std::move(detection_out)));
@@ -0,0 +1,79 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: Ping-pong latency of the bells, i.e. the handoff between a
+ * request thread and an inference worker. Two threads ring each other's
+ * bell; a round trip is two handoffs.
+ * Usage: bell_bench [round trips] [spin budget of the futex bell]
+ ***************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "st_message_queue.h"
+
+using namespace st::sync;
+using bench_clock = std::chrono::steady_clock;
+
+/**
+ * @brief Round trip times of a bell type, in nanoseconds
+ *
+ * @tparam Bell
+ * @param n number of round trips
+ * @param work_ns busy time of the ponger before it answers, i.e. a tiny
+ * model
+ * @return std::vector<int64_t>
+ */
+template <class Bell>
+std::vector<int64_t> ping_pong(int n, int64_t work_ns) {
+  Bell ping, pong;
+  std::vector<int64_t> rtt(n);
+  std::thread ponger([&]() {
+    for (int i = 0; i < n; ++i) {
+      ping.wait_any();
+      const auto until = bench_clock::now() + std::chrono::nanoseconds(work_ns);
+      while (bench_clock::now() < until) {
+      }
+      pong.ring(1);
+    }
+  });
+  for (int i = 0; i < n; ++i) {
+    const auto start = bench_clock::now();
+    ping.ring(1);
+    pong.wait_any();
+    rtt[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 bench_clock::now() - start)
+                 .count();
+  }
+  ponger.join();
+  std::sort(rtt.begin(), rtt.end());
+  return rtt;
+}
+
+template <class Bell>
+void report(const std::string& name, int n, int64_t work_ns) {
+  auto rtt = ping_pong<Bell>(n, work_ns);
+  double sum = 0;
+  for (auto t : rtt) sum += t;
+  std::printf("%-24s work %6ld ns: mean %8.0f ns, p50 %8ld ns, p99 %8ld ns\n",
+              name.c_str(), static_cast<long>(work_ns), sum / n, rtt[n / 2],
+              rtt[n * 99 / 100]);
+}
+
+int main(int argc, char** argv) {
+  const int n = argc > 1 ? std::atoi(argv[1]) : 100000;
+  const int spin =
+      argc > 2 ? std::atoi(argv[2]) : futex_bell::spin_budget().load();
+  for (int64_t work_ns : {0, 20000}) {
+    report<condvar_bell>("mutex + condvar", n, work_ns);
+    futex_bell::spin_budget() = 0;
+    report<futex_bell>("futex, no spin", n, work_ns);
+    futex_bell::spin_budget() = spin;
+    report<futex_bell>("futex, spin " + std::to_string(spin), n, work_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,179 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: Non-maximum suppression, the brute-force reference vs the
+ * suppressor of the YOLO parsers (st_ie_nms.h). The reference tests every
+ * pair of candidates with the IoU in double precision; both must keep the
+ * same candidates. Synthetic candidates are clusters of jittered boxes
+ * around objects, as a detection network outputs them; recorded ones are
+ * read from a file, one "x1 y1 x2 y2 score label" per line.
+ * Usage: nms_bench [iterations] [recorded candidates]
+ ***************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "st_ie_nms.h"
+
+using namespace st::ie;
+using bench_clock = std::chrono::steady_clock;
+
+/**
+ * @brief Greedy NMS that tests every pair, in double precision
+ *
+ * @param in candidates
+ * @param p parameters, top_k and keep_top_k are not supported
+ * @param keep indices of kept candidates
+ */
+void reference_nms(const nms_boxes& in, const nms_param& p,
+                   std::vector<int>& keep) {
+  keep.clear();
+  std::vector<int> order;
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (in.score[i] >= p.score_threshold) order.push_back(i);
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int a, int b) { return in.score[a] > in.score[b]; });
+  auto area = [&](int i) {
+    return static_cast<double>(in.x2[i] - in.x1[i]) * (in.y2[i] - in.y1[i]);
+  };
+  std::vector<char> suppressed(in.size(), 0);
+  for (size_t k = 0; k < order.size(); ++k) {
+    const int a = order[k];
+    if (suppressed[a]) continue;
+    keep.push_back(a);
+    for (size_t l = k + 1; l < order.size(); ++l) {
+      const int b = order[l];
+      if (suppressed[b]) continue;
+      if (p.class_aware && in.label[a] != in.label[b]) continue;
+      const double iw = std::min<double>(in.x2[a], in.x2[b]) -
+                        std::max<double>(in.x1[a], in.x1[b]);
+      const double ih = std::min<double>(in.y2[a], in.y2[b]) -
+                        std::max<double>(in.y1[a], in.y1[b]);
+      if (iw <= 0 || ih <= 0) continue;
+      const double inter = iw * ih;
+      if (inter / (area(a) + area(b) - inter) >= p.iou_threshold) {
+        suppressed[b] = 1;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Candidates of a detection network: a few boxes per object, jittered
+ * around it, with several classes
+ *
+ * @param n number of candidates
+ * @param classes number of classes
+ * @param seed
+ * @return nms_boxes
+ */
+nms_boxes synthetic_candidates(int n, int classes, unsigned seed) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> position(0, 1920);
+  std::uniform_real_distribution<float> size(8, 200);
+  std::uniform_real_distribution<float> score(0.05f, 1);
+  std::normal_distribution<float> jitter(0, 0.1f);
+  std::uniform_int_distribution<int> label(0, classes - 1);
+  std::uniform_int_distribution<int> per_object(1, 12);
+  nms_boxes ret;
+  ret.reserve(n);
+  while (static_cast<int>(ret.size()) < n) {
+    const float x = position(gen), y = position(gen);
+    const float w = size(gen), h = size(gen);
+    const int c = label(gen);
+    for (int k = per_object(gen); k > 0 && static_cast<int>(ret.size()) < n;
+         --k) {
+      const float dx = jitter(gen) * w, dy = jitter(gen) * h;
+      const float sw = w * (1 + jitter(gen)), sh = h * (1 + jitter(gen));
+      ret.push_back(x + dx, y + dy, x + dx + sw, y + dy + sh, score(gen), c);
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief Candidates recorded from a network, one "x1 y1 x2 y2 score label"
+ * per line
+ *
+ * @param path
+ * @return nms_boxes
+ */
+nms_boxes recorded_candidates(const std::string& path) {
+  nms_boxes ret;
+  std::ifstream file(path);
+  float x1, y1, x2, y2, score;
+  int label;
+  while (file >> x1 >> y1 >> x2 >> y2 >> score >> label) {
+    ret.push_back(x1, y1, x2, y2, score, label);
+  }
+  return ret;
+}
+
+/**
+ * @brief Mean time of both, in microseconds, and whether they keep the same
+ * candidates
+ *
+ * @return true if the kept sets are identical
+ */
+bool report(const char* name, const nms_boxes& in, const nms_param& p,
+            int iterations) {
+  std::vector<int> expected, keep;
+  nms_suppressor nms;
+  auto start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) reference_nms(in, p, expected);
+  const double reference_us =
+      std::chrono::duration<double, std::micro>(bench_clock::now() - start)
+          .count() /
+      iterations;
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) nms.run(in, p, keep);
+  const double suppressor_us =
+      std::chrono::duration<double, std::micro>(bench_clock::now() - start)
+          .count() /
+      iterations;
+  std::sort(expected.begin(), expected.end());
+  std::sort(keep.begin(), keep.end());
+  const bool same = expected == keep;
+  std::printf(
+      "%-12s %6zu candidates, %5zu kept: reference %10.1f us, suppressor "
+      "%8.1f us, %6.1fx%s\n",
+      name, in.size(), expected.size(), reference_us, suppressor_us,
+      reference_us / suppressor_us, same ? "" : "  KEPT SETS DIFFER");
+  return same;
+}
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 5;
+  bool same = true;
+  if (argc > 2) {
+    const auto in = recorded_candidates(argv[2]);
+    for (bool class_aware : {true, false}) {
+      nms_param p;
+      p.class_aware = class_aware;
+      same &= report(class_aware ? "class" : "agnostic", in, p, iterations);
+    }
+    return same ? 0 : 1;
+  }
+  for (int n : {50, 500, 5000, 20000}) {
+    const auto in = synthetic_candidates(n, 4, n);
+    for (bool class_aware : {true, false}) {
+      nms_param p;
+      p.class_aware = class_aware;
+      p.score_threshold = 0.1f;
+      for (float iou : {0.4f, 0.7f}) {
+        p.iou_threshold = iou;
+        char name[32];
+        std::snprintf(name, sizeof(name), "%s %.1f",
+                      class_aware ? "class" : "agnostic", iou);
+        same &= report(name, in, p, iterations);
+      }
+    }
+  }
+  return same ? 0 : 1;
+}
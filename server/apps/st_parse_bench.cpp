@@ -0,0 +1,198 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: Time to turn the output blob of a network into the JSON body of
+ * the HTTP API, for a crowded image. The usual path parses the blob into a
+ * detection result and serializes it through a property tree; the fused
+ * path writes the body while it scans the blob. SSD outputs a
+ * DetectionOutput blob, YOLO v3 three region outputs.
+ * Usage: parse_bench [iterations] [detections]
+ ***************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "st_ie_detection_output.h"
+#include "st_ie_json.h"
+#include "st_ie_nms.h"
+#include "st_ie_yolo.h"
+
+using namespace st::ie;
+using bench_clock = std::chrono::steady_clock;
+
+static const int width = 1920;   //!< size of the image
+static const int height = 1080;
+static const int classes = 80;   //!< number of classes
+
+/**
+ * @brief A DetectionOutput blob with n records above the threshold
+ *
+ */
+std::vector<float> ssd_blob(int proposals, int n, std::minstd_rand& rng) {
+  std::uniform_real_distribution<float> u(0, 1);
+  std::vector<float> blob(proposals * 7, 0);
+  for (int i = 0; i < proposals; ++i) {
+    float* rec = &blob[i * 7];
+    rec[0] = 0;
+    rec[1] = 1 + rng() % classes;
+    rec[2] = i < n ? 0.5f + 0.5f * u(rng) : 0.2f * u(rng);
+    rec[3] = 0.9f * u(rng);
+    rec[4] = 0.9f * u(rng);
+    rec[5] = rec[3] + 0.01f + 0.09f * u(rng);
+    rec[6] = rec[4] + 0.01f + 0.09f * u(rng);
+  }
+  return blob;
+}
+
+template <class Out>
+void ssd_parse(const std::vector<float>& blob, Out& out) {
+  detection_output_parser::parse(blob.data(), blob.size() / 7, 7, width,
+                                 height, 0.45f, out);
+}
+
+/**
+ * @brief The outputs of the three regions of YOLO v3, the objectness of
+ * about a fraction of the cells passes the threshold
+ *
+ */
+struct yolo_outputs {
+  std::vector<yolo_region> regions;
+  std::vector<std::vector<float>> blobs;
+  yolo_outputs(float fraction, std::minstd_rand& rng) {
+    std::uniform_real_distribution<float> u(0, 1);
+    const int sides[3] = {13, 26, 52};
+    const float anchors[3][6] = {{116, 90, 156, 198, 373, 326},
+                                 {30, 61, 62, 45, 59, 119},
+                                 {10, 13, 16, 30, 33, 23}};
+    for (int s = 0; s < 3; ++s) {
+      yolo_region r;
+      r.side_h = r.side_w = sides[s];
+      r.classes = classes;
+      r.anchors.assign(anchors[s], anchors[s] + 6);
+      const int plane = r.side_h * r.side_w;
+      const int entries = r.coords + r.classes + 1;
+      std::vector<float> blob(r.num() * entries * plane);
+      for (int n = 0; n < r.num(); ++n) {
+        float* base = &blob[n * entries * plane];
+        for (int loc = 0; loc < plane; ++loc) {
+          base[loc] = u(rng);
+          base[plane + loc] = u(rng);
+          base[2 * plane + loc] = u(rng) - 0.5f;
+          base[3 * plane + loc] = u(rng) - 0.5f;
+          const bool object = u(rng) < fraction;
+          base[4 * plane + loc] = object ? 0.9f + 0.1f * u(rng) : 0.1f * u(rng);
+          const int best = rng() % classes;
+          for (int j = 0; j < classes; ++j) {
+            base[(5 + j) * plane + loc] =
+                j == best ? 0.7f + 0.3f * u(rng) : 0.05f * u(rng);
+          }
+        }
+      }
+      regions.push_back(r);
+      blobs.push_back(std::move(blob));
+    }
+  }
+};
+
+/**
+ * @brief As the parser of openvino_yolo, on a single thread
+ *
+ */
+template <class Out>
+void yolo_parse(const yolo_outputs& y, Out& out) {
+  static nms_boxes objects;
+  static nms_suppressor nms;
+  static std::vector<int> keep;
+  objects.clear();
+  for (size_t i = 0; i < y.regions.size(); ++i) {
+    yolo_decoder::decode(y.blobs[i].data(), y.regions[i], 416, 416, height,
+                         width, 0.5f, objects);
+  }
+  nms_param param;
+  param.iou_threshold = 0.4;
+  param.score_threshold = 0.5f;
+  nms.run(objects, param, keep);
+  out.reserve(keep.size());
+  for (int i : keep) {
+    out.push_back(objects.label[i] + 1, objects.score[i],
+                  static_cast<int>(objects.x1[i]),
+                  static_cast<int>(objects.y1[i]),
+                  static_cast<int>(objects.x2[i]),
+                  static_cast<int>(objects.y2[i]));
+  }
+}
+
+/**
+ * @brief Mean time of both paths, in microseconds, and whether they write
+ * the same body
+ *
+ */
+template <class Parse>
+void report(const char* name, int iterations, const label_table::ptr& labels,
+            Parse parse) {
+  std::string usual, fused;
+  size_t detections = 0;
+  auto start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    detection_result ret;
+    ret.labels = labels;
+    parse(ret);
+    usual = predictions_json(ret);
+    detections = ret.size();
+  }
+  const double usual_us =
+      std::chrono::duration<double, std::micro>(bench_clock::now() - start)
+          .count() /
+      iterations;
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    detection_json_writer out(fused, labels.get());
+    parse(out);
+    out.finish();
+  }
+  const double fused_us =
+      std::chrono::duration<double, std::micro>(bench_clock::now() - start)
+          .count() /
+      iterations;
+  std::printf("%-5s %4zu detections: tree %8.1f us, fused %8.1f us, %5.1fx%s\n",
+              name, detections, usual_us, fused_us, usual_us / fused_us,
+              usual == fused ? "" : "  BODIES DIFFER");
+}
+
+/**
+ * @brief C++11 equivalents of generic lambdas
+ *
+ */
+struct ssd_job {
+  const std::vector<float>& blob;
+  template <class Out>
+  void operator()(Out& out) const {
+    ssd_parse(blob, out);
+  }
+};
+struct yolo_job {
+  const yolo_outputs& y;
+  template <class Out>
+  void operator()(Out& out) const {
+    yolo_parse(y, out);
+  }
+};
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 1000;
+  const int n = argc > 2 ? std::atoi(argv[2]) : 200;
+  std::minstd_rand rng(42);
+  std::vector<std::string> names;
+  for (int i = 0; i < classes; ++i) names.push_back("class/" + std::to_string(i));
+  auto labels = std::make_shared<const label_table>(std::move(names));
+  const auto ssd = ssd_blob(std::max(n, 100) * 2, n, rng);
+  report("SSD", iterations, labels, ssd_job{ssd});
+  // about n candidates before NMS
+  const yolo_outputs yolo(n / (3.0f * (13 * 13 + 26 * 26 + 52 * 52)), rng);
+  report("YOLO", iterations, labels, yolo_job{yolo});
+  return 0;
+}
@@ -0,0 +1,267 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the admission control of the server. A
+ * request is admitted only if the task queue is not full, the bytes of
+ * the requests in flight stay under a limit and, with the adaptive limiter,
+ * the requests in flight stay under the current concurrency limit;
+ * otherwise it's shed right away with a retry hint, instead of waiting in
+ * an unbounded queue until the client times out.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include "st_ie_common.h"
+#include "st_limiter.h"
+#include "st_logging.h"
+#include "st_metrics.h"
+#include "st_priority.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief Outcome of an inference request
+ *
+ */
+enum class request_status {
+  done,    //!< predictions are ready
+  shed,     //!< rejected by the admission control
+  expired,  //!< dropped, the deadline passed before inference
+  cancelled,  //!< the client went away before the answer
+  failed      //!< the engine failed on it
+};
+
+/**
+ * @brief Outcome of a request answered with a msg_state
+ *
+ * @param state
+ * @return request_status
+ */
+inline request_status answer_status(int state) {
+  return state == msg_expired     ? request_status::expired
+         : state == msg_cancelled ? request_status::cancelled
+         : state == msg_failed    ? request_status::failed
+                                  : request_status::done;
+}
+
+/**
+ * @brief Parameters of the admission control, 0 = unlimited
+ *
+ */
+struct admission_param {
+  int max_queue_depth = 0;          //!< maximum number of queued tasks
+  uint64_t max_inflight_bytes = 0;  //!< maximum bytes of admitted requests
+  int retry_after = 1;              //!< retry hint of shed requests, seconds
+};
+
+/**
+ * @brief Admission control of the inference requests
+ * @details Thread-safe, one object is shared by all request threads
+ */
+class admission_control {
+ public:
+  /**
+   * @brief Construct a new admission control object
+   *
+   * @param _param
+   */
+  admission_control(const admission_param& _param)
+      : param(_param),
+        admitted(metrics::server_metrics().get_counter("admission.admitted")),
+        shed_queue_full(metrics::server_metrics().get_counter(
+            "admission.shed.queue full")),
+        shed_bytes(metrics::server_metrics().get_counter(
+            "admission.shed.inflight bytes")),
+        shed_limit(metrics::server_metrics().get_counter(
+            "admission.shed.concurrency limit")),
+        inflight(metrics::server_metrics().get_gauge(
+            "admission.inflight bytes")) {}
+  /**
+   * @brief Read the parameters from the "admission" node of the configuration
+   *
+   * @param conf
+   * @return admission_param
+   */
+  static admission_param read_param(const JSON& conf) {
+    admission_param p;
+    p.max_queue_depth = conf.get<int>("max queue depth", p.max_queue_depth);
+    p.max_inflight_bytes =
+        conf.get<uint64_t>("max inflight bytes", p.max_inflight_bytes);
+    p.retry_after = conf.get<int>("retry after", p.retry_after);
+    return p;
+  }
+  /**
+   * @brief Limit the requests in flight of each priority class too
+   * @details Not thread-safe, set it before the first request
+   * @param _classes
+   */
+  void set_classes(priority_classes::ptr& _classes) { classes = _classes; }
+  /**
+   * @brief Limit the requests in flight with an adaptive limiter
+   * @details Not thread-safe, set it before the first request
+   * @param _limiter
+   */
+  void set_limiter(concurrency_limiter::ptr& _limiter) { limiter = _limiter; }
+  /**
+   * @brief Admit a request and push its tasks to the queue
+   * @details The tasks are pushed all or nothing, they have the priority
+   * class of the first one. Once admitted, the caller must call done() with
+   * the same bytes and class, and the latency since submit, when the
+   * response is ready
+   * @param q task queue
+   * @param first
+   * @param last
+   * @param bytes size of the request
+   * @return true if admitted
+   */
+  template <class It>
+  bool submit(object_detection_mq<single_bell>& q, It first, It last,
+              uint64_t bytes) {
+    const int c = first != last ? first->priority : 0;
+    // the cheapest check first, to reject fast
+    if (limiter && !limiter->acquire()) {
+      shed_limit.inc();
+      if (classes) classes->count_shed(c);
+      return false;
+    }
+    if (classes && !classes->enter(c)) {
+      if (limiter) limiter->release();
+      return false;
+    }
+    if (!reserve(bytes)) {
+      shed_bytes.inc();
+      leave_shed(c);
+      return false;
+    }
+    if (!q.try_push(first, last, param.max_queue_depth)) {
+      release(bytes);
+      shed_queue_full.inc();
+      leave_shed(c);
+      return false;
+    }
+    admitted.inc();
+    return true;
+  }
+  /**
+   * @brief Admit a request of one task
+   *
+   */
+  bool submit(object_detection_mq<single_bell>& q,
+              const obj_detection_msg<single_bell>& m, uint64_t bytes) {
+    return submit(q, &m, &m + 1, bytes);
+  }
+  /**
+   * @brief Admit a request of one task, moved to the queue if admitted
+   *
+   */
+  bool submit(object_detection_mq<single_bell>& q,
+              obj_detection_msg<single_bell>&& m, uint64_t bytes) {
+    return submit(q, std::make_move_iterator(&m),
+                  std::make_move_iterator(&m + 1), bytes);
+  }
+  /**
+   * @brief Whether a request would be admitted now, from its header
+   * @details Nothing is reserved, submit() still decides once the body is
+   * read. A request that would be shed is counted as shed: its body is
+   * never read
+   * @param q task queue
+   * @param bytes size of the request, e.g. its Content-Length
+   * @param priority class of the request
+   * @return true if the body is worth reading
+   */
+  bool admits(object_detection_mq<single_bell>& q, uint64_t bytes,
+              int priority) {
+    metrics::counter* reason = nullptr;
+    if (limiter && !limiter->has_room()) {
+      reason = &shed_limit;
+    } else if (param.max_inflight_bytes > 0 &&
+               inflight_bytes.load() + bytes > param.max_inflight_bytes) {
+      reason = &shed_bytes;
+    } else if (param.max_queue_depth > 0 &&
+               q.size() >= param.max_queue_depth) {
+      reason = &shed_queue_full;
+    } else if (!classes || classes->has_room(priority)) {
+      return true;
+    }
+    if (reason) reason->inc();
+    if (classes) classes->count_shed(priority);
+    return false;
+  }
+  /**
+   * @brief Release the bytes of an admitted request
+   *
+   * @param bytes
+   * @param priority class of the request
+   * @param latency since submit, a sample of the limiter
+   * @param status outcome of the request, only the ones done or expired are
+   * samples: the latency of a cancelled or failed one tells nothing of the
+   * queue
+   */
+  void done(uint64_t bytes, int priority, deadline_clock::duration latency,
+            request_status status) {
+    release(bytes);
+    if (classes) classes->leave(priority);
+    if (!limiter) return;
+    if (status == request_status::done || status == request_status::expired) {
+      limiter->release(latency, status == request_status::expired);
+    } else {
+      limiter->release();
+    }
+  }
+  /**
+   * @brief Retry hint of shed requests, in seconds
+   *
+   */
+  int retry_after() const { return param.retry_after; }
+
+  using ptr = std::shared_ptr<admission_control>;
+
+ private:
+  admission_param param;
+  std::atomic<uint64_t> inflight_bytes{0};  //!< bytes of admitted requests
+  metrics::counter& admitted;               //!< number of admitted requests
+  metrics::counter& shed_queue_full;        //!< shed, queue is full
+  metrics::counter& shed_bytes;             //!< shed, too many bytes
+  metrics::counter& shed_limit;             //!< shed, over concurrency limit
+  metrics::gauge& inflight;                 //!< exported inflight_bytes
+  priority_classes::ptr classes;            //!< priority classes, optional
+  concurrency_limiter::ptr limiter;         //!< adaptive limiter, optional
+  void leave_shed(int c) {
+    if (limiter) limiter->release();
+    if (!classes) return;
+    classes->leave(c);
+    classes->count_shed(c);
+  }
+  /**
+   * @brief Reserve bytes if they stay under the limit
+   *
+   */
+  bool reserve(uint64_t bytes) {
+    uint64_t cur = inflight_bytes.load();
+    do {
+      if (param.max_inflight_bytes > 0 &&
+          cur + bytes > param.max_inflight_bytes) {
+        return false;
+      }
+    } while (!inflight_bytes.compare_exchange_weak(cur, cur + bytes));
+    inflight.add(bytes);
+    return true;
+  }
+  void release(uint64_t bytes) {
+    inflight_bytes -= bytes;
+    inflight.add(-static_cast<int64_t>(bytes));
+  }
+};  // class admission_control
+
+}  // namespace worker
+}  // namespace st
@@ -0,0 +1,116 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the allocation accounting of the server.
+ * Built with ST_COUNT_ALLOCATIONS, the global operator new counts the
+ * allocations of each thread, and the stages of the request path report
+ * theirs as "alloc.{stage}" counters next to "alloc.requests", so the
+ * allocations per request of each stage are read from /metrics. Otherwise
+ * nothing is counted and the stages cost nothing.
+ * The hook replaces operator new, so with ST_COUNT_ALLOCATIONS this header
+ * must be part of a single translation unit, as the server is.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include "st_metrics.h"
+
+namespace st {
+namespace metrics {
+
+/**
+ * @brief Allocations of the calling thread so far
+ *
+ * @return uint64_t&
+ */
+inline uint64_t& thread_allocations() {
+  static thread_local uint64_t n = 0;
+  return n;
+}
+
+/**
+ * @brief Whether the allocations are counted, see ST_COUNT_ALLOCATIONS
+ *
+ */
+constexpr bool allocations_counted() {
+#if defined(ST_COUNT_ALLOCATIONS)
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Counter of the allocations of a stage, or null if they are not
+ * counted
+ *
+ * @param stage e.g. "http.read"
+ * @return counter*
+ */
+inline counter* alloc_counter(const std::string& stage) {
+  return allocations_counted()
+             ? &server_metrics().get_counter("alloc." + stage)
+             : nullptr;
+}
+
+/**
+ * @brief Counts the allocations of the calling thread in a scope
+ *
+ */
+class alloc_scope {
+ public:
+  explicit alloc_scope(counter* _stage)
+      : stage(_stage), start(thread_allocations()) {}
+  alloc_scope(const alloc_scope&) = delete;
+  alloc_scope& operator=(const alloc_scope&) = delete;
+  ~alloc_scope() {
+    if (stage) stage->inc(thread_allocations() - start);
+  }
+
+ private:
+  counter* stage;  //!< counter of the stage
+  uint64_t start;  //!< allocations when the scope began
+};
+
+/**
+ * @brief Counts the allocations of the calling thread between two reports
+ * @details For an event loop, whose handlers are not scoped one by one: a
+ * scope around each run_one() of asio would also count the memory that asio
+ * caches per run call, which run() keeps
+ */
+class alloc_meter {
+ public:
+  explicit alloc_meter(counter* _stage)
+      : stage(_stage), reported(thread_allocations()) {}
+  /**
+   * @brief Count the allocations since the last report
+   *
+   */
+  void report() {
+    if (!stage) return;
+    const uint64_t n = thread_allocations();
+    stage->inc(n - reported);
+    reported = n;
+  }
+
+ private:
+  counter* stage;     //!< counter of the stage
+  uint64_t reported;  //!< allocations at the last report
+};
+
+}  // namespace metrics
+}  // namespace st
+
+#if defined(ST_COUNT_ALLOCATIONS)
+void* operator new(std::size_t size) {
+  ++st::metrics::thread_allocations();
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#endif
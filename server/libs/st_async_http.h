@@ -0,0 +1,608 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the asynchronous HTTP front end. A few
+ * threads run all the sessions on an io_context; an inference request does
+ * not block a thread while it waits for the engine. The inference worker
+ * completes the message through its context, which posts the answer back to
+ * the strand of the session, where the response is written.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/strand.hpp>
+#include <boost/optional.hpp>
+#include "st_admission.h"
+#include "st_alloc.h"
+#include "st_cancel.h"
+#include "st_connection.h"
+#include "st_hedging.h"
+#include "st_http.h"
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_priority.h"
+#include "st_tenant.h"
+#include "st_tiling.h"
+#include "st_utils.h"
+#include "st_worker.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief What the HTTP sessions share
+ *
+ */
+struct http_context {
+  object_detection_mq<single_bell>::ptr taskq;  //!< task queue
+  admission_control::ptr admission;             //!< admission control
+  tiled_detector::ptr tiler;                    //!< tiled inference
+  request_hedger::ptr hedger;                   //!< hedging, optional
+  priority_classes::ptr classes;                //!< priority classes
+  tenant_table::ptr tenants;                    //!< tenants
+  http_param http;                              //!< parameters
+  connection_limit::ptr connections;  //!< open connections, of the listener
+};
+
+/**
+ * @brief A HTTP connection of the asynchronous front end
+ * @details All the handlers of a session run on its strand. While an
+ * inference is in flight, the session waits for the socket to become
+ * readable: if the client closed it, the message is cancelled. If the
+ * client sent its next request instead, the socket is polled on the timer
+ * of the session until the answer, as the blocking front end does
+ */
+class async_http_session
+    : public request_completion,
+      public std::enable_shared_from_this<async_http_session> {
+ public:
+  // the strand is not type-erased, its copies allocate nothing
+  using strand_type = net::strand<net::io_context::executor_type>;
+  using stream_type = beast::basic_stream<tcp, strand_type>;
+  using socket_type = stream_type::socket_type;
+  // the timeouts are not the ones of the stream, their handlers would
+  // allocate
+  using timer_type = net::basic_waitable_timer<
+      std::chrono::steady_clock,
+      net::wait_traits<std::chrono::steady_clock>, strand_type>;
+  async_http_session() = delete;
+  /**
+   * @brief Construct a new async http session object
+   *
+   * @param _sock connected socket, on a strand
+   * @param _srv
+   */
+  async_http_session(socket_type&& _sock, const http_context& _srv)
+      : stream(std::move(_sock)), timer(stream.get_executor()), srv(_srv) {
+    beast::error_code ec;
+    auto peer = stream.socket().remote_endpoint(ec);
+    if (!ec) client_ip = peer.address().to_string();
+  }
+  ~async_http_session() { srv.connections->leave(); }
+  /**
+   * @brief Start reading the requests
+   *
+   */
+  void run() {
+    // the handlers of the session must run on its strand
+    net::dispatch(stream.get_executor(), bind(&async_http_session::do_read));
+  }
+  /**
+   * @brief Answer of the inference worker, handed over to the strand
+   *
+   * @param state
+   */
+  void on_complete(int state) override {
+    net::post(stream.get_executor(), answer_handler{shared_from_this(), state});
+  }
+
+ private:
+  /**
+   * @brief Sends a response from the strand, C++11 equivalent of a generic
+   * lambda
+   *
+   */
+  struct sender_type {
+    async_http_session& self;
+    template <bool isRequest, class Body, class Fields>
+    void operator()(http::message<isRequest, Body, Fields>&& msg) const {
+      self.send(std::move(msg));
+    }
+  };
+  /**
+   * @brief Handler of an answer, allocated in the memory of the session
+   *
+   */
+  struct answer_handler {
+    std::shared_ptr<async_http_session> self;
+    int state;
+    using allocator_type = handler_allocator<answer_handler>;
+    allocator_type get_allocator() const {
+      return allocator_type(self->memory);
+    }
+    void operator()() { self->on_answer(state); }
+  };
+  /**
+   * @brief Handler of an operation, allocated in the memory of the session
+   *
+   */
+  template <class Handler>
+  struct session_handler {
+    Handler handler;
+    handler_memory& memory;
+    using allocator_type = handler_allocator<session_handler>;
+    allocator_type get_allocator() const { return allocator_type(memory); }
+    template <class... Args>
+    void operator()(Args&&... args) {
+      handler(std::forward<Args>(args)...);
+    }
+  };
+  /**
+   * @brief Bind a member to the session, in the memory of the session
+   *
+   */
+  template <class F, class... Args>
+  auto bind(F f, Args&&... args) -> session_handler<decltype(
+      beast::bind_front_handler(f, shared_from_this(), args...))> {
+    return {beast::bind_front_handler(f, shared_from_this(),
+                                      std::forward<Args>(args)...),
+            memory};
+  }
+  stream_type stream;          //!< the connection
+  timer_type timer;            //!< timeout of the current phase
+  http_context srv;            //!< shared objects of the server
+  std::string client_ip;       //!< address of the client
+  tenant_cache tenant;         //!< tenant of the requests
+  beast::flat_buffer buffer;   //!< read buffer
+  boost::optional<beast_request_parser> parser;  //!< parser of the request
+  beast_basic_request req;     //!< request being served
+  beast_basic_response res;    //!< response being written, reused
+  beast_empty_response interim;  //!< 100 Continue
+  std::shared_ptr<void> other; //!< other response being written
+  // the inference in flight
+  pool_ptr<detection_context> ctx;  //!< context of a single inference
+  tiled_detector::tiled_call::ptr call;  //!< call of a tiled inference
+  detection_result predictions;        //!< answer of the inference
+  uint64_t bytes = 0;                  //!< admitted bytes
+  handler_memory memory;               //!< memory of the handlers
+  int priority = 0;                    //!< class of the request
+  deadline_clock::time_point start;      //!< request handling began
+  deadline_clock::time_point submitted;  //!< admission time
+  bool pending = false;                  //!< an inference is in flight
+  bool unread = false;                   //!< a refused body is in the socket
+  bool timed_out = false;                //!< closed on a timeout
+  bool lingering = false;                //!< discarding a refused body
+
+  void do_read() {
+    // idle until the first bytes of the next request come
+    if (buffer.size() > 0) return read_header();
+    expire(srv.http.idle_timeout, connection_phase::idle);
+    stream.async_read_some(buffer.prepare(first_read),
+                           bind(&async_http_session::on_first_read));
+  }
+  void on_first_read(beast::error_code ec, std::size_t n) {
+    buffer.commit(n);
+    if (ec == net::error::eof) return do_close();
+    if (ec) return stop(ec, connection_phase::idle);
+    read_header();
+  }
+  void read_header() {
+    // a new parser for each request, its body comes from the pool
+    parser.emplace();
+    parser->body_limit(srv.http.body_limit);
+    expire(srv.http.header_timeout, connection_phase::header);
+    http::async_read_header(stream, buffer, *parser,
+                            bind(&async_http_session::on_header));
+  }
+  /**
+   * @brief The header is read, refuse the request or read its body
+   *
+   */
+  void on_header(beast::error_code ec, std::size_t) {
+    if (ec == http::error::end_of_stream) return do_close();
+    if (ec == http::error::body_limit) {
+      // Content-Length is over the limit
+      unread = true;
+      return send(body_too_large(parser->get()));
+    }
+    if (ec) return stop(ec, connection_phase::header);
+    sender_type sender{*this};
+    if (refuse_early(parser->get(), parser->content_length(), *srv.admission,
+                     *srv.taskq, *srv.classes, sender)) {
+      unread = true;
+      return;
+    }
+    if (!parser->is_done() && expects_continue(parser->get())) {
+      interim = {http::status::continue_, parser->get().version()};
+      expire(srv.http.write_timeout, connection_phase::write);
+      return http::async_write(stream, interim,
+                               bind(&async_http_session::on_continue));
+    }
+    read_body();
+  }
+  void on_continue(beast::error_code ec, std::size_t) {
+    if (ec) return stop(ec, connection_phase::write);
+    read_body();
+  }
+  void read_body() {
+    expire(srv.http.body_timeout, connection_phase::body);
+    http::async_read(stream, buffer, *parser,
+                     bind(&async_http_session::on_read));
+  }
+  void on_read(beast::error_code ec, std::size_t) {
+    if (ec == http::error::body_limit) {
+      // a chunked body over the limit
+      unread = true;
+      return send(body_too_large(parser->get()));
+    }
+    if (ec) return stop(ec, connection_phase::body);
+    // no timeout while the inference is in flight
+    disarm();
+    req = parser->release();
+    static metrics::counter* const requests =
+        metrics::alloc_counter("requests");
+    static metrics::counter* const stage =
+        metrics::alloc_counter("http.route");
+    // the handlers of the io thread since its previous request
+    static thread_local metrics::alloc_meter io{
+        metrics::alloc_counter("http.io")};
+    io.report();
+    if (requests) requests->inc();
+    metrics::alloc_scope counted{stage};
+    sender_type sender{*this};
+    const auto route = route_request(req, *srv.classes, priority, sender);
+    if (route == inference_route::none) return;
+    start = deadline_clock::now();
+    if (route == inference_route::tiled) return submit_tiled();
+    submit();
+  }
+  /**
+   * @brief A message of the request, without bell
+   *
+   */
+  obj_detection_msg<single_bell> make_message() {
+    obj_detection_msg<single_bell> m;
+    m.data = req.body().data();
+    m.size = req.body().size();
+    m.deadline = request_deadline(req.base()["x-request-deadline"]);
+    m.priority = priority;
+    m.tenant = tenant.identify(*srv.tenants, req.base()["x-api-key"],
+                               client_ip);
+    return m;
+  }
+  void submit() {
+    auto m = make_message();
+    m.make_claimable();
+    if (srv.hedger) {
+      // the copies share the body, handed over to the context as is
+      req.body().hand_over(m.context->data);
+      m.data = m.context->data.data();
+      srv.hedger->prepare(m);
+    }
+    // the context answers the session, and keeps it alive until then
+    ctx = m.context;
+    ctx->completion = this;
+    ctx->keep = shared_from_this();
+    m.predictions = &ctx->predictions;
+    m.json_body = true;
+    bytes = m.size;
+    http_log->debug("Enqueue my task, current queue size {}",
+                    srv.taskq->size());
+    submitted = deadline_clock::now();
+    const bool hedged = static_cast<bool>(srv.hedger);
+    const auto watched = hedged ? m : obj_detection_msg<single_bell>{};
+    if (!srv.admission->submit(*srv.taskq, std::move(m), bytes)) {
+      ctx = nullptr;
+      return respond(request_status::shed);
+    }
+    if (hedged) srv.hedger->watch(watched);
+    pending = true;
+    watch_client();
+  }
+  void submit_tiled() {
+    auto self = shared_from_this();
+    auto request = make_message();
+    pending = true;
+    call = srv.tiler->submit(request, [self](request_status status) {
+      net::post(self->stream.get_executor(),
+                [self, status]() { self->on_tiled(status); });
+    });
+    if (call) watch_client();
+  }
+  /**
+   * @brief Wait for the client to close the socket while the inference is
+   * in flight
+   *
+   */
+  void watch_client() {
+    stream.socket().async_wait(tcp::socket::wait_read,
+                               bind(&async_http_session::on_readable));
+  }
+  void on_readable(beast::error_code ec) {
+    if (ec || !pending) return;
+    // readable but open: the next request came early, it waits in the
+    // socket until the answer is written. Waiting again would return at
+    // once, the socket is polled instead
+    if (!socket_closed(stream.socket().native_handle())) return poll_client();
+    cancel_inference();
+  }
+  /**
+   * @brief Look at the socket again after a while, on the session timer
+   * @details The timer is free: there is no timeout while the inference is
+   * in flight, and the response sets it again
+   */
+  void poll_client() {
+    timer.expires_after(cancel_poll_interval);
+    timer.async_wait(bind(&async_http_session::on_poll));
+  }
+  void on_poll(beast::error_code ec) {
+    // cancelled, or the timer was set again since
+    if (ec || !pending || timer.expiry() > std::chrono::steady_clock::now()) {
+      return;
+    }
+    if (!socket_closed(stream.socket().native_handle())) return poll_client();
+    cancel_inference();
+  }
+  /**
+   * @brief The client went away, the inference in flight is cancelled
+   *
+   */
+  void cancel_inference() {
+    http_log->debug("Client went away, cancel the request");
+    if (call) {
+      // the tiled call completes once its tiles are cancelled
+      call->cancel();
+    } else if (ctx->cancel()) {
+      // no worker will answer it anymore
+      on_answer(msg_cancelled);
+    }
+  }
+  void on_answer(int state) {
+    if (!pending) return;
+    const auto status = answer_status(state);
+    const auto latency = deadline_clock::now() - submitted;
+    srv.admission->done(bytes, priority, latency, status);
+    if (srv.hedger && status == request_status::done) {
+      srv.hedger->record_latency(latency);
+    }
+    if (status == request_status::done) predictions.swap(ctx->predictions);
+    // the context holds the session, drop it
+    ctx = nullptr;
+    respond(status);
+  }
+  void on_tiled(request_status status) {
+    if (!pending) return;
+    if (status == request_status::done && call) {
+      srv.tiler->result(*call, predictions);
+    }
+    call.reset();
+    respond(status);
+  }
+  /**
+   * @brief Answer the inference request
+   *
+   */
+  void respond(request_status status) {
+    static metrics::counter* const stage =
+        metrics::alloc_counter("http.respond");
+    metrics::alloc_scope counted{stage};
+    pending = false;
+    beast::error_code ec;
+    stream.socket().cancel(ec);  // stop watching the client
+    if (status == request_status::cancelled) return do_close();
+    std::string body;
+    if (status == request_status::done) {
+      srv.classes->record(priority,
+                          std::chrono::duration_cast<std::chrono::microseconds>(
+                              deadline_clock::now() - start)
+                              .count());
+      body = predictions_body(predictions);
+    }
+    sender_type sender{*this};
+    respond_inference(req, status, std::move(body),
+                      srv.admission->retry_after(), sender);
+  }
+  void send(beast_basic_response&& m) {
+    res = std::move(m);
+    expire(srv.http.write_timeout, connection_phase::write);
+    http::async_write(stream, res,
+                      bind(&async_http_session::on_write, res.need_eof()));
+  }
+  template <bool isRequest, class Body, class Fields>
+  void send(http::message<isRequest, Body, Fields>&& m) {
+    // the response must live until it's written
+    auto sp = std::make_shared<http::message<isRequest, Body, Fields>>(
+        std::move(m));
+    other = sp;
+    expire(srv.http.write_timeout, connection_phase::write);
+    http::async_write(stream, *sp,
+                      bind(&async_http_session::on_write, sp->need_eof()));
+  }
+  void on_write(bool close, beast::error_code ec, std::size_t) {
+    if (ec) return stop(ec, connection_phase::write);
+    disarm();
+    other = nullptr;
+    // the body goes back to the engine with the next inference
+    predictions.json.swap(res.body());
+    predictions.json.clear();
+    if (close) return do_close();
+    do_read();
+  }
+  void do_close() {
+    disarm();
+    beast::error_code ec;
+    stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+    if (unread) do_linger();
+  }
+  /**
+   * @brief Discard the refused body for a while before closing
+   * @details Closed with unread bytes, the socket would be reset, and the
+   * client might lose the response before reading it
+   */
+  void do_linger() {
+    unread = false;
+    lingering = true;
+    buffer.clear();
+    // the timer closes the socket, which ends the reads
+    expire(1, connection_phase::body);
+    on_linger({}, 0);
+  }
+  void on_linger(beast::error_code ec, std::size_t) {
+    if (ec) return;
+    buffer.clear();
+    stream.async_read_some(buffer.prepare(linger_read),
+                           bind(&async_http_session::on_linger));
+  }
+  /**
+   * @brief Set the timeout of a phase of the connection
+   * @details Past it, the socket is closed and the pending operation fails
+   * @param seconds 0 = none
+   * @param phase
+   */
+  void expire(int seconds, connection_phase phase) {
+    if (seconds <= 0) return disarm();
+    timer.expires_after(std::chrono::seconds(seconds));
+    timer.async_wait(bind(&async_http_session::on_timeout, phase));
+  }
+  /**
+   * @brief No timeout, the waiting handler lets the session go
+   *
+   */
+  void disarm() {
+    timer.expires_at(std::chrono::steady_clock::time_point::max());
+  }
+  void on_timeout(connection_phase phase, beast::error_code ec) {
+    // cancelled, or the timer was set again since
+    if (ec || timer.expiry() > std::chrono::steady_clock::now()) return;
+    // the end of a linger is no timeout of the client
+    if (!lingering) {
+      http_log->debug("Timeout, close the connection of {}", client_ip);
+      srv.connections->reap(phase);
+    }
+    timed_out = true;
+    stream.socket().close(ec);
+  }
+  /**
+   * @brief An operation failed, the session ends
+   *
+   * @param ec
+   * @param phase of the connection
+   */
+  void stop(beast::error_code ec, connection_phase phase) {
+    disarm();
+    // the socket was closed on a timeout
+    if (timed_out) return;
+    fail(ec, phase == connection_phase::write ? "write" : "read");
+  }
+  static constexpr size_t linger_read = 65536;  //!< bytes per read
+  static constexpr size_t first_read = 1024;    //!< bytes read when idle
+};  // class async_http_session
+
+/**
+ * @brief listening worker of the asynchronous front end
+ * @details Accepts the connections and runs all the sessions on a pool of
+ * threads
+ */
+class async_listen_worker : public sync_worker {
+ public:
+  async_listen_worker() = delete;
+  /**
+   * @brief Construct a new async listen worker object
+   *
+   * @param _ctx
+   * @param _threads threads of the io_context, 0 = one per core
+   */
+  async_listen_worker(const http_context& _ctx, int _threads = 0)
+      : ctx(_ctx),
+        threads(_threads > 0
+                    ? _threads
+                    : std::max(1u, std::thread::hardware_concurrency())) {
+    if (!ctx.connections) {
+      ctx.connections =
+          std::make_shared<connection_limit>(ctx.http.max_connections);
+    }
+  }
+  /**
+   * @brief Destroy the async listen worker object
+   *
+   */
+  ~async_listen_worker() {}
+  // sync worker public interface implementation
+  void operator()() final {
+    pthread_setname_np(pthread_self(), "listen worker");
+    http_log->warn("No IP and address is provide");
+    http_log->warn("Use defaul address 0.0.0.0 and default port 8080");
+    listen("0.0.0.0", "8080");
+  }
+  /**
+   * @brief additional public interface
+   *
+   * @param ip
+   * @param port
+   */
+  void operator()(std::string& ip, std::string& port) {
+    pthread_setname_np(pthread_self(), "listen worker");
+    listen(ip.c_str(), port.c_str());
+  }
+
+ private:
+  http_context ctx;  //!< shared objects of the sessions
+  int threads;       //!< threads of the io_context
+  /**
+   * @brief Accept the connections, forever
+   *
+   * @param ioc
+   * @param acceptor
+   */
+  void do_accept(net::io_context& ioc, tcp::acceptor& acceptor) {
+    // each session gets its own strand
+    acceptor.async_accept(
+        net::make_strand(ioc.get_executor()),
+        [this, &ioc, &acceptor](beast::error_code ec,
+                                async_http_session::socket_type sock) {
+          if (ec) {
+            fail(ec, "accept");
+          } else if (!ctx.connections->enter()) {
+            // over the maximum, closed right away
+            http_log->debug("Too many connections, refuse a client");
+            sock.close(ec);
+          } else {
+            http_log->info("New client: {}",
+                           sock.remote_endpoint(ec).address().to_string());
+            std::make_shared<async_http_session>(std::move(sock), ctx)->run();
+          }
+          do_accept(ioc, acceptor);
+        });
+  }
+  void listen(const char* ip, const char* p) {
+    auto const address = net::ip::make_address(ip);
+    auto const port = static_cast<unsigned short>(std::stoi(p));
+    net::io_context ioc{threads};
+    http_log->info("Start accepting on {}:{} with {} threads", ip, p,
+                   threads);
+    tcp::acceptor acceptor{ioc, {address, port}};
+    do_accept(ioc, acceptor);
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; ++i) {
+      pool.emplace_back([&ioc]() {
+        pthread_setname_np(pthread_self(), "http worker");
+        ioc.run();
+      });
+    }
+    ioc.run();
+    for (auto& t : pool) t.join();
+  }
+};  // class async_listen_worker
+
+}  // namespace worker
+}  // namespace st
@@ -0,0 +1,91 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the cancellation of the requests whose client
+ * went away, e.g. it timed out and closed its socket, or cancelled its gRPC
+ * call. While waiting for the answer, the request thread polls the client;
+ * once it's gone the thread cancels the message, so the inference workers
+ * skip it instead of decoding and inferring an image nobody waits for.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include "st_ie_common.h"
+#include "st_message_queue.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::ie;
+
+/**
+ * @brief Test whether the client of a request went away
+ *
+ */
+using client_probe = std::function<bool()>;
+
+/**
+ * @brief Interval of the probes of the client while waiting for an answer
+ *
+ */
+constexpr std::chrono::milliseconds cancel_poll_interval{50};
+
+/**
+ * @brief The peer of a connected socket closed or reset the connection
+ * @details Only looks at the socket, without consuming any byte, e.g. of a
+ * pipelined request
+ * @param fd
+ * @return true if the peer is gone
+ */
+inline bool socket_closed(int fd) {
+  pollfd p{fd, POLLIN | POLLRDHUP, 0};
+  if (poll(&p, 1, 0) <= 0) return false;
+  if (p.revents & (POLLERR | POLLHUP | POLLRDHUP)) return true;
+  char c;
+  const auto n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR);
+}
+
+/**
+ * @brief Wait for the answer of a submitted message, cancel it if the client
+ * goes away
+ * @details The message must be claimable, see make_claimable(). If a worker
+ * already started the message, the answer is on its way and is waited for
+ * @param m
+ * @param gone probe of the client, optional
+ * @param timeout give up waiting after it, then the message is still queued
+ * @return int msg_done, msg_expired, msg_cancelled, msg_failed, or 0 on
+ * timeout
+ */
+inline int wait_answer(
+    obj_detection_msg<single_bell>& m, const client_probe& gone,
+    deadline_clock::duration timeout = deadline_clock::duration::max()) {
+  if (!gone && timeout == deadline_clock::duration::max()) {
+    return m.bell->wait_any();
+  }
+  const auto until = timeout == deadline_clock::duration::max()
+                         ? deadline_clock::time_point::max()
+                         : deadline_clock::now() + timeout;
+  for (;;) {
+    const auto now = deadline_clock::now();
+    if (now >= until) return 0;
+    auto slice = until - now;
+    if (gone && slice > cancel_poll_interval) slice = cancel_poll_interval;
+    const int state = m.bell->wait_any_for(slice);
+    if (state != 0) return state;
+    if (gone && gone()) {
+      if (m.cancel()) return msg_cancelled;
+      // a worker is answering, it won't be long
+      return m.bell->wait_any();
+    }
+  }
+}
+
+}  // namespace worker
+}  // namespace st
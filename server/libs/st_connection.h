@@ -0,0 +1,198 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the limits of the HTTP connections. A front
+ * end keeps a maximum number of connections open, the ones over it are
+ * closed as soon as they are accepted; and a session gives up on a client
+ * that is idle for too long between requests, or too slow to send a request
+ * or to read a response, so that such clients hold no thread or socket
+ * forever. The closed connections are counted in the metrics.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <poll.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include "st_logging.h"
+#include "st_metrics.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::log;
+
+/**
+ * @brief Phase of a connection, each one has its timeout
+ *
+ */
+enum class connection_phase {
+  idle,    //!< waiting for the next request
+  header,  //!< reading the header of a request
+  body,    //!< reading the body of a request
+  write    //!< writing a response
+};
+
+/**
+ * @brief Open connections of a front end, up to a maximum
+ * @details Thread-safe, shared by the listener and the sessions
+ */
+class connection_limit {
+ public:
+  using ptr = std::shared_ptr<connection_limit>;
+  /**
+   * @brief Construct a new connection limit object
+   *
+   * @param _max maximum number of open connections, 0 = unlimited
+   */
+  explicit connection_limit(int _max)
+      : max(_max),
+        open(metrics::server_metrics().get_gauge("connection.open")),
+        accepted(metrics::server_metrics().get_counter("connection.accepted")),
+        refused(metrics::server_metrics().get_counter("connection.refused")),
+        reaped{&metrics::server_metrics().get_counter("connection.reaped.idle"),
+               &metrics::server_metrics().get_counter(
+                   "connection.reaped.header"),
+               &metrics::server_metrics().get_counter("connection.reaped.body"),
+               &metrics::server_metrics().get_counter(
+                   "connection.reaped.write")} {}
+  /**
+   * @brief A connection is accepted, it's kept if there is room for it
+   *
+   * @return true if kept, leave() once it's closed
+   */
+  bool enter() {
+    if (count.fetch_add(1) >= max && max > 0) {
+      count.fetch_sub(1);
+      refused.inc();
+      return false;
+    }
+    accepted.inc();
+    open.add(1);
+    return true;
+  }
+  /**
+   * @brief A connection that entered is closed
+   *
+   */
+  void leave() {
+    count.fetch_sub(1);
+    open.add(-1);
+  }
+  /**
+   * @brief A connection is closed on a timeout
+   *
+   * @param phase
+   */
+  void reap(connection_phase phase) {
+    reaped[static_cast<int>(phase)]->inc();
+  }
+
+ private:
+  const int max;                 //!< maximum open connections, 0 = unlimited
+  std::atomic<int> count{0};     //!< open connections
+  metrics::gauge& open;          //!< open connections, exported
+  metrics::counter& accepted;    //!< connections kept
+  metrics::counter& refused;     //!< connections over the maximum
+  metrics::counter* reaped[4];   //!< timed out connections, by phase
+};
+
+/**
+ * @brief Blocking stream of a socket, with a deadline
+ * @details The blocking reads and writes of asio ignore the timeouts of the
+ * socket, so the socket is made non-blocking and each operation polls it up
+ * to the deadline; past it, the operation fails with beast::error::timeout.
+ * A SyncReadStream and SyncWriteStream, for http::read and http::write
+ */
+class timed_socket {
+ public:
+  /**
+   * @brief Construct a new timed socket object
+   *
+   * @param _sock connected socket, made non-blocking
+   */
+  explicit timed_socket(tcp::socket& _sock) : sock(_sock) {
+    beast::error_code ec;
+    sock.non_blocking(true, ec);
+  }
+  /**
+   * @brief Set the deadline of the next operations
+   *
+   * @param seconds from now, 0 = none
+   */
+  void expires_after(int seconds) {
+    until = seconds > 0 ? clock::now() + std::chrono::seconds(seconds)
+                        : clock::time_point::max();
+  }
+  template <class MutableBufferSequence>
+  size_t read_some(const MutableBufferSequence& buffers,
+                   beast::error_code& ec) {
+    for (;;) {
+      const size_t n = sock.read_some(buffers, ec);
+      if (ec != net::error::would_block) return n;
+      if (!wait(POLLIN, ec)) return 0;
+    }
+  }
+  template <class MutableBufferSequence>
+  size_t read_some(const MutableBufferSequence& buffers) {
+    beast::error_code ec;
+    const size_t n = read_some(buffers, ec);
+    if (ec) BOOST_THROW_EXCEPTION(beast::system_error{ec});
+    return n;
+  }
+  template <class ConstBufferSequence>
+  size_t write_some(const ConstBufferSequence& buffers,
+                    beast::error_code& ec) {
+    for (;;) {
+      const size_t n = sock.write_some(buffers, ec);
+      if (ec != net::error::would_block) return n;
+      if (!wait(POLLOUT, ec)) return 0;
+    }
+  }
+  template <class ConstBufferSequence>
+  size_t write_some(const ConstBufferSequence& buffers) {
+    beast::error_code ec;
+    const size_t n = write_some(buffers, ec);
+    if (ec) BOOST_THROW_EXCEPTION(beast::system_error{ec});
+    return n;
+  }
+
+ private:
+  using clock = std::chrono::steady_clock;
+  tcp::socket& sock;                             //!< the connection
+  clock::time_point until = clock::time_point::max();  //!< the deadline
+  /**
+   * @brief Wait until the socket is ready, up to the deadline
+   *
+   * @param events POLLIN or POLLOUT
+   * @param ec timeout, or the error of poll
+   * @return true if ready
+   */
+  bool wait(short events, beast::error_code& ec) {
+    pollfd p{sock.native_handle(), events, 0};
+    for (;;) {
+      int timeout = -1;
+      if (until != clock::time_point::max()) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              until - clock::now())
+                              .count();
+        timeout = left > 0 ? static_cast<int>(left) : 0;
+      }
+      const int n = poll(&p, 1, timeout);
+      if (n > 0) return true;
+      if (n == 0) {
+        ec = beast::error::timeout;
+        return false;
+      }
+      if (errno != EINTR) {
+        ec.assign(errno, beast::system_category());
+        return false;
+      }
+    }
+  }
+};
+
+}  // namespace worker
+}  // namespace st
@@ -5,15 +5,23 @@
  * stubs/inference_rpc.proto
  ***************************************************************************************/
 
+#include <atomic>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include "stubs/inference_rpc.grpc.pb.h"
 #include "stubs/inference_rpc.pb.h"
 #include "st_utils.h"
+#include "st_admission.h"
+#include "st_cancel.h"
+#include "st_hedging.h"
+#include "st_priority.h"
+#include "st_tenant.h"
 #include "st_ie_common.h" 
+#include "st_tiling.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -31,46 +39,211 @@ namespace st {
 namespace rpc {
 /**
  * @brief service implementation
- * 
+ * @details Callback service: a call does not hold a gRPC thread while it
+ * waits for the engine, the inference worker finishes it by continuation
  */
-class inference_rpc_impl final : public inference_rpc::Service {
+class inference_rpc_impl final : public inference_rpc::CallbackService {
   public:
-    inference_rpc_impl(object_detection_mq<single_bell>::ptr& _taskq) : 
-      inference_rpc::Service() , taskq(_taskq) {
-        bell = std::make_shared<single_bell>();
-      };
-    virtual Status run_detection(ServerContext* context, const encoded_image* request, detection_output* response) override {
-      auto data = request->data().c_str();
-      int sz = request->size();
-      std::vector<bbox> prediction;
-      obj_detection_msg<single_bell> m{data, sz, &prediction, bell};
-      rpc_log->debug("Enqueue my task, current queue size {}",
-              taskq->size());
-      taskq->push(m);
-      rpc_log->debug("Waiting for inference engine");
-      bell->wait(1);
-      rpc_log->debug("Received data");
+    inference_rpc_impl(object_detection_mq<single_bell>::ptr& _taskq,
+                       admission_control::ptr& _admission,
+                       tiled_detector::ptr& _tiler,
+                       request_hedger::ptr& _hedger,
+                       priority_classes::ptr& _classes,
+                       tenant_table::ptr& _tenants) : 
+      inference_rpc::CallbackService() , taskq(_taskq), admission(_admission),
+      tiler(_tiler), hedger(_hedger), classes(_classes), tenants(_tenants) {};
+    virtual grpc::ServerUnaryReactor* run_detection(grpc::CallbackServerContext* context, const encoded_image* request, detection_output* response) override {
+      auto call = new detection_reactor(*this, context, response);
+      call->start(request);
+      return call;
+    }
+    virtual grpc::ServerUnaryReactor* run_tiled_detection(grpc::CallbackServerContext* context, const encoded_image* request, detection_output* response) override {
+      auto call = new detection_reactor(*this, context, response);
+      call->start_tiled(request);
+      return call;
+    }
+  private:
+    /**
+     * @brief A detection call in flight
+     * @details Finished once both the handler returned and the answer came,
+     * deletes itself when gRPC is done with it
+     */
+    class detection_reactor : public grpc::ServerUnaryReactor,
+                              public request_completion {
+      public:
+        detection_reactor(inference_rpc_impl& _service,
+                          grpc::CallbackServerContext* _context,
+                          detection_output* _response)
+            : service(_service), context(_context), response(_response),
+              start_time(deadline_clock::now()) {}
+        void start(const encoded_image* request) {
+          m.data = request->data().c_str();
+          m.size = request->size();
+          m.deadline = to_deadline(context->deadline());
+          m.priority = service.request_priority(context);
+          m.tenant = service.request_tenant(context);
+          if (service.hedger) service.hedger->prepare(m);
+          m.make_claimable();
+          m.context->completion = this;
+          m.predictions = &m.context->predictions;
+          rpc_log->debug("Enqueue my task, current queue size {}",
+                         service.taskq->size());
+          // the answer may come before the handler returns, see release()
+          submitted = deadline_clock::now();
+          if (!service.admission->submit(*service.taskq, m, m.size)) {
+            // never queued, nothing to cancel nor to give back
+            m.context = nullptr;
+            status = request_status::shed;
+            release();
+          } else {
+            admitted.store(true);
+            if (service.hedger) service.hedger->watch(m);
+          }
+          release();
+        }
+        void start_tiled(const encoded_image* request) {
+          m.data = request->data().c_str();
+          m.size = request->size();
+          m.deadline = to_deadline(context->deadline());
+          m.priority = service.request_priority(context);
+          m.tenant = service.request_tenant(context);
+          call = service.tiler->submit(m, [this](request_status s) {
+            status = s;
+            release();
+          });
+          release();
+        }
+        void OnCancel() override {
+          if (call) {
+            call->cancel();
+          } else if (admitted.load() && m.cancel()) {
+            // no worker will answer it anymore
+            on_answer(msg_cancelled);
+          }
+        }
+        void OnDone() override { delete this; }
+        void on_complete(int state) override { on_answer(state); }
+      private:
+        inference_rpc_impl& service;
+        grpc::CallbackServerContext* context;
+        detection_output* response;
+        deadline_clock::time_point start_time;
+        deadline_clock::time_point submitted;
+        obj_detection_msg<single_bell> m;  //!< copy of the queued message
+        tiled_detector::tiled_call::ptr call;
+        request_status status = request_status::done;
+        std::atomic<int> holds{2};  //!< the handler and the answer
+        std::atomic<bool> admitted{false};  //!< queued, its answer is due
+        void on_answer(int state) {
+          status = answer_status(state);
+          const auto latency = deadline_clock::now() - submitted;
+          service.admission->done(m.size, m.priority, latency, status);
+          if (service.hedger && status == request_status::done) {
+            service.hedger->record_latency(latency);
+          }
+          release();
+        }
+        void release() {
+          if (holds.fetch_sub(1) != 1) return;
+          if (status == request_status::shed) {
+            return Finish(service.overloaded(context));
+          }
+          if (status == request_status::cancelled) {
+            return Finish(service.cancelled());
+          }
+          if (status == request_status::expired) {
+            return Finish(service.expired());
+          }
+          if (status == request_status::failed) {
+            return Finish(service.failed());
+          }
+          service.record_latency(m.priority, start_time);
+          rpc_log->debug("Received data");
+          if (call) {
+            detection_result prediction;
+            service.tiler->result(*call, prediction);
+            service.write_response(prediction, response);
+          } else {
+            service.write_response(m.context->predictions, response);
+          }
+          Finish(Status::OK);
+        }
+    };
+  private:
+  object_detection_mq<single_bell>::ptr taskq;
+  admission_control::ptr admission;
+  tiled_detector::ptr tiler;
+  request_hedger::ptr hedger;
+  priority_classes::ptr classes;
+  tenant_table::ptr tenants;
+    /**
+     * @brief Priority class of a call, from its x-priority metadata
+     * 
+     */
+    int request_priority(grpc::CallbackServerContext* context) {
+      const auto& metadata = context->client_metadata();
+      auto it = metadata.find("x-priority");
+      if (it == metadata.end()) return classes->classify("");
+      return classes->classify(
+          beast::string_view(it->second.data(), it->second.size()));
+    }
+    /**
+     * @brief Tenant of a call, from its x-api-key metadata or its peer
+     * 
+     */
+    int request_tenant(grpc::CallbackServerContext* context) {
+      const auto& metadata = context->client_metadata();
+      auto it = metadata.find("x-api-key");
+      beast::string_view api_key;
+      if (it != metadata.end()) {
+        api_key = beast::string_view(it->second.data(), it->second.size());
+      }
+      return tenants->identify(api_key,
+                               tenant_table::peer_address(context->peer()));
+    }
+    void record_latency(int priority, deadline_clock::time_point start) {
+      classes->record(priority,
+                      std::chrono::duration_cast<std::chrono::microseconds>(
+                          deadline_clock::now() - start)
+                          .count());
+    }
+    Status overloaded(grpc::CallbackServerContext* context) {
+      rpc_log->debug("Server is overloaded, shed the request");
+      context->AddTrailingMetadata("retry-after",
+                                   std::to_string(admission->retry_after()));
+      return Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                    "Server is overloaded");
+    }
+    Status cancelled() {
+      rpc_log->debug("Call cancelled, drop the request");
+      return Status(grpc::StatusCode::CANCELLED, "Cancelled");
+    }
+    Status expired() {
+      rpc_log->debug("Deadline exceeded, drop the request");
+      return Status(grpc::StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+    }
+    Status failed() {
+      rpc_log->debug("Inference failed, drop the request");
+      return Status(grpc::StatusCode::INTERNAL, "Inference failed");
+    }
+    void write_response(const detection_result& prediction,
+                        detection_output* response) {
       int n = prediction.size();
       for (int i = 0; i < n; ++i) {
-        bbox& pred = prediction[i];
         auto rpc_bbox = response->add_bboxes();
-        rpc_bbox->set_label_id(pred.label_id);
-        rpc_bbox->set_label(pred.label);
-        rpc_bbox->set_prob(pred.prop);
-        if (pred.c[3]) {
+        rpc_bbox->set_label_id(prediction.label_id[i]);
+        rpc_bbox->set_label(prediction.label(i));
+        rpc_bbox->set_prob(prediction.score[i]);
+        if (prediction.has_box(i)) {
           st::rpc::detection_output_rectangle *rec = new st::rpc::detection_output_rectangle();
-          rec->set_xmin(pred.c[0]);
-          rec->set_ymin(pred.c[1]);
-          rec->set_xmax(pred.c[2]);
-          rec->set_ymax(pred.c[3]);
+          rec->set_xmin(prediction.x1[i]);
+          rec->set_ymin(prediction.y1[i]);
+          rec->set_xmax(prediction.x2[i]);
+          rec->set_ymax(prediction.y2[i]);
           rpc_bbox->set_allocated_box(rec);
         }
       }
-      return Status::OK;
     }
-  private:
-  object_detection_mq<single_bell>::ptr taskq;
-  single_bell::ptr bell;
 }; // class inference_rpc_impl
 
 /**
@@ -79,8 +252,14 @@ class inference_rpc_impl final : public inference_rpc::Service {
  */
 class rpc_listen_worker {
   public:
-    rpc_listen_worker(object_detection_mq<single_bell>::ptr& _taskq)
-        : taskq(_taskq) {}
+    rpc_listen_worker(object_detection_mq<single_bell>::ptr& _taskq,
+                      admission_control::ptr& _admission,
+                      tiled_detector::ptr& _tiler,
+                      request_hedger::ptr& _hedger,
+                      priority_classes::ptr& _classes,
+                      tenant_table::ptr& _tenants)
+        : taskq(_taskq), admission(_admission), tiler(_tiler),
+          hedger(_hedger), classes(_classes), tenants(_tenants) {}
     ~rpc_listen_worker() {}
     void operator()() {
       pthread_setname_np(pthread_self(), "rpc listener");
@@ -94,11 +273,17 @@ class rpc_listen_worker {
     }
   private:
     object_detection_mq<single_bell>::ptr taskq;
+    admission_control::ptr admission;
+    tiled_detector::ptr tiler;
+    request_hedger::ptr hedger;
+    priority_classes::ptr classes;
+    tenant_table::ptr tenants;
     void listen(const char* ip, const char* p) {
       std::string address(ip);
       std::string port(p);
       std::string binding = address + ":" + port;
-      inference_rpc_impl service(taskq);
+      inference_rpc_impl service(taskq, admission, tiler, hedger, classes,
+                                 tenants);
       grpc::EnableDefaultHealthCheckService(true);
       grpc::reflection::InitProtoReflectionServerBuilderPlugin();
       ServerBuilder builder;
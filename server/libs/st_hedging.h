@@ -0,0 +1,271 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the hedged requests. When a request is still
+ * waiting after the recent p95 latency, e.g. its engine stalls on a
+ * pathological image, a copy is sent to an idle engine and the first answer
+ * wins. The other copy is skipped if it has not started yet, otherwise its
+ * result is discarded. A budget caps the extra work of the copies.
+ * The losing copy may still run after the request is answered, so hedged
+ * messages own a copy of the encoded image instead of pointing to the
+ * buffer of the request.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "st_cancel.h"
+#include "st_ie_common.h"
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_metrics.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief Parameters of the hedged requests
+ *
+ */
+struct hedging_param {
+  double percentile = 95;  //!< hedge after this percentile of the latency
+  double budget = 0.05;    //!< maximum copies per request
+  int window = 1000;       //!< number of recent latencies of the percentile
+  int min_samples = 100;   //!< no hedging before that many latencies
+};
+
+/**
+ * @brief Hedging of the requests of one model
+ * @details Thread-safe, one object is shared by all request threads. The
+ * budget is a token bucket: each request earns `budget` of a copy, a copy
+ * spends one, and at most a few copies can be saved for a burst
+ */
+class request_hedger {
+ public:
+  request_hedger() = delete;
+  /**
+   * @brief Construct a new request hedger object
+   *
+   * @param _taskq
+   * @param _param
+   */
+  request_hedger(object_detection_mq<single_bell>::ptr& _taskq,
+                 const hedging_param& _param)
+      : taskq(_taskq),
+        param(_param),
+        hedged(metrics::server_metrics().get_counter("hedging.hedged")),
+        over_budget(
+            metrics::server_metrics().get_counter("hedging.over budget")),
+        no_idle(metrics::server_metrics().get_counter(
+            "hedging.no idle engine")),
+        threshold(metrics::server_metrics().get_gauge("hedging.threshold us")) {
+    latencies.reserve(std::max(param.window, 1));
+    std::thread{[this]() { run_timers(); }}.detach();
+  }
+  /**
+   * @brief Read the parameters from the "hedging" node of the configuration
+   *
+   * @param conf
+   * @return hedging_param
+   */
+  static hedging_param read_param(const JSON& conf) {
+    hedging_param p;
+    p.percentile = conf.get<double>("percentile", p.percentile);
+    p.budget = conf.get<double>("budget", p.budget);
+    p.window = conf.get<int>("window", p.window);
+    p.min_samples = conf.get<int>("min samples", p.min_samples);
+    return p;
+  }
+  /**
+   * @brief Make a message hedgeable, before it is submitted
+   * @details The copies share the context of the message, with the image
+   * data, which live as long as one copy does. The data is copied unless
+   * the producer handed it over to the context already
+   * @param m
+   */
+  void prepare(obj_detection_msg<single_bell>& m) {
+    m.make_claimable();
+    if (m.data != m.context->data.data()) {
+      m.context->data.assign(m.data, m.size);
+      m.data = m.context->data.data();
+    }
+    earn();
+  }
+  /**
+   * @brief Wait for the answer of a submitted message, hedge it if it's late
+   *
+   * @param m the message, as submitted
+   * @param gone probe of the client, the copies are cancelled once it's gone
+   * @return int a msg_state
+   */
+  int wait(obj_detection_msg<single_bell>& m, const client_probe& gone) {
+    const auto start = deadline_clock::now();
+    const int64_t after_us = threshold.get();
+    int state = 0;
+    if (after_us > 0) {
+      state = wait_answer(m, gone, std::chrono::microseconds(after_us));
+      if (state == 0) hedge(m);
+    }
+    if (state == 0) state = wait_answer(m, gone);
+    if (state == msg_done) {
+      record(std::chrono::duration_cast<std::chrono::microseconds>(
+                 deadline_clock::now() - start)
+                 .count());
+    }
+    return state;
+  }
+  /**
+   * @brief Hedge a submitted message if it's not answered after the
+   * threshold, without waiting for it
+   * @details For the requests that are completed by continuation; they
+   * report their latency with record_latency()
+   * @param m the message, as submitted
+   */
+  void watch(const obj_detection_msg<single_bell>& m) {
+    const int64_t after_us = threshold.get();
+    if (after_us <= 0) return;
+    std::lock_guard<std::mutex> lk{timer_mtx};
+    timers.push({deadline_clock::now() + std::chrono::microseconds(after_us),
+                 m});
+    timer_cv.notify_one();
+  }
+  /**
+   * @brief Record the latency of an answered request that was watched
+   *
+   * @param latency
+   */
+  void record_latency(deadline_clock::duration latency) {
+    record(std::chrono::duration_cast<std::chrono::microseconds>(latency)
+               .count());
+  }
+
+  using ptr = std::shared_ptr<request_hedger>;
+
+ private:
+  static constexpr int64_t token = 1000;  //!< cost of a copy, in milli-copies
+  static constexpr int64_t burst = 10;    //!< copies that can be saved
+  /**
+   * @brief A watched message, to hedge at a time point
+   *
+   */
+  struct hedge_timer {
+    deadline_clock::time_point due;
+    obj_detection_msg<single_bell> m;
+    bool operator<(const hedge_timer& rhs) const { return due > rhs.due; }
+  };
+  object_detection_mq<single_bell>::ptr taskq;  //!< task queue
+  hedging_param param;                          //!< hedging parameters
+  std::atomic<int64_t> tokens{0};               //!< budget, in milli-copies
+  std::mutex mtx;                               //!< protects latencies
+  std::vector<int64_t> latencies;               //!< ring of recent latencies
+  size_t next = 0;                              //!< next slot of the ring
+  int since_update = 0;                         //!< latencies since threshold
+  metrics::counter& hedged;       //!< copies sent
+  metrics::counter& over_budget;  //!< late requests over the budget
+  metrics::counter& no_idle;      //!< late requests without idle engine
+  metrics::gauge& threshold;      //!< hedging threshold, 0 = not yet known
+  std::mutex timer_mtx;                     //!< protects timers
+  std::condition_variable timer_cv;         //!< wakes up the timer thread
+  std::priority_queue<hedge_timer> timers;  //!< watched messages, soonest
+                                            //! first
+  /**
+   * @brief Hedge the watched messages that are still not answered in time
+   *
+   */
+  void run_timers() {
+    pthread_setname_np(pthread_self(), "hedge timers");
+    std::unique_lock<std::mutex> lk{timer_mtx};
+    for (;;) {
+      if (timers.empty()) {
+        timer_cv.wait(lk);
+        continue;
+      }
+      const auto due = timers.top().due;
+      if (deadline_clock::now() < due) {
+        timer_cv.wait_until(lk, due);
+        continue;
+      }
+      auto m = timers.top().m;
+      timers.pop();
+      lk.unlock();
+      if (!m.claimed()) hedge(m);
+      lk.lock();
+    }
+  }
+  /**
+   * @brief Send a copy of a late message to an idle engine, within budget
+   *
+   */
+  void hedge(const obj_detection_msg<single_bell>& m) {
+    if (!spend()) {
+      over_budget.inc();
+      return;
+    }
+    if (!taskq->try_push_idle(m)) {
+      // nobody could start it right away, a copy would only add load
+      tokens.fetch_add(token);
+      no_idle.inc();
+      return;
+    }
+    server_log->debug("Hedge a request after {} us", threshold.get());
+    hedged.inc();
+  }
+  void earn() {
+    const int64_t earned = static_cast<int64_t>(param.budget * token);
+    int64_t cur = tokens.load();
+    while (cur < burst * token &&
+           !tokens.compare_exchange_weak(
+               cur, std::min(cur + earned, burst * token))) {
+    }
+  }
+  bool spend() {
+    int64_t cur = tokens.load();
+    do {
+      if (cur < token) return false;
+    } while (!tokens.compare_exchange_weak(cur, cur - token));
+    return true;
+  }
+  /**
+   * @brief Record the latency of a request, update the threshold from time
+   * to time
+   *
+   */
+  void record(int64_t us) {
+    std::lock_guard<std::mutex> lk{mtx};
+    const size_t window = std::max(param.window, 1);
+    if (latencies.size() < window) {
+      latencies.push_back(us);
+    } else {
+      latencies[next] = us;
+      next = (next + 1) % window;
+    }
+    if (static_cast<int>(latencies.size()) < param.min_samples ||
+        ++since_update < 64) {
+      return;
+    }
+    since_update = 0;
+    std::vector<int64_t> sorted(latencies);
+    const size_t k = std::min(
+        sorted.size() - 1,
+        static_cast<size_t>(param.percentile / 100 * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+    threshold.set(sorted[k]);
+  }
+};  // class request_hedger
+
+}  // namespace worker
+}  // namespace st
@@ -0,0 +1,480 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the pieces of the HTTP API that the HTTP
+ * front ends share: their parameters, routing of the targets, error
+ * responses, the JSON bodies, and the headers of the inference requests.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "st_admission.h"
+#include "st_ie_common.h"
+#include "st_ie_json.h"
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_metrics.h"
+#include "st_priority.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief Parameters of the HTTP front ends
+ *
+ */
+struct http_param {
+  uint64_t body_limit = 64 << 20;  //!< bytes of a request body, over it the
+                                   //! request is refused with 413
+  int pipeline_depth = 4;  //!< requests of a connection in flight at once,
+                           //! sync front end
+  // timeouts in seconds, 0 = none
+  int idle_timeout = 30;    //!< waiting for the next request
+  int header_timeout = 10;  //!< reading the header of a request
+  int body_timeout = 60;    //!< reading the body of a request
+  int write_timeout = 30;   //!< writing a response
+  int max_connections = 0;  //!< open connections, 0 = unlimited
+};
+
+/**
+ * @brief Read the parameters from the "http" node of the configuration
+ *
+ * @param conf
+ * @return http_param
+ */
+inline http_param read_http_param(const JSON& conf) {
+  http_param p;
+  p.body_limit = conf.get<uint64_t>("body limit", p.body_limit);
+  p.pipeline_depth =
+      std::max(1, conf.get<int>("pipeline depth", p.pipeline_depth));
+  p.idle_timeout = conf.get<int>("idle timeout", p.idle_timeout);
+  p.header_timeout = conf.get<int>("header timeout", p.header_timeout);
+  p.body_timeout = conf.get<int>("body timeout", p.body_timeout);
+  p.write_timeout = conf.get<int>("write timeout", p.write_timeout);
+  p.max_connections = conf.get<int>("max connections", p.max_connections);
+  return p;
+}
+
+/**
+* @brief This funtion generate error response
+* @details Depend on the type of error status, different responses messages
+* are generated
+* @param req
+* @param status
+* @param why
+* @return beast_basic_response
+*/
+inline beast_basic_response error_message(const beast_basic_request& req,
+                                          http::status status,
+                                          beast::string_view why) {
+  beast_basic_response res{status, req.version()};
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = std::string(why);
+  res.prepare_payload();
+  return res;
+}  // error_message
+
+/**
+ * @brief Response of a request whose body is over the limit
+ * @details The rest of the body is not read, so the connection is closed
+ * @param req the header of the request
+ * @return beast_basic_response
+ */
+inline beast_basic_response body_too_large(const beast_basic_request& req) {
+  auto res = error_message(req, http::status::payload_too_large,
+                           "Request body is too large");
+  res.keep_alive(false);
+  return res;
+}
+
+/**
+ * @brief Resources of the API
+ *
+ */
+enum class resource {
+  none,             //!< illegal target
+  root,             //!< GET /
+  api,              //!< GET /v1
+  metadata,         //!< GET /metadata
+  metrics,          //!< GET /metrics
+  inference,        //!< POST /inference
+  inference_tiled   //!< POST /inference/tiled
+};
+
+/**
+ * @brief A route of the API
+ *
+ */
+struct api_route {
+  const char* path;   //!< target, without the leading '/' but for the root
+  http::verb method;  //!< method of the resource, HEAD is always allowed
+  resource res;       //!< the resource
+};
+
+/**
+ * @brief The routes of the API, fixed at compile time
+ *
+ */
+constexpr api_route api_routes[] = {
+    {"/", http::verb::get, resource::root},
+    {"v1", http::verb::get, resource::api},
+    {"metadata", http::verb::get, resource::metadata},
+    {"metrics", http::verb::get, resource::metrics},
+    {"inference", http::verb::post, resource::inference},
+    {"inference/tiled", http::verb::post, resource::inference_tiled}};
+
+/**
+* @brief This function resolve the request target to route it to proper
+* resource.
+* @details The target is matched in place against the route table, nothing
+* is copied
+* @param target
+* @param ec
+* @return const api_route* nullptr if the target is illegal
+* @exception raise ec::no_such_file if the resource doesn't exist
+*/
+inline const api_route* request_resolve(beast::string_view target,
+                                        beast::error_code& ec) {
+  // Assume the request to the server is always in form `/{resource}`
+  if (target.empty() || target[0] != '/' ||
+      target.find("..") != beast::string_view::npos)
+    return nullptr;
+  if (target.size() > 1) target.remove_prefix(1);
+  // the greeting advertises "/v1/" and "/metadata/"
+  if (target.size() > 1 && target.back() == '/') target.remove_suffix(1);
+  for (const auto& r : api_routes) {
+    if (target == r.path) return &r;
+  }
+  // raise no_such_file error
+  ec = beast::errc::make_error_code(beast::errc::no_such_file_or_directory);
+  return nullptr;
+}  // request_resolve
+
+
+/**
+ * @brief
+ *
+ */
+inline std::string greeting() {
+  JSON res;
+  res.put<std::string>("type", "greeting");
+  res.put<std::string>("from", "canhld@kaist.ac.kr");
+  res.put<std::string>("message",
+                       "welcome to NCL inference server version 1");
+  JSON what_next;
+  what_next.put<std::string>("API", "GET /v1/ for supported API");
+  what_next.put<std::string>("INFO", "GET /metadata/ for model information");
+  res.put_child("what next", what_next);
+  std::ostringstream ss;
+  bpt::write_json(ss, res);
+  return ss.str();
+}  // greeting
+
+/**
+ * @brief The resources of the API, from the route table
+ *
+ */
+inline std::string api_listing() {
+  JSON res;
+  res.put<std::string>("type", "api");
+  JSON resources;
+  for (const auto& r : api_routes) {
+    JSON v;
+    v.put<std::string>("", static_cast<std::string>(http::to_string(r.method)) +
+                               (r.res == resource::root ? " " : " /") +
+                               r.path);
+    resources.push_back({"", v});
+  }
+  res.put_child("resources", resources);
+  std::ostringstream ss;
+  bpt::write_json(ss, res);
+  return ss.str();
+}  // api_listing
+
+/**
+ * @brief
+ *
+ *
+ * TODO: Implement the function with proper resource
+ */
+inline std::string metadata_request_handler() {
+  std::ostringstream ss;
+  ss.str("");
+  ss << std::fixed << "{\n"
+     << "\"from\": \"canhld@kaist.ac.kr\",\n"
+     << "\"message\": \"this is metadata request\"\n"
+     << "}\n";
+  return ss.str();
+}  // metadata_request_handler
+
+/**
+* @brief Deadline of a request from its X-Request-Deadline header
+*
+* @param value Unix time in milliseconds, empty if no deadline
+* @return deadline_clock::time_point
+*/
+inline deadline_clock::time_point request_deadline(beast::string_view value) {
+  if (value.empty()) return no_deadline();
+  try {
+    std::chrono::milliseconds ms{std::stoll(static_cast<std::string>(value))};
+    return to_deadline(std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(ms)));
+  } catch (const std::exception& e) {
+    http_log->debug("Ignore invalid X-Request-Deadline {}",
+                    static_cast<std::string>(value));
+    return no_deadline();
+  }
+}
+
+/**
+ * @brief JSON body of the predictions of an inference request
+ * @details The body written by a fused parser is taken as is
+ * @param prediction
+ * @return std::string
+ */
+inline std::string predictions_body(detection_result& prediction) {
+  if (!prediction.json.empty()) return std::move(prediction.json);
+  return predictions_json(prediction);
+}  // predictions_body
+
+/**
+ * @brief Response of a request with a JSON body
+ *
+ * @param req
+ * @param body
+ * @return beast_basic_response
+ */
+inline beast_basic_response json_response(const beast_basic_request& req,
+                                          std::string&& body) {
+  // Cache the size since we need it after the move
+  auto const size = body.size();
+  beast_basic_response res{std::piecewise_construct,
+                           std::make_tuple(std::move(body)),
+                           std::make_tuple(http::status::ok, req.version())};
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "application/json");
+  res.content_length(size);
+  res.keep_alive(req.keep_alive());
+  return res;
+}
+
+/**
+ * @brief Inference resources of the API
+ *
+ */
+enum class inference_route {
+  none,    //!< not an inference, already answered
+  single,  //!< POST /inference
+  tiled    //!< POST /inference/tiled
+};
+
+/**
+ * @brief Route a request, answer it right away unless it's an inference
+ * @details The priority class of an inference comes from the /{class}/
+ * prefix of the target or the X-Priority header
+ * @tparam Send
+ * @param req
+ * @param classes
+ * @param priority [out] class of the inference
+ * @param sender
+ * @return inference_route none if the request is answered
+ */
+template <class Send>
+inference_route route_request(const beast_basic_request& req,
+                              const priority_classes& classes, int& priority,
+                              Send& sender) {
+  // Make sure we can handle the method
+  if (req.method() != http::verb::get && req.method() != http::verb::head &&
+      req.method() != http::verb::post) {
+    sender(error_message(req, http::status::bad_request, "Unknown HTTP-method"));
+    return inference_route::none;
+  }
+
+  // Request path must be absolute and not contain "..".
+  beast::error_code ec;
+  // priority class from the /{class}/ prefix of the target or the header
+  beast::string_view path = req.target();
+  priority = classes.strip_prefix(path);
+  if (priority < 0) priority = classes.classify(req.base()["x-priority"]);
+  const api_route* r = request_resolve(path, ec);
+
+  // Handle the case where the resource doesn't exist
+  if (ec == beast::errc::no_such_file_or_directory) {
+    sender(error_message(req, http::status::not_found, "Not found"));
+    return inference_route::none;
+  }
+
+  // Handle an unknown error
+  if (ec) {
+    sender(error_message(req, http::status::unknown, ec.message()));
+    return inference_route::none;
+  }
+  if (!r) {
+    sender(error_message(req, http::status::bad_request,
+                         "Illegal request-target"));
+    return inference_route::none;
+  }
+
+  // Respond to HEAD request, alway just send the basic information of the
+  // server
+  if (req.method() == http::verb::head) {
+    beast_empty_response res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, mime_type(r->path));
+    res.content_length(0);
+    res.keep_alive(req.keep_alive());
+    sender(std::move(res));
+    return inference_route::none;
+  }
+  if (req.method() != r->method) {
+    sender(error_message(req, http::status::bad_request,
+                         "Illegal HTTP method"));
+    return inference_route::none;
+  }
+  switch (r->res) {
+    case resource::inference:
+      return inference_route::single;
+    case resource::inference_tiled:
+      return inference_route::tiled;
+    case resource::root: {
+      static const std::string body = greeting();
+      sender(json_response(req, std::string(body)));
+      return inference_route::none;
+    }
+    case resource::api: {
+      static const std::string body = api_listing();
+      sender(json_response(req, std::string(body)));
+      return inference_route::none;
+    }
+    case resource::metadata:
+      sender(json_response(req, metadata_request_handler()));
+      return inference_route::none;
+    case resource::metrics:
+      sender(json_response(req, metrics::server_metrics().to_json()));
+      return inference_route::none;
+    default:
+      break;
+  }
+  sender(error_message(req, http::status::bad_request, "Illegal HTTP method"));
+  return inference_route::none;
+}  // route_request
+
+/**
+ * @brief Whether the client waits for 100 Continue before it sends the body
+ *
+ * @param req
+ */
+inline bool expects_continue(const beast_basic_request& req) {
+  return beast::iequals(req.base()[http::field::expect], "100-continue");
+}
+
+/**
+ * @brief Refuse a request from its header, before its body is read
+ * @details A request with a body that would only be answered 404 or 400,
+ * i.e. an unknown route or a wrong method, gets it at once; so does an
+ * inference that is not an image, or that the admission control would shed
+ * right now, with 415 or 503: the body, maybe megabytes, is not worth
+ * reading. The body is left in the socket, so the response closes the
+ * connection. Other requests, and bodiless ones, are routed once they are
+ * read
+ * @tparam Send
+ * @param req the header of the request
+ * @param length its Content-Length, if any
+ * @param admission
+ * @param q task queue
+ * @param classes
+ * @param sender
+ * @return true if refused, the response is sent
+ */
+template <class Send>
+bool refuse_early(const beast_basic_request& req,
+                  const boost::optional<uint64_t>& length,
+                  admission_control& admission,
+                  object_detection_mq<single_bell>& q,
+                  const priority_classes& classes, Send& sender) {
+  const bool has_body = length ? *length > 0 : req.chunked();
+  // priority class and route as in route_request()
+  beast::string_view path = req.target();
+  int priority = classes.strip_prefix(path);
+  if (priority < 0) priority = classes.classify(req.base()["x-priority"]);
+  beast::error_code ec;
+  const api_route* r = request_resolve(path, ec);
+  beast_basic_response res;
+  if (req.method() != http::verb::get && req.method() != http::verb::head &&
+      req.method() != http::verb::post) {
+    if (!has_body) return false;
+    res = error_message(req, http::status::bad_request, "Unknown HTTP-method");
+  } else if (!r) {
+    if (!has_body) return false;
+    res = ec == beast::errc::no_such_file_or_directory
+              ? error_message(req, http::status::not_found, "Not found")
+              : error_message(req, http::status::bad_request,
+                              "Illegal request-target");
+  } else if (req.method() == http::verb::head) {
+    return false;
+  } else if (req.method() != r->method) {
+    if (!has_body) return false;
+    res = error_message(req, http::status::bad_request, "Illegal HTTP method");
+  } else if (r->res != resource::inference &&
+             r->res != resource::inference_tiled) {
+    return false;
+  } else if (req.base()[http::field::content_type].find("image/") ==
+             beast::string_view::npos) {
+    res = error_message(req, http::status::unsupported_media_type,
+                        "Not an image");
+  } else if (!admission.admits(q, length ? *length : 0, priority)) {
+    res = error_message(req, http::status::service_unavailable,
+                        "Server is overloaded");
+    res.set(http::field::retry_after, std::to_string(admission.retry_after()));
+  } else {
+    return false;
+  }
+  res.keep_alive(false);
+  sender(std::move(res));
+  return true;
+}  // refuse_early
+
+/**
+ * @brief Answer an inference request
+ * @details Nothing is sent for a cancelled request, nobody waits for it
+ * @tparam Send
+ * @param req
+ * @param status
+ * @param body predictions, if done
+ * @param retry_after retry hint of a shed request, seconds
+ * @param sender
+ */
+template <class Send>
+void respond_inference(const beast_basic_request& req, request_status status,
+                       std::string&& body, int retry_after, Send& sender) {
+  if (status == request_status::cancelled) return;
+  if (status == request_status::expired) {
+    return sender(error_message(req, http::status::gateway_timeout,
+                                "Deadline exceeded"));
+  }
+  if (status == request_status::shed) {
+    auto res = error_message(req, http::status::service_unavailable,
+                             "Server is overloaded");
+    res.set(http::field::retry_after, std::to_string(retry_after));
+    return sender(std::move(res));
+  }
+  if (status == request_status::failed) {
+    return sender(error_message(req, http::status::internal_server_error,
+                                "Inference failed"));
+  }
+  sender(json_response(req, std::move(body)));
+}  // respond_inference
+
+}  // namespace worker
+}  // namespace st
@@ -0,0 +1,116 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the body of the HTTP requests. The body is
+ * read into a pooled buffer, sized once from Content-Length, and the buffer
+ * is handed over to the inference pipeline as is: a multi-megabyte image is
+ * neither grown chunk by chunk nor copied after it's read.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/optional.hpp>
+#include "st_pool.h"
+
+namespace st {
+namespace sync {
+
+/**
+ * @brief Pooled buffer of a request body, keeps its capacity when recycled
+ * @details Up to pooled_capacity, the buffer of a larger body is freed
+ */
+struct body_buffer {
+  std::string bytes;  //!< the body
+  void recycle() { recycle_buffer(bytes); }
+};
+
+/**
+ * @brief Body of a request, a handle of a pooled buffer
+ * @details Empty until the parser reads a body. Copies share the buffer
+ */
+class request_body {
+ public:
+  const char* data() const { return buf ? buf->bytes.data() : ""; }
+  size_t size() const { return buf ? buf->bytes.size() : 0; }
+  bool empty() const { return size() == 0; }
+  /**
+   * @brief Drop the buffer, it goes back to the pool
+   *
+   */
+  void clear() { buf.reset(); }
+  /**
+   * @brief Take a buffer of the pool for a body of that many bytes
+   *
+   * @param length
+   */
+  void prepare(uint64_t length) {
+    if (!buf) buf = object_pool<body_buffer>::acquire();
+    buf->bytes.clear();
+    buf->bytes.reserve(length);
+  }
+  /**
+   * @brief Append a part of the body
+   *
+   */
+  void append(const char* p, size_t n) { buf->bytes.append(p, n); }
+  /**
+   * @brief Hand the bytes over to the pipeline without copying
+   * @details The bytes are swapped with the string, the body gets its
+   * former content
+   * @param other e.g. the input of a request context
+   */
+  void hand_over(std::string& other) {
+    if (buf) buf->bytes.swap(other);
+  }
+
+ private:
+  pool_ptr<body_buffer> buf;  //!< the buffer, or null
+};
+
+/**
+ * @brief Beast body of the requests, on a pooled buffer
+ * @details Read only: the server parses request bodies, it never
+ * serializes one
+ */
+struct pooled_body {
+  using value_type = request_body;
+  static uint64_t size(const value_type& body) { return body.size(); }
+  /**
+   * @brief Reads the body, presized from Content-Length
+   *
+   */
+  class reader {
+   public:
+    template <bool isRequest, class Fields>
+    reader(boost::beast::http::header<isRequest, Fields>&, value_type& b)
+        : body(b) {}
+    void init(const boost::optional<uint64_t>& length,
+              boost::beast::error_code& ec) {
+      body.prepare(length ? *length : 0);
+      ec = {};
+    }
+    template <class ConstBufferSequence>
+    size_t put(const ConstBufferSequence& buffers,
+               boost::beast::error_code& ec) {
+      size_t n = 0;
+      for (auto b : boost::beast::buffers_range_ref(buffers)) {
+        body.append(static_cast<const char*>(b.data()), b.size());
+        n += b.size();
+      }
+      ec = {};
+      return n;
+    }
+    void finish(boost::beast::error_code& ec) { ec = {}; }
+
+   private:
+    value_type& body;  //!< the body being read
+  };
+};
+
+}  // namespace sync
+}  // namespace st
@@ -10,12 +10,14 @@
 
 #pragma once
 #include <fstream>
+#include <functional>
 #include <sstream>
 #include <iterator>
 #include <memory>
 #include <string>
 #include <vector>
 #include "st_ie_common.h"
+#include "st_utils.h"
 
 /*
 TensorRT and OpenVINO Anatomy
@@ -65,12 +67,88 @@ class inference_engine {
   /****************************************************************/
   /**
    * @brief Run object detection and classification
+   * @details The result is replaced, its buffers are reused, so a result
+   * that is kept from one request to the next does not allocate
+   * @param data
+   * @param size
+   * @param ret replaced by the detections
+   */
+  virtual void run_detection(const char* data, int size,
+                             detection_result& ret) = 0;
+
+  /**
+   * @brief Parser of a finished inference request
+   * @details The parser owns the raw output of the network, so it can be
+   * invoked later and from any thread, e.g. from a post-processing worker.
+   * It replaces the result it is given, as run_detection()
+   */
+  using deferred_detection = std::function<void(detection_result&)>;
+
+  /**
+   * @brief Run inference only and defer the parsing of the output
+   *
+   * @param data
+   * @param size
+   * @return deferred_detection
+   */
+  virtual deferred_detection run_inference(const char* data, int size) = 0;
+
+  /**
+   * @brief Run object detection and classification on a decoded image
+   * @details The image can be a region of a larger image, e.g. a tile, and
+   * the coordinates of the detections are relative to this region
+   * @param image
+   * @param ret replaced by the detections
+   */
+  virtual void run_detection(const cv::Mat& image, detection_result& ret) = 0;
+
+  /**
+   * @brief Run inference on a decoded image and defer the parsing
+   *
+   * @param image
+   * @return deferred_detection
+   */
+  virtual deferred_detection run_inference(const cv::Mat& image) = 0;
+
+  /**
+   * @brief Run object detection for a producer that answers with the JSON
+   * body of the HTTP API
+   * @details With "fused json", an engine with a fused parser writes the
+   * body into the json of the result while it scans the output blob, the
+   * arrays stay empty. Otherwise, as run_detection()
+   * @param data
+   * @param size
+   * @param ret replaced by the detections or the body
+   */
+  virtual void run_detection_json(const char* data, int size,
+                                  detection_result& ret) {
+    run_detection(data, size, ret);
+  }
+
+  /**
+   * @brief Run inference only, the deferred parser writes the JSON body as
+   * run_detection_json()
    *
    * @param data
    * @param size
-   * @return std::vector<bbox>
+   * @return deferred_detection
    */
-  virtual std::vector<bbox> run_detection(const char* data, int size) = 0;
+  virtual deferred_detection run_inference_json(const char* data, int size) {
+    return run_inference(data, size);
+  }
+
+  /**
+   * @brief Read the optional, network specific parameters of the model
+   * @details The node is the "model" of the engine in the configuration
+   * file; by default, the minimum confidence and whether the parser writes
+   * the JSON body are read
+   * @param model
+   */
+  virtual void configure(const JSON& model) {
+    confidence_threshold =
+        model.get<float>("confidence", confidence_threshold);
+    fused_json = model.get<bool>("fused json", fused_json);
+  }
 
   /**
    * @brief default shared pointer
@@ -79,7 +157,9 @@ class inference_engine {
   using ptr = std::shared_ptr<inference_engine>;
 
  protected:
-  std::vector<std::string> labels;
+  label_table::ptr labels;  //!< class names, shared by the results
+  float confidence_threshold = 0.45;  //!< network specific default
+  bool fused_json = false;  //!< the parser writes the JSON body, if asked
   /**
    * @brief Construct a new inference engine object
    *
@@ -100,9 +180,20 @@ class inference_engine {
     std::stringstream ss;
     ss << inputFile.rdbuf();
     std::string tmp;
+    std::vector<std::string> names;
     while (std::getline(ss, tmp, '\n')) {
-      labels.push_back(tmp);
+      names.push_back(tmp);
     }
+    labels = std::make_shared<const label_table>(std::move(names));
+  }
+  /**
+   * @brief Empty a result, keeping its memory, and refer it to the labels of
+   * the engine
+   *
+   */
+  void reset_result(detection_result& ret) const {
+    ret.clear();
+    ret.labels = labels;
   }
 }; // class inference_engine
 }  // namespace st
@@ -13,6 +13,7 @@
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <vector>
+#include "st_ie_result.h"
 #include "st_message_queue.h"
 
 using namespace InferenceEngine;
@@ -20,34 +21,51 @@ using namespace nvinfer1;
 
 namespace st {
 namespace ie {
-/**
- * @brief Bouding box object
- * @details Basic bouding box object that can use in any recognition task
- */
-struct bbox {
-  int label_id;             //!< label id
-  std::string label;        //!< class name
-  float prop;               //!< confidence score
-  int c[4] = {};            //!< coordinates of bounding box
-};
-
 /**
  * @brief Message template that can hold object detection result
- *
+ * @details The input is either an encoded image (data, size) or a decoded
+ * image, e.g. a tile of a large image (image)
  * @tparam simple_bell
  */
 template <class simple_bell>
-using obj_detection_msg =
-    st::sync::message<const char*, int, std::vector<bbox>*, simple_bell>;
+using obj_detection_msg = st::sync::message<const char*, int,
+                                            detection_result*, simple_bell,
+                                            const cv::Mat*>;
+
+/**
+ * @brief Pooled state of an object detection request: claim flag, result
+ * storage and completion, shared by the copies of its message
+ */
+using detection_context = st::sync::request_context<detection_result>;
 
 /**
  * @brief Object detection message queue that can be used to exchange object
  * detection message
+ * @details One lane per inference worker, one queue per priority class in
+ * a lane, one virtual queue per tenant in a class; messages of a tenant are
+ * served earliest deadline first
  *
  * @tparam simple_bell
  */
 template <class simple_bell>
-using object_detection_mq =  st::sync::blocking_queue<obj_detection_msg<simple_bell>>;
+using object_detection_mq = st::sync::stealing_queue<
+    obj_detection_msg<simple_bell>,
+    st::sync::class_queue<
+        obj_detection_msg<simple_bell>,
+        st::sync::fair_queue<
+            obj_detection_msg<simple_bell>,
+            st::sync::edf_queue<obj_detection_msg<simple_bell>>>>>;
+
+/**
+ * @brief States that the consumer rings the bell of a message with
+ *
+ */
+enum msg_state : int {
+  msg_done = 1,       //!< predictions are ready
+  msg_expired = 2,    //!< dropped, the deadline passed before inference
+  msg_cancelled = 3,  //!< never rung, the producer cancelled the message
+  msg_failed = 4      //!< the engine or its parser threw, see the log
+};
 
 /**
 * @brief Sets image data stored in cv::Mat object to a given Blob object.
@@ -0,0 +1,148 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the parser of DetectionOutput blobs, i.e. the
+ * [image_id, label, conf, xmin, ymin, xmax, ymax] records produced by SSD and
+ * Faster R-CNN in OpenVino and TensorRT. Confidences are filtered a vector
+ * of records at a time and the records are dispatched to their image by
+ * image_id, so batched outputs are supported. The records are appended to
+ * any output with the push_back() of detection_result, e.g. the fused JSON
+ * writer.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "st_ie_result.h"
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief Size of an image in a batch
+ *
+ */
+struct image_size {
+  int width;
+  int height;
+};
+
+/**
+ * @brief Parser of DetectionOutput blobs
+ *
+ */
+class detection_output_parser {
+ public:
+  /**
+   * @brief Parse a batch of detections
+   * @details Records end at the first negative image_id. Records of the
+   * background (label <= 0) or of images out of the batch are skipped.
+   * @param detections the blob, [max_proposals][object_size]
+   * @param max_proposals number of records
+   * @param object_size size of a record, at least 7
+   * @param sizes size of each image of the batch
+   * @param batch number of images
+   * @param threshold keep records with confidence > threshold
+   * @param out detections of each image, appended
+   */
+  template <class Out>
+  static void parse(const float* detections, const int max_proposals,
+                    const int object_size, const image_size* sizes,
+                    const int batch, const float threshold,
+                    Out* out) {
+    int i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; i + lanes <= max_proposals; i += lanes) {
+      const float* rec = detections + i * object_size;
+      unsigned end = scan_end(rec, object_size);
+      unsigned hits = scan_confidence(rec + 2, object_size, threshold);
+      if (end) {
+        // drop everything from the first terminating record
+        hits &= (end & -end) - 1;
+      }
+      for (; hits; hits &= hits - 1) {
+        emit(detections + (i + __builtin_ctz(hits)) * object_size, sizes,
+             batch, out);
+      }
+      if (end) return;
+    }
+#endif
+    for (; i < max_proposals; ++i) {
+      const float* rec = detections + i * object_size;
+      if (rec[0] < 0) return;
+      if (rec[2] > threshold) emit(rec, sizes, batch, out);
+    }
+  }
+  /**
+   * @brief Parse the detections of a single image
+   *
+   */
+  template <class Out>
+  static void parse(const float* detections, const int max_proposals,
+                    const int object_size, const int width, const int height,
+                    const float threshold, Out& out) {
+    image_size size = {width, height};
+    parse(detections, max_proposals, object_size, &size, 1, threshold, &out);
+  }
+
+ private:
+#if defined(__AVX2__)
+  static constexpr int lanes = 8;
+#else
+  static constexpr int lanes = 4;
+#endif
+  /**
+   * @brief Append a record to the result of its image
+   *
+   */
+  template <class Out>
+  static void emit(const float* rec, const image_size* sizes, const int batch,
+                   Out* out) {
+    const int image_id = static_cast<int>(rec[0]);
+    const int label_id = static_cast<int>(rec[1]);
+    if (image_id >= batch || label_id <= 0) return;
+    const int width = sizes[image_id].width;
+    const int height = sizes[image_id].height;
+    out[image_id].push_back(label_id, rec[2], static_cast<int>(rec[3] * width),
+                            static_cast<int>(rec[4] * height),
+                            static_cast<int>(rec[5] * width),
+                            static_cast<int>(rec[6] * height));
+  }
+#if defined(__AVX2__)
+  static __m256 load(const float* p, const int stride) {
+    const __m256i idx =
+        _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                           _mm256_set1_epi32(stride));
+    return _mm256_i32gather_ps(p, idx, 4);
+  }
+  static unsigned scan_end(const float* p, const int stride) {
+    return _mm256_movemask_ps(
+        _mm256_cmp_ps(load(p, stride), _mm256_setzero_ps(), _CMP_LT_OQ));
+  }
+  static unsigned scan_confidence(const float* p, const int stride,
+                                  const float t) {
+    return _mm256_movemask_ps(
+        _mm256_cmp_ps(load(p, stride), _mm256_set1_ps(t), _CMP_GT_OQ));
+  }
+#elif defined(__SSE2__)
+  static __m128 load(const float* p, const int stride) {
+    return _mm_setr_ps(p[0], p[stride], p[2 * stride], p[3 * stride]);
+  }
+  static unsigned scan_end(const float* p, const int stride) {
+    return _mm_movemask_ps(_mm_cmplt_ps(load(p, stride), _mm_setzero_ps()));
+  }
+  static unsigned scan_confidence(const float* p, const int stride,
+                                  const float t) {
+    return _mm_movemask_ps(_mm_cmpgt_ps(load(p, stride), _mm_set1_ps(t)));
+  }
+#endif
+};
+
+}  // namespace ie
+}  // namespace st
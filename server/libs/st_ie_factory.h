@@ -9,6 +9,7 @@
 #include <unordered_map>
 #include "st_ie_base.h"
 #include "st_ie_openvino.h"
+#include "st_ie_synthetic.h"
 #include "st_ie_tensorrt.h"
 #include "st_utils.h"
 #include "st_logging.h"
@@ -156,6 +157,17 @@ class nvidia_gpu_inference_engine_creator : public inference_engine_creator {
     return create_tensorrt_engine(name, graph, label);
   }
 };
+/**
+ * @brief Creator for the engine with a synthetic latency, for testing
+ * 
+ */
+class synthetic_inference_engine_creator : public inference_engine_creator {
+ public:
+  inference_engine::ptr create(JSON& conf) final {
+    // the latency is read from the model by configure()
+    return std::make_shared<synthetic_inference_engine>();
+  }
+};
 /**
  * @brief creator for xilinx device
  * 
@@ -179,6 +191,7 @@ class ie_factory {
     Register("intel cpu", new intel_cpu_inference_engine_creator());
     Register("intel fpga", new intel_fpga_inference_engine_creator());
     Register("nvidia gpu", new nvidia_gpu_inference_engine_creator());
+    Register("synthetic", new synthetic_inference_engine_creator());
   }
   /**
    * @brief Create a inference engine object
@@ -194,7 +207,12 @@ class ie_factory {
       throw std::logic_error("Creator of [" + device + "] not found in registry");
     }
     auto creator = it->second;
-    return creator->create(conf);
+    auto ret = creator->create(conf);
+    // optional parameters of the network, network default if not set
+    if (ret) {
+      ret->configure(conf.get_child("model"));
+    }
+    return ret;
   }
   /**
    * @brief Registor a device with a creator, should be done at compile time by now
@@ -0,0 +1,166 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the JSON encodings of the predictions of the
+ * HTTP API. The property tree encoding serializes a detection result; the
+ * fused writer lets a parser write the same text straight into the body
+ * while it scans the output blob, without the arrays, the tree and the
+ * stream in between.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <boost/property_tree/json_parser.hpp>
+#include "st_ie_result.h"
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief JSON body of the predictions, through a property tree
+ *
+ * @param prediction
+ * @return std::string
+ */
+inline std::string predictions_json(const detection_result& prediction) {
+  using JSON = boost::property_tree::ptree;
+  int n = prediction.size();
+  // create property tree and write to json
+  JSON res;     // our response
+  JSON bboxes;  // predicion
+  for (int i = 0; i < n; ++i) {
+    // parse prediction[i] to p[i], the label is looked up only here
+    JSON p;
+    p.put<int>("label_id", prediction.label_id[i]);
+    p.put<std::string>("label", prediction.label(i));
+    p.put<float>("confidences", prediction.score[i]);
+    JSON tmp;
+    if (prediction.has_box(i)) {
+      const int box[4] = {prediction.x1[i], prediction.y1[i],
+                          prediction.x2[i], prediction.y2[i]};
+      for (int v : box) {
+        JSON c;
+        c.put<int>("", v);
+        tmp.push_back({"", c});
+      }
+      p.put_child("detection_box", std::move(tmp));
+    }
+    bboxes.push_back({"", std::move(p)});
+  }
+  res.put_child("predictions", std::move(bboxes));
+  std::ostringstream ss;
+  boost::property_tree::write_json(ss, res);
+  return ss.str();
+}  // predictions_json
+
+/**
+ * @brief Writes the JSON body of the predictions while a parser scans the
+ * output blob
+ * @details The text is the one of predictions_json(), byte for byte, but
+ * appended to the body as the detections come. It has the push_back() of
+ * detection_result, so the parsers write to either. The body keeps its
+ * capacity, a reused body does not allocate
+ */
+class detection_json_writer {
+ public:
+  /**
+   * @brief Start the body
+   *
+   * @param _body replaced by the predictions
+   * @param _labels labels of the engine, may be null
+   */
+  detection_json_writer(std::string& _body, const label_table* _labels)
+      : body(_body), labels(_labels) {
+    body.clear();
+    body += "{\n    \"predictions\": ";
+  }
+  /**
+   * @brief Reserve the body for n detections
+   *
+   */
+  void reserve(size_t n) { body.reserve(body.size() + n * per_detection); }
+  /**
+   * @brief Append a detection, without box for a classification
+   *
+   */
+  void push_back(int label_id, float score, int x1 = 0, int y1 = 0,
+                 int x2 = 0, int y2 = 0) {
+    body += n++ ? ",\n" : "[\n";
+    body += "        {\n            \"label_id\": \"";
+    append(label_id);
+    body += "\",\n            \"label\": \"";
+    if (labels) escape(labels->name(label_id));
+    body += "\",\n            \"confidences\": \"";
+    append(score);
+    body += '"';
+    if (y2) {  // ymax should never be zero
+      body += ",\n            \"detection_box\": [\n";
+      const int box[4] = {x1, y1, x2, y2};
+      for (int i = 0; i < 4; ++i) {
+        body += "                \"";
+        append(box[i]);
+        body += i < 3 ? "\",\n" : "\"\n";
+      }
+      body += "            ]";
+    }
+    body += "\n        }";
+  }
+  /**
+   * @brief Close the body, after the last detection
+   *
+   */
+  void finish() { body += n ? "\n    ]\n}\n" : "\"\"\n}\n"; }
+  size_t size() const { return n; }
+
+ private:
+  static constexpr size_t per_detection = 256;  //!< bytes, with a box
+  std::string& body;                            //!< the body
+  const label_table* labels;                    //!< labels of the engine
+  size_t n = 0;                                 //!< detections written
+  void append(int v) {
+    char buf[16];
+    body.append(buf, std::snprintf(buf, sizeof(buf), "%d", v));
+  }
+  void append(float v) {
+    // the precision of the property tree
+    char buf[32];
+    body.append(buf, std::snprintf(buf, sizeof(buf), "%.9g",
+                                   static_cast<double>(v)));
+  }
+  /**
+   * @brief Append a string with the escapes of the property tree
+   *
+   */
+  void escape(const std::string& s) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (char ch : s) {
+      const unsigned char c = ch;
+      if (c == 0x20 || c == 0x21 || (c >= 0x23 && c <= 0x2E) ||
+          (c >= 0x30 && c <= 0x5B) || c >= 0x5D) {
+        body += ch;
+        continue;
+      }
+      body += '\\';
+      switch (ch) {
+        case '\b': body += 'b'; break;
+        case '\f': body += 'f'; break;
+        case '\n': body += 'n'; break;
+        case '\r': body += 'r'; break;
+        case '\t': body += 't'; break;
+        case '/': body += '/'; break;
+        case '"': body += '"'; break;
+        case '\\': body += '\\'; break;
+        default:
+          body += "u00";
+          body += hex[c >> 4];
+          body += hex[c & 0xF];
+      }
+    }
+  }
+};
+
+}  // namespace ie
+}  // namespace st
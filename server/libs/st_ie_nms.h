@@ -0,0 +1,305 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement non-maximum suppression (NMS) for detection
+ * networks that do not have a DetectionOutput layer, e.g. YOLO. Boxes are kept
+ * in structure-of-arrays layout so the IoU test can be vectorized, and kept
+ * boxes are bucketed in a uniform grid so each candidate is only tested
+ * against its spatial neighbours instead of all kept boxes.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief Candidate boxes in structure-of-arrays layout
+ *
+ */
+struct nms_boxes {
+  std::vector<float> x1;     //!< xmin
+  std::vector<float> y1;     //!< ymin
+  std::vector<float> x2;     //!< xmax
+  std::vector<float> y2;     //!< ymax
+  std::vector<float> score;  //!< confidence score
+  std::vector<int> label;    //!< class id
+  /**
+   * @brief Append a candidate
+   *
+   */
+  void push_back(float _x1, float _y1, float _x2, float _y2, float _score,
+                 int _label) {
+    x1.push_back(_x1);
+    y1.push_back(_y1);
+    x2.push_back(_x2);
+    y2.push_back(_y2);
+    score.push_back(_score);
+    label.push_back(_label);
+  }
+  void reserve(size_t n) {
+    x1.reserve(n);
+    y1.reserve(n);
+    x2.reserve(n);
+    y2.reserve(n);
+    score.reserve(n);
+    label.reserve(n);
+  }
+  /**
+   * @brief Remove all candidates but keep the memory
+   *
+   */
+  void clear() {
+    x1.clear();
+    y1.clear();
+    x2.clear();
+    y2.clear();
+    score.clear();
+    label.clear();
+  }
+  size_t size() const { return score.size(); }
+};
+
+/**
+ * @brief NMS parameters
+ *
+ */
+struct nms_param {
+  float iou_threshold = 0.4f;    //!< suppress if IoU >= iou_threshold
+  float score_threshold = 0.0f;  //!< drop candidates below this score
+  int top_k = 0;       //!< candidates per class kept before NMS, 0 = all
+  int keep_top_k = 0;  //!< maximum number of outputs, 0 = all
+  bool class_aware = true;  //!< suppress only boxes of the same class
+};
+
+/**
+ * @brief Greedy NMS with vectorized IoU and grid-bucketed neighbour search
+ * @details The suppressor owns its workspace, so running it repeatedly does
+ * not allocate once the buffers are warmed up. It's not thread-safe, use one
+ * suppressor per thread.
+ */
+class nms_suppressor {
+ public:
+  /**
+   * @brief Run NMS
+   *
+   * @param in candidates
+   * @param p parameters
+   * @param keep indices of kept candidates, sorted by decreasing score
+   */
+  void run(const nms_boxes& in, const nms_param& p, std::vector<int>& keep) {
+    keep.clear();
+    // filter by score, order by class then by decreasing score
+    order.clear();
+    const int n = in.size();
+    for (int i = 0; i < n; ++i) {
+      if (in.score[i] >= p.score_threshold) order.push_back(i);
+    }
+    const bool class_aware = p.class_aware;
+    const float* score = in.score.data();
+    const int* label = in.label.data();
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+      if (class_aware && label[a] != label[b]) return label[a] < label[b];
+      return score[a] > score[b];
+    });
+    // suppress class by class
+    const int m = order.size();
+    for (int b = 0; b < m;) {
+      int e = b + 1;
+      if (class_aware) {
+        while (e < m && label[order[e]] == label[order[b]]) ++e;
+      } else {
+        e = m;
+      }
+      int end = (p.top_k > 0 && e - b > p.top_k) ? b + p.top_k : e;
+      suppress_group(in, b, end, p.iou_threshold, keep);
+      b = e;
+    }
+    // merge the classes
+    std::sort(keep.begin(), keep.end(),
+              [&](int a, int b) { return score[a] > score[b]; });
+    if (p.keep_top_k > 0 && static_cast<int>(keep.size()) > p.keep_top_k) {
+      keep.resize(p.keep_top_k);
+    }
+  }
+
+ private:
+  std::vector<int> order;  //!< sorted candidate indices
+  // kept boxes of the current group in SoA layout
+  std::vector<float> kx1, ky1, kx2, ky2, karea;
+  // gathered neighbours of the current candidate
+  std::vector<float> gx1, gy1, gx2, gy2, garea;
+  // grid buckets of kept boxes, store index in kx1...
+  std::vector<std::vector<int>> cells;
+  std::vector<int> touched;     //!< non-empty cells, to reset the grid
+  std::vector<unsigned> stamp;  //!< dedup kept boxes spanning several cells
+  unsigned epoch = 0;
+
+  /**
+   * @brief Is a box suppressed by any of n boxes
+   * @details IoU >= t <=> inter * (1 + t) >= t * (area_a + area_b), so we
+   * never divide
+   */
+  static bool any_overlap(float x1, float y1, float x2, float y2, float area,
+                          const float* ox1, const float* oy1, const float* ox2,
+                          const float* oy2, const float* oarea, int n,
+                          float t) {
+    int j = 0;
+#if defined(__AVX__)
+    const __m256 bx1 = _mm256_set1_ps(x1), by1 = _mm256_set1_ps(y1);
+    const __m256 bx2 = _mm256_set1_ps(x2), by2 = _mm256_set1_ps(y2);
+    const __m256 barea = _mm256_set1_ps(area), zero = _mm256_setzero_ps();
+    const __m256 vt = _mm256_set1_ps(t), vt1 = _mm256_set1_ps(1.0f + t);
+    for (; j + 8 <= n; j += 8) {
+      __m256 iw = _mm256_sub_ps(_mm256_min_ps(bx2, _mm256_loadu_ps(ox2 + j)),
+                                _mm256_max_ps(bx1, _mm256_loadu_ps(ox1 + j)));
+      __m256 ih = _mm256_sub_ps(_mm256_min_ps(by2, _mm256_loadu_ps(oy2 + j)),
+                                _mm256_max_ps(by1, _mm256_loadu_ps(oy1 + j)));
+      __m256 inter =
+          _mm256_mul_ps(_mm256_max_ps(iw, zero), _mm256_max_ps(ih, zero));
+      __m256 lhs = _mm256_mul_ps(inter, vt1);
+      __m256 rhs =
+          _mm256_mul_ps(vt, _mm256_add_ps(barea, _mm256_loadu_ps(oarea + j)));
+      __m256 hit = _mm256_and_ps(_mm256_cmp_ps(lhs, rhs, _CMP_GE_OQ),
+                                 _mm256_cmp_ps(inter, zero, _CMP_GT_OQ));
+      if (_mm256_movemask_ps(hit)) return true;
+    }
+#elif defined(__SSE2__)
+    const __m128 bx1 = _mm_set1_ps(x1), by1 = _mm_set1_ps(y1);
+    const __m128 bx2 = _mm_set1_ps(x2), by2 = _mm_set1_ps(y2);
+    const __m128 barea = _mm_set1_ps(area), zero = _mm_setzero_ps();
+    const __m128 vt = _mm_set1_ps(t), vt1 = _mm_set1_ps(1.0f + t);
+    for (; j + 4 <= n; j += 4) {
+      __m128 iw = _mm_sub_ps(_mm_min_ps(bx2, _mm_loadu_ps(ox2 + j)),
+                             _mm_max_ps(bx1, _mm_loadu_ps(ox1 + j)));
+      __m128 ih = _mm_sub_ps(_mm_min_ps(by2, _mm_loadu_ps(oy2 + j)),
+                             _mm_max_ps(by1, _mm_loadu_ps(oy1 + j)));
+      __m128 inter = _mm_mul_ps(_mm_max_ps(iw, zero), _mm_max_ps(ih, zero));
+      __m128 lhs = _mm_mul_ps(inter, vt1);
+      __m128 rhs = _mm_mul_ps(vt, _mm_add_ps(barea, _mm_loadu_ps(oarea + j)));
+      __m128 hit = _mm_and_ps(_mm_cmpge_ps(lhs, rhs), _mm_cmpgt_ps(inter, zero));
+      if (_mm_movemask_ps(hit)) return true;
+    }
+#endif
+    for (; j < n; ++j) {
+      float iw = std::min(x2, ox2[j]) - std::max(x1, ox1[j]);
+      float ih = std::min(y2, oy2[j]) - std::max(y1, oy1[j]);
+      if (iw <= 0 || ih <= 0) continue;
+      float inter = iw * ih;
+      if (inter * (1.0f + t) >= t * (area + oarea[j])) return true;
+    }
+    return false;
+  }
+
+  /**
+   * @brief Greedy NMS over order[b, e), candidates are sorted by score
+   *
+   */
+  void suppress_group(const nms_boxes& in, int b, int e, float t,
+                      std::vector<int>& keep) {
+    const int brute_force_limit = 64;  // use the grid above this
+    const int max_grid_side = 64;      // cap of the grid resolution
+    kx1.clear(), ky1.clear(), kx2.clear(), ky2.clear(), karea.clear();
+    // a non-positive threshold suppresses disjoint boxes as well, the grid
+    // only finds overlapping ones
+    if (e - b <= brute_force_limit || t <= 0) {
+      for (int k = b; k < e; ++k) {
+        int i = order[k];
+        float area = (in.x2[i] - in.x1[i]) * (in.y2[i] - in.y1[i]);
+        if (t > 0 && any_overlap(in.x1[i], in.y1[i], in.x2[i], in.y2[i], area,
+                                 kx1.data(), ky1.data(), kx2.data(),
+                                 ky2.data(), karea.data(), kx1.size(), t)) {
+          continue;
+        }
+        if (t <= 0 && !kx1.empty()) continue;
+        keep_box(in, i, area, keep);
+      }
+      return;
+    }
+    // grid geometry from the extent and the mean size of the candidates
+    float minx = in.x1[order[b]], miny = in.y1[order[b]];
+    float maxx = in.x2[order[b]], maxy = in.y2[order[b]];
+    double side = 0;
+    for (int k = b; k < e; ++k) {
+      int i = order[k];
+      minx = std::min(minx, in.x1[i]), miny = std::min(miny, in.y1[i]);
+      maxx = std::max(maxx, in.x2[i]), maxy = std::max(maxy, in.y2[i]);
+      side += std::max(in.x2[i] - in.x1[i], in.y2[i] - in.y1[i]);
+    }
+    side = std::max(side / (e - b), 1.0);
+    const int gw = std::max(1, std::min(max_grid_side,
+                                        static_cast<int>((maxx - minx) / side)));
+    const int gh = std::max(1, std::min(max_grid_side,
+                                        static_cast<int>((maxy - miny) / side)));
+    const float sx = gw / std::max(maxx - minx, 1.0f);
+    const float sy = gh / std::max(maxy - miny, 1.0f);
+    if (static_cast<int>(cells.size()) < gw * gh) cells.resize(gw * gh);
+    auto cell_of = [](float v, float lo, float s, int g) {
+      return std::max(0, std::min(g - 1, static_cast<int>((v - lo) * s)));
+    };
+    for (int k = b; k < e; ++k) {
+      int i = order[k];
+      float area = (in.x2[i] - in.x1[i]) * (in.y2[i] - in.y1[i]);
+      int cx0 = cell_of(in.x1[i], minx, sx, gw);
+      int cx1 = cell_of(in.x2[i], minx, sx, gw);
+      int cy0 = cell_of(in.y1[i], miny, sy, gh);
+      int cy1 = cell_of(in.y2[i], miny, sy, gh);
+      // gather the kept neighbours, dedup with the epoch stamp
+      if (++epoch == 0) {
+        std::fill(stamp.begin(), stamp.end(), 0);
+        epoch = 1;
+      }
+      gx1.clear(), gy1.clear(), gx2.clear(), gy2.clear(), garea.clear();
+      for (int cy = cy0; cy <= cy1; ++cy) {
+        for (int cx = cx0; cx <= cx1; ++cx) {
+          for (int id : cells[cy * gw + cx]) {
+            if (stamp[id] == epoch) continue;
+            stamp[id] = epoch;
+            gx1.push_back(kx1[id]), gy1.push_back(ky1[id]);
+            gx2.push_back(kx2[id]), gy2.push_back(ky2[id]);
+            garea.push_back(karea[id]);
+          }
+        }
+      }
+      if (any_overlap(in.x1[i], in.y1[i], in.x2[i], in.y2[i], area, gx1.data(),
+                      gy1.data(), gx2.data(), gy2.data(), garea.data(),
+                      gx1.size(), t)) {
+        continue;
+      }
+      // keep it and bucket it in every cell it spans
+      int id = kx1.size();
+      keep_box(in, i, area, keep);
+      if (stamp.size() < kx1.size()) stamp.resize(kx1.size(), 0);
+      for (int cy = cy0; cy <= cy1; ++cy) {
+        for (int cx = cx0; cx <= cx1; ++cx) {
+          auto& cell = cells[cy * gw + cx];
+          if (cell.empty()) touched.push_back(cy * gw + cx);
+          cell.push_back(id);
+        }
+      }
+    }
+    // reset the grid for the next group, keep the memory
+    for (int c : touched) cells[c].clear();
+    touched.clear();
+  }
+
+  void keep_box(const nms_boxes& in, int i, float area,
+                std::vector<int>& keep) {
+    kx1.push_back(in.x1[i]), ky1.push_back(in.y1[i]);
+    kx2.push_back(in.x2[i]), ky2.push_back(in.y2[i]);
+    karea.push_back(area);
+    keep.push_back(i);
+  }
+};
+
+}  // namespace ie
+}  // namespace st
@@ -10,7 +10,6 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <numeric>
 #include <algorithm>
 
 #include <spdlog/sinks/basic_file_sink.h>
@@ -22,6 +21,11 @@
 #include <ie_plugin.hpp>
 #include <hetero/hetero_plugin_config.hpp>
 #include "st_ie_base.h"
+#include "st_ie_detection_output.h"
+#include "st_ie_json.h"
+#include "st_ie_nms.h"
+#include "st_ie_topk.h"
+#include "st_ie_yolo.h"
 #include "st_logging.h"
 #include "st_utils.h"
 
@@ -50,19 +54,70 @@ public:
   /*  Inference engine public interface implementation            */
   /****************************************************************/
 
-  std::vector<bbox> run_detection(const char* data, int size) final {
+  void run_detection(const char* data, int size,
+                     detection_result& ret) final {
     auto net_out = do_infer(data, size);
-    return detection_parser(net_out);
+    detection_parser(net_out, ret);
+  }
+
+  deferred_detection run_inference(const char* data, int size) final {
+    auto net_out = do_infer(data, size);
+    // the infer request is created per call, so the parser can safely hold it
+    return [this, net_out](detection_result& ret) mutable {
+      detection_parser(net_out, ret);
+    };
+  }
+
+  void run_detection(const cv::Mat& image, detection_result& ret) final {
+    auto net_out = do_infer(image);
+    detection_parser(net_out, ret);
+  }
+
+  deferred_detection run_inference(const cv::Mat& image) final {
+    auto net_out = do_infer(image);
+    return [this, net_out](detection_result& ret) mutable {
+      detection_parser(net_out, ret);
+    };
+  }
+
+  void run_detection_json(const char* data, int size,
+                          detection_result& ret) final {
+    auto net_out = do_infer(data, size);
+    if (fused_json) {
+      json_parser(net_out, ret);
+    } else {
+      detection_parser(net_out, ret);
+    }
+  }
+
+  deferred_detection run_inference_json(const char* data, int size) final {
+    if (!fused_json) return run_inference(data, size);
+    auto net_out = do_infer(data, size);
+    return [this, net_out](detection_result& ret) mutable {
+      json_parser(net_out, ret);
+    };
   }
 
   /**
    * @brief Parse detection output of a inference request, network specific
    *
    * @param net_out
-   * @return std::vector<bbox>
+   * @param ret replaced by the detections, its buffers are reused
+   */
+  virtual void detection_parser(network_output& net_out,
+                                detection_result& ret) {
+    reset_result(ret);
+  }
+
+  /**
+   * @brief Parse detection output of a inference request into the JSON body,
+   * network specific
+   * @details By default, the arrays are parsed and serialized later
+   * @param net_out
+   * @param ret replaced by the body, its buffers are reused
    */
-  virtual std::vector<bbox> detection_parser(network_output& net_out) {
-    return {};
+  virtual void json_parser(network_output& net_out, detection_result& ret) {
+    detection_parser(net_out, ret);
   }
 
   /**
@@ -227,11 +282,11 @@ protected:
     }
   }
   /**
-   * @brief Do inference and return the infered request
+   * @brief Decode the image, do inference and return the infered request
    * @details
    * @param data
    * @param size
-   * @return InferRequest::Ptr
+   * @return network_output
    */
   network_output do_infer(const char* data, int size) {
     try {
@@ -244,11 +299,31 @@ protected:
       cv::Mat frame =
           cv::imdecode(cv::Mat(1, size, CV_8UC3, (unsigned char*)data),
                        cv::IMREAD_UNCHANGED);
-      const int width = frame.size().width;
-      const int height = frame.size().height;
       end = std::chrono::system_clock::now();
       elapsed_mil = end - start;
       ovn_log->debug("Decode image in {} ms", elapsed_mil.count());
+      return do_infer(frame);
+    }
+    catch (const cv::Exception& e) {
+      // let not opencv silly exception terminate our program
+      std::cerr << "Error: " << e.what() << std::endl;
+      return {nullptr, -1, -1};
+    }
+  }
+  /**
+   * @brief Do inference on a decoded image and return the infered request
+   * @details The frame can be a region of interest of a larger image, it's
+   * read in place
+   * @param frame
+   * @return network_output
+   */
+  network_output do_infer(const cv::Mat& frame) {
+    try {
+      std::chrono::time_point<std::chrono::system_clock> start;
+      std::chrono::time_point<std::chrono::system_clock> end;
+      std::chrono::duration<double, std::milli> elapsed_mil;
+      const int width = frame.size().width;
+      const int height = frame.size().height;
 
       // create new request
       start = std::chrono::system_clock::now();
@@ -332,8 +407,23 @@ public:
     set_labels(label);
   }
   // detection parser implementation for ssd
-  std::vector<bbox> detection_parser(network_output& net_out) final {
-    std::vector<bbox> ret = {};  // return value
+  void detection_parser(network_output& net_out,
+                        detection_result& ret) final {
+    reset_result(ret);
+    parse_output(net_out, ret);
+  }
+  void json_parser(network_output& net_out, detection_result& ret) final {
+    ret.clear();
+    detection_json_writer out(ret.json, labels.get());
+    parse_output(net_out, out);
+    out.finish();
+  }
+  /**
+   * @brief Parse the output into the arrays or the JSON body
+   *
+   */
+  template <class Out>
+  void parse_output(network_output& net_out, Out& ret) {
     try {
       ovn_log->debug("Parsing ssd output");
       std::chrono::time_point<std::chrono::system_clock> start;
@@ -352,41 +442,15 @@ public:
       const int maxProposalCount = dims[1];
       const int objectSize = dims[0];
       ovn_log->trace("TopK {}, object size {}", maxProposalCount, objectSize);
-      for (int i = 0; i < maxProposalCount; i++) {
-        float image_id = detections[i * objectSize + 0];
-        if (image_id < 0) {
-          break;
-        }
-        float confidence = detections[i * objectSize + 2];
-        auto label_id = static_cast<int>(detections[i * objectSize + 1]);
-        if (label_id <= 0) break;
-        int xmin = detections[i * objectSize + 3] * width;
-        int ymin = detections[i * objectSize + 4] * height;
-        int xmax = detections[i * objectSize + 5] * width;
-        int ymax = detections[i * objectSize + 6] * height;
-        ovn_log->trace("{} {} {} {} {} {} {} {}", i, image_id, label_id, confidence, xmin, ymin, xmax, ymax);
-        auto label = labels[label_id - 1];
-        ovn_log->trace("Object: {}", label);
-        if (confidence > 0.45) {
-          bbox d;
-          d.prop = confidence;
-          d.label_id = label_id;
-          d.label = std::move(label);
-          d.c[0] = xmin;
-          d.c[1] = ymin;
-          d.c[2] = xmax;
-          d.c[3] = ymax;
-          ret.push_back(std::move(d));
-        }
-      }
+      detection_output_parser::parse(detections, maxProposalCount, objectSize,
+                                     width, height, confidence_threshold,
+                                     ret);
       end = std::chrono::system_clock::now();  // sync mode only
       elapsed_mil = end - start;
       ovn_log->debug("Parsing ssd output in {} ms", elapsed_mil.count());
-      return ret;
     }
     catch (const cv::Exception& e) {
       std::cerr << "Error: " << e.what() << std::endl;
-      return ret;
     }
   }
 
@@ -436,12 +500,29 @@ public:
     init_plugin(device);
     load_network(model);
     init_IO(Precision::U8, Layout::NCHW);
+    init_regions();
     // load_plugin({});
     set_labels(label);
+    confidence_threshold = 0.5;
   }
   // detection parser implementation for yolo
-  std::vector<bbox> detection_parser(network_output& net_out) final {
-    std::vector<bbox> ret;
+  void detection_parser(network_output& net_out,
+                        detection_result& ret) final {
+    reset_result(ret);
+    parse_output(net_out, ret);
+  }
+  void json_parser(network_output& net_out, detection_result& ret) final {
+    ret.clear();
+    detection_json_writer out(ret.json, labels.get());
+    parse_output(net_out, out);
+    out.finish();
+  }
+  /**
+   * @brief Parse the output into the arrays or the JSON body
+   *
+   */
+  template <class Out>
+  void parse_output(network_output& net_out, Out& ret) {
     try {
       ovn_log->debug("Parsing yolo output");
       std::chrono::time_point<std::chrono::system_clock> start;
@@ -449,231 +530,146 @@ public:
       std::chrono::duration<double, std::milli> elapsed_mil;
       start = std::chrono::system_clock::now();
       auto infer_request = net_out.infer_request;
-      auto width = net_out.width;
-      auto height = net_out.height;
-      // process YOLO output, it's quite complicated though
-      auto input_info = exe_network.GetInputsInfo();
-      auto output_info = exe_network.GetOutputsInfo();
-      start = std::chrono::system_clock::now();
-      unsigned long resized_im_h =
-          input_info.begin()->second.get()->getDims()[0];
-      unsigned long resized_im_w =
-          input_info.begin()->second.get()->getDims()[1];
-      std::vector<detection_object> objects;
-      // Parsing outputs
-      for (auto& output : output_info) {
-        auto output_name = output.first;
-        CNNLayerPtr layer = get_layer(output_name.c_str());
-        Blob::Ptr blob = infer_request->GetBlob(output_name);
-        parse_yolov3_output(layer, blob, resized_im_h, resized_im_w, height,
-                            width, 0.5, objects);
+      const float width = net_out.width;
+      const float height = net_out.height;
+      // the parser may run in several post-processing threads
+      static thread_local std::vector<nms_boxes> scales;
+      static thread_local nms_boxes objects;
+      static thread_local nms_suppressor nms;
+      static thread_local std::vector<int> keep;
+      const int num_scales = regions.size();
+      scales.resize(num_scales);
+      // the scales are decoded in turn: the requests are parsed in parallel
+      // by the workers already, a thread per scale would only add the cost
+      // of starting it to each request
+      for (int i = 0; i < num_scales; ++i) {
+        Blob::Ptr blob = infer_request->GetBlob(region_names[i]);
+        const float* output =
+            blob->buffer().as<PrecisionTrait<Precision::FP32>::value_type*>();
+        scales[i].clear();
+        yolo_decoder::decode(output, regions[i], input_h, input_w, height,
+                             width, confidence_threshold, scales[i]);
       }
-      // Filtering overlapping boxes
-      std::sort(objects.begin(), objects.end(),
-                std::greater<detection_object>());
-      for (size_t i = 0; i < objects.size(); ++i) {
-        if (objects[i].confidence == 0) continue;
-        for (size_t j = i + 1; j < objects.size(); ++j)
-          if (intersection_over_union(objects[i], objects[j]) >= 0.4)
-            objects[j].confidence = 0;
+      objects.clear();
+      for (auto& scale : scales) {
+        objects.x1.insert(objects.x1.end(), scale.x1.begin(), scale.x1.end());
+        objects.y1.insert(objects.y1.end(), scale.y1.begin(), scale.y1.end());
+        objects.x2.insert(objects.x2.end(), scale.x2.begin(), scale.x2.end());
+        objects.y2.insert(objects.y2.end(), scale.y2.begin(), scale.y2.end());
+        objects.score.insert(objects.score.end(), scale.score.begin(),
+                             scale.score.end());
+        objects.label.insert(objects.label.end(), scale.label.begin(),
+                             scale.label.end());
       }
+      // Filtering overlapping boxes of the same class
+      nms_param param;
+      param.iou_threshold = 0.4;
+      param.score_threshold = confidence_threshold;
+      nms.run(objects, param, keep);
       // Get the bboxes
-      for (auto& object : objects) {
-        bbox d;
-        ovn_log->trace("{} {} {} {} {} {}", object.class_id, object.confidence, object.xmin, object.ymin, object.xmax, object.ymax);
-        if (object.confidence < 0.4) continue;
-        auto label_id = object.class_id+1;
-        auto label = labels[label_id-1];
-        ovn_log->trace("Object: {}", label);
-        float confidence = object.confidence;
-        d.prop = confidence;
-        d.label_id = label_id;
-        d.label = std::move(label);
-        d.c[0] = object.xmin;
-        d.c[1] = object.ymin;
-        d.c[2] = object.xmax;
-        d.c[3] = object.ymax;
-        ret.push_back(std::move(d));
+      ret.reserve(keep.size());
+      for (int i : keep) {
+        ovn_log->trace("{} {} {} {} {} {}", objects.label[i], objects.score[i],
+                       objects.x1[i], objects.y1[i], objects.x2[i],
+                       objects.y2[i]);
+        ret.push_back(objects.label[i] + 1, objects.score[i],
+                      static_cast<int>(objects.x1[i]),
+                      static_cast<int>(objects.y1[i]),
+                      static_cast<int>(objects.x2[i]),
+                      static_cast<int>(objects.y2[i]));
       }
       end = std::chrono::system_clock::now();  // sync mode only
       elapsed_mil = end - start;
       ovn_log->debug("Parsing yolo output in {} ms", elapsed_mil.count());
-      return ret;
     } 
     catch (const cv::Exception& e) {
       std::cerr << e.what() << '\n';
-      return ret;
     }
   }
 
   using ptr = std::shared_ptr<openvino_yolo>;
 
 private:
+  float input_h = 0;                      //!< input height of the network
+  float input_w = 0;                      //!< input width of the network
+  std::vector<std::string> region_names;  //!< output names
+  std::vector<yolo_region> regions;       //!< parameters of the outputs
   /**
-   * @brief Yolo detection object
-   *
+   * @brief Read the region parameters from the network
+   * @details Anchors of each scale are selected by the "mask" of the layer.
+   * Layers without mask use the darknet convention: the coarsest grid takes
+   * the last anchors. Grid sides are taken from the output shape, so any
+   * input resolution works.
    */
-  struct detection_object {
-    int xmin, ymin, xmax, ymax, class_id;
-    float confidence;
-
-    detection_object(double x, double y, double h, double w, int class_id,
-                     float confidence, float h_scale, float w_scale) {
-      this->xmin = static_cast<int>((x - w / 2) * w_scale);
-      this->ymin = static_cast<int>((y - h / 2) * h_scale);
-      this->xmax = static_cast<int>(this->xmin + w * w_scale);
-      this->ymax = static_cast<int>(this->ymin + h * h_scale);
-      this->class_id = class_id;
-      this->confidence = confidence;
-    }
-
-    bool operator<(const detection_object& s2) const {
-      return this->confidence < s2.confidence;
-    }
-    bool operator>(const detection_object& s2) const {
-      return this->confidence > s2.confidence;
-    }
-  };
-  /**
-   * @brief
-   *
-   * @param side
-   * @param lcoords
-   * @param lclasses
-   * @param location
-   * @param entry
-   * @return int
-   */
-  static int entry_index(int side, int lcoords, int lclasses, int location,
-                         int entry) {
-    int n = location / (side * side);
-    int loc = location % (side * side);
-    return n * side * side * (lcoords + lclasses + 1) + entry * side * side +
-           loc;
-  }
-  /**
-   * @brief IOU
-   *
-   * @param box_1
-   * @param box_2
-   * @return double
-   */
-  double intersection_over_union(const detection_object& box_1,
-                                 const detection_object& box_2) {
-    double width_of_overlap_area =
-        fmin(box_1.xmax, box_2.xmax) - fmax(box_1.xmin, box_2.xmin);
-    double height_of_overlap_area =
-        fmin(box_1.ymax, box_2.ymax) - fmax(box_1.ymin, box_2.ymin);
-    double area_of_overlap;
-    if (width_of_overlap_area < 0 || height_of_overlap_area < 0)
-      area_of_overlap = 0;
-    else
-      area_of_overlap = width_of_overlap_area * height_of_overlap_area;
-    double box_1_area = (box_1.ymax - box_1.ymin) * (box_1.xmax - box_1.xmin);
-    double box_2_area = (box_2.ymax - box_2.ymin) * (box_2.xmax - box_2.xmin);
-    double area_of_union = box_1_area + box_2_area - area_of_overlap;
-    return area_of_overlap / area_of_union;
-  }
-  /**
-   * @brief Parsing YOLO output
-   *
-   * @param layer
-   * @param blob
-   * @param resized_im_h
-   * @param resized_im_w
-   * @param original_im_h
-   * @param original_im_w
-   * @param threshold
-   * @param objects
-   */
-  void parse_yolov3_output(const CNNLayerPtr& layer, const Blob::Ptr& blob,
-                           const unsigned long resized_im_h,
-                           const unsigned long resized_im_w,
-                           const unsigned long original_im_h,
-                           const unsigned long original_im_w,
-                           const double threshold,
-                           std::vector<detection_object>& objects) {
-    // --------------------------- Validating output parameters
-    // -------------------------------------
-    if (layer->type != "RegionYolo")
-      throw std::runtime_error("Invalid output type: " + layer->type +
-                               ". RegionYolo expected");
-    const int out_blob_h = static_cast<int>(blob->getTensorDesc().getDims()[2]);
-    const int out_blob_w = static_cast<int>(blob->getTensorDesc().getDims()[3]);
-    if (out_blob_h != out_blob_w)
-      throw std::runtime_error("Invalid size of output " + layer->name +
-                               " It should be in NCHW layout and H should be "
-                               "equal to W. Current H = " +
-                               std::to_string(out_blob_h) + ", current W = " +
-                               std::to_string(out_blob_h));
-    // --------------------------- Extracting layer parameters
-    // -------------------------------------
-    auto num = layer->GetParamAsInt("num");
-    try {
-      num = layer->GetParamAsInts("mask").size();
-    } catch (...) {
-    }
-    auto coords = layer->GetParamAsInt("coords");
-    auto classes = layer->GetParamAsInt("classes");
-    std::vector<float> anchors = {10.0,  13.0, 16.0,  30.0,  33.0,  23.0,
-                                  30.0,  61.0, 62.0,  45.0,  59.0,  119.0,
-                                  116.0, 90.0, 156.0, 198.0, 373.0, 326.0};
-    try {
-      anchors = layer->GetParamAsFloats("anchors");
-    } catch (...) {
+  void init_regions() {
+    auto input_info = InputsDataMap(network.getInputsInfo());
+    for (auto& item : input_info) {
+      auto dims = item.second->getTensorDesc().getDims();
+      if (dims.size() == 4) {
+        input_h = dims[2];
+        input_w = dims[3];
+      }
     }
-    auto side = out_blob_h;
-    int anchor_offset = 0;
-    std::cout << side << std::endl;
-    switch (side) {
-      case 13:
-        anchor_offset = 2 * 6;
-        break;
-      case 26:
-        anchor_offset = 2 * 3;
-        break;
-      case 52:
-        anchor_offset = 2 * 0;
-        break;
-      default:
-        throw std::runtime_error("Invalid output size");
+    auto output_info = OutputsDataMap(network.getOutputsInfo());
+    std::vector<std::vector<float>> all_anchors;
+    std::vector<int> masked;
+    for (auto& output : output_info) {
+      CNNLayerPtr layer = get_layer(output.first.c_str());
+      if (layer->type != "RegionYolo")
+        throw std::runtime_error("Invalid output type: " + layer->type +
+                                 ". RegionYolo expected");
+      auto dims = output.second->getTensorDesc().getDims();
+      yolo_region r;
+      r.side_h = dims[2];
+      r.side_w = dims[3];
+      r.coords = layer->GetParamAsInt("coords");
+      r.classes = layer->GetParamAsInt("classes");
+      std::vector<float> anchors = {10.0,  13.0, 16.0,  30.0,  33.0,  23.0,
+                                    30.0,  61.0, 62.0,  45.0,  59.0,  119.0,
+                                    116.0, 90.0, 156.0, 198.0, 373.0, 326.0};
+      try {
+        anchors = layer->GetParamAsFloats("anchors");
+      } catch (...) {
+      }
+      std::vector<int> mask;
+      try {
+        mask = layer->GetParamAsInts("mask");
+      } catch (...) {
+      }
+      for (int m : mask) {
+        r.anchors.push_back(anchors[2 * m]);
+        r.anchors.push_back(anchors[2 * m + 1]);
+      }
+      if (mask.empty()) {
+        // filled below, when we know the rank of this scale
+        r.anchors.resize(2 * layer->GetParamAsInt("num"));
+      }
+      masked.push_back(!mask.empty());
+      all_anchors.push_back(anchors);
+      region_names.push_back(output.first);
+      regions.push_back(r);
     }
-    auto side_square = side * side;
-    const float* output_blob =
-        blob->buffer().as<PrecisionTrait<Precision::FP32>::value_type*>();
-    // --------------------------- Parsing YOLO Region output
-    // -------------------------------------
-    for (int i = 0; i < side_square; ++i) {
-      int row = i / side;
-      int col = i % side;
-      for (int n = 0; n < num; ++n) {
-        int obj_index =
-            entry_index(side, coords, classes, n * side * side + i, coords);
-        int box_index =
-            entry_index(side, coords, classes, n * side * side + i, 0);
-        float scale = output_blob[obj_index];
-        if (scale < threshold) continue;
-        double x = (col + output_blob[box_index + 0 * side_square]) / side *
-                   resized_im_w;
-        double y = (row + output_blob[box_index + 1 * side_square]) / side *
-                   resized_im_h;
-        double height = std::exp(output_blob[box_index + 3 * side_square]) *
-                        anchors[anchor_offset + 2 * n + 1];
-        double width = std::exp(output_blob[box_index + 2 * side_square]) *
-                       anchors[anchor_offset + 2 * n];
-        for (int j = 0; j < classes; ++j) {
-          int class_index = entry_index(side, coords, classes,
-                                        n * side_square + i, coords + 1 + j);
-          float prob = scale * output_blob[class_index];
-          if (prob < threshold) continue;
-          detection_object obj(x, y, height, width, j, prob,
-                               static_cast<float>(original_im_h) /
-                                   static_cast<float>(resized_im_h),
-                               static_cast<float>(original_im_w) /
-                                   static_cast<float>(resized_im_w));
-          objects.push_back(obj);
-        }
+    const int num_scales = regions.size();
+    for (int i = 0; i < num_scales; ++i) {
+      if (masked[i]) continue;
+      // the finest grid takes the first anchors
+      int rank = 0;
+      for (int j = 0; j < num_scales; ++j) {
+        rank += regions[j].side_h > regions[i].side_h;
       }
+      const int num = regions[i].num();
+      const int offset = rank * num;
+      if (2 * (offset + num) > static_cast<int>(all_anchors[i].size()))
+        throw std::runtime_error("Not enough anchors for output " +
+                                 region_names[i]);
+      std::copy(all_anchors[i].begin() + 2 * offset,
+                all_anchors[i].begin() + 2 * (offset + num),
+                regions[i].anchors.begin());
+    }
+    for (int i = 0; i < num_scales; ++i) {
+      ovn_log->info("YOLO output {}: grid {}x{}, {} anchors, {} classes",
+                    region_names[i], regions[i].side_h, regions[i].side_w,
+                    regions[i].num(), regions[i].classes);
     }
   }
 };  // class openvino_yolo
@@ -701,8 +697,23 @@ public:
   }
 
   // frcnn detection parser implementation
-  std::vector<bbox> detection_parser(network_output& net_out) final {
-    std::vector<bbox> ret = {};  // return value
+  void detection_parser(network_output& net_out,
+                        detection_result& ret) final {
+    reset_result(ret);
+    parse_output(net_out, ret);
+  }
+  void json_parser(network_output& net_out, detection_result& ret) final {
+    ret.clear();
+    detection_json_writer out(ret.json, labels.get());
+    parse_output(net_out, out);
+    out.finish();
+  }
+  /**
+   * @brief Parse the output into the arrays or the JSON body
+   *
+   */
+  template <class Out>
+  void parse_output(network_output& net_out, Out& ret) {
     try {
       std::chrono::time_point<std::chrono::system_clock> start;
       std::chrono::time_point<std::chrono::system_clock> end;
@@ -719,39 +730,15 @@ public:
       auto dims = blob->dims();
       const int maxProposalCount = dims[1];
       const int objectSize = dims[0];
-      for (int i = 0; i < maxProposalCount; i++) {
-        float image_id = detections[i * objectSize + 0];
-        if (image_id < 0) {
-          break;
-        }
-        float confidence = detections[i * objectSize + 2];
-        auto label_id = static_cast<int>(detections[i * objectSize + 1]);
-        int xmin = detections[i * objectSize + 3] * width;
-        int ymin = detections[i * objectSize + 4] * height;
-        int xmax = detections[i * objectSize + 5] * width;
-        int ymax = detections[i * objectSize + 6] * height;
-        auto label = labels[label_id - 1];
-
-        if (confidence > 0.45) {
-          bbox d;
-          d.prop = confidence;
-          d.label_id = label_id;
-          d.label = std::move(label);
-          d.c[0] = xmin;
-          d.c[1] = ymin;
-          d.c[2] = xmax;
-          d.c[3] = ymax;
-          ret.push_back(std::move(d));
-        }
-      }
+      detection_output_parser::parse(detections, maxProposalCount, objectSize,
+                                     width, height, confidence_threshold,
+                                     ret);
       end = std::chrono::system_clock::now();  // sync mode only
       elapsed_mil = end - start;
       ovn_log->debug("Parsing network output in {} ms", elapsed_mil.count());
-      return ret;
     } 
     catch (const cv::Exception& e) {
       std::cerr << "Error: " << e.what() << std::endl;
-      return ret;
     }
   }
 
@@ -801,10 +788,33 @@ class openvino_anynet_classification : public openvino_inference_engine {
     load_network(model);
     init_IO(Precision::U8, Layout::NCHW);
     set_labels(label);
+    confidence_threshold = 0.01;
+  }
+
+  // read the top-k parameters of the classification
+  void configure(const JSON& model) override {
+    openvino_inference_engine::configure(model);
+    top_k = model.get<int>("top k", top_k);
+    softmax = model.get<bool>("softmax", softmax);
   }
 
-  std::vector<bbox> detection_parser(network_output& net_out) final {
-    std::vector<bbox> ret = {};  // return value
+  void detection_parser(network_output& net_out,
+                        detection_result& ret) final {
+    reset_result(ret);
+    parse_output(net_out, ret);
+  }
+  void json_parser(network_output& net_out, detection_result& ret) final {
+    ret.clear();
+    detection_json_writer out(ret.json, labels.get());
+    parse_output(net_out, out);
+    out.finish();
+  }
+  /**
+   * @brief Parse the output into the arrays or the JSON body
+   *
+   */
+  template <class Out>
+  void parse_output(network_output& net_out, Out& ret) {
     try {
       ovn_log->debug("Parsing classification output");
       std::chrono::time_point<std::chrono::system_clock> start;
@@ -819,39 +829,31 @@ class openvino_anynet_classification : public openvino_inference_engine {
           blob->buffer().as<PrecisionTrait<Precision::FP32>::value_type*>();
       auto dims = blob->dims();
       int num_class = dims[0];
-      std::vector<int> idx(num_class);
       ovn_log->trace("Number of classes: {}", num_class);
-      std::iota(idx.begin(), idx.end(), 0);
-      auto comp = [&](int x, int y) {
-        return scores[x] > scores[y];
-      };
-      std::sort(idx.begin(), idx.end(), comp);
-      for (int i = 0; i < 10; i++) {
-        int cls_id = idx[i];
-        float confidence = scores[cls_id];
-        ovn_log->trace("{} {} {}", i, cls_id, confidence);
-        if (cls_id <= 0) break;
-        auto label = labels[cls_id - 1];
-        ovn_log->trace("Class: {}", label);
-        if (confidence > 0.01) {
-          bbox d;
-          d.prop = confidence;
-          d.label_id = cls_id;
-          d.label = std::move(label);
-          ret.push_back(std::move(d));
-        }
+      // the parser may run in several post-processing threads. Scores of
+      // image b of a batch start at scores + b * num_class, we run batch 1
+      static thread_local topk_selector selector;
+      static thread_local std::vector<topk_selector::item> best;
+      // class 0 is the background
+      selector.run(scores, num_class, top_k, confidence_threshold, softmax, 1,
+                   best);
+      for (auto& b : best) {
+        ovn_log->trace("{} {}", b.first, b.second);
+        // strictly above the threshold, as before
+        if (b.second <= confidence_threshold) continue;
+        ret.push_back(b.first, b.second);
       }
       end = std::chrono::system_clock::now();  // sync mode only
       elapsed_mil = end - start;
       ovn_log->debug("Parsing network output in {} ms", elapsed_mil.count());
-      return ret;
     }
     catch (const cv::Exception& e) {
       std::cerr << "Error: " << e.what() << std::endl;
-      return ret;
     }
   }
   private:
+  int top_k = 10;        //!< number of reported classes
+  bool softmax = false;  //!< the network outputs logits
 }; // class openvino_anynet_classification
 }  // namespace ie
 }  // namespace st
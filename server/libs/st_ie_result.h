@@ -0,0 +1,135 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the result of a detection: label ids,
+ * scores and boxes in structure-of-arrays layout, and the interned label
+ * table of the engine that produced it.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief Class names of a model, interned when the engine loads them
+ * @details Immutable and shared by all the results of the engine, so a
+ * detection only holds its label id. Label id i is the name at i - 1, id 0
+ * is the background
+ */
+class label_table {
+ public:
+  label_table() = default;
+  explicit label_table(std::vector<std::string> _names)
+      : names(std::move(_names)) {}
+  /**
+   * @brief Name of a label id, empty if the id is not in the table
+   *
+   */
+  const std::string& name(int label_id) const {
+    static const std::string unknown;
+    if (label_id <= 0 || label_id > size()) return unknown;
+    return names[label_id - 1];
+  }
+  int size() const { return names.size(); }
+  using ptr = std::shared_ptr<const label_table>;
+
+ private:
+  std::vector<std::string> names;  //!< class names
+};
+
+/**
+ * @brief Detections of an image in structure-of-arrays layout
+ * @details A detection is a label id, a confidence score and a box; the
+ * results of a classification have no box, i.e. all coordinates are zero.
+ * The names of the labels are only looked up in the table of the engine
+ * when the result is written, so a detection costs no allocation. For a
+ * message that asks for the JSON body of the HTTP API, an engine with a
+ * fused parser writes the body instead of the arrays, see st_ie_json.h
+ */
+struct detection_result {
+  std::vector<int> label_id;  //!< label id, see label_table
+  std::vector<float> score;   //!< confidence score
+  std::vector<int> x1;        //!< xmin
+  std::vector<int> y1;        //!< ymin
+  std::vector<int> x2;        //!< xmax
+  std::vector<int> y2;        //!< ymax
+  label_table::ptr labels;    //!< labels of the engine
+  std::string json;           //!< body written by a fused parser, if any
+  /**
+   * @brief Append a detection, without box for a classification
+   *
+   */
+  void push_back(int _label_id, float _score, int _x1 = 0, int _y1 = 0,
+                 int _x2 = 0, int _y2 = 0) {
+    label_id.push_back(_label_id);
+    score.push_back(_score);
+    x1.push_back(_x1);
+    y1.push_back(_y1);
+    x2.push_back(_x2);
+    y2.push_back(_y2);
+  }
+  /**
+   * @brief Append detection i of another result
+   *
+   */
+  void push_back(const detection_result& rhs, size_t i) {
+    push_back(rhs.label_id[i], rhs.score[i], rhs.x1[i], rhs.y1[i], rhs.x2[i],
+              rhs.y2[i]);
+  }
+  void reserve(size_t n) {
+    label_id.reserve(n);
+    score.reserve(n);
+    x1.reserve(n);
+    y1.reserve(n);
+    x2.reserve(n);
+    y2.reserve(n);
+  }
+  /**
+   * @brief Remove all detections but keep the memory
+   *
+   */
+  void clear() {
+    label_id.clear();
+    score.clear();
+    x1.clear();
+    y1.clear();
+    x2.clear();
+    y2.clear();
+    labels.reset();
+    json.clear();
+  }
+  void swap(detection_result& rhs) {
+    label_id.swap(rhs.label_id);
+    score.swap(rhs.score);
+    x1.swap(rhs.x1);
+    y1.swap(rhs.y1);
+    x2.swap(rhs.x2);
+    y2.swap(rhs.y2);
+    labels.swap(rhs.labels);
+    json.swap(rhs.json);
+  }
+  size_t size() const { return score.size(); }
+  bool empty() const { return score.empty(); }
+  /**
+   * @brief Whether detection i has a box, ymax should never be zero
+   *
+   */
+  bool has_box(size_t i) const { return y2[i] != 0; }
+  /**
+   * @brief Name of the label of detection i
+   *
+   */
+  const std::string& label(size_t i) const {
+    static const std::string unknown;
+    return labels ? labels->name(label_id[i]) : unknown;
+  }
+};
+
+}  // namespace ie
+}  // namespace st
@@ -0,0 +1,80 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement an inference engine with a synthetic
+ * latency. It does not run any network, it sleeps for a configured time
+ * then returns no detection, so the scheduling of the server (queues,
+ * routing, deadlines) can be tried on a machine without any accelerator.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "st_ie_base.h"
+#include "st_logging.h"
+
+using namespace st::log;
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief Inference engine with a synthetic latency
+ * @details latency = "latency ms" + "latency ms per mb" x input size, times
+ * a uniform jitter of +/- "jitter" (fraction)
+ */
+class synthetic_inference_engine : public inference_engine {
+ public:
+  void run_detection(const char* data, int size,
+                     detection_result& ret) final {
+    wait(size);
+    ret.clear();
+  }
+
+  deferred_detection run_inference(const char* data, int size) final {
+    wait(size);
+    return [](detection_result& ret) { ret.clear(); };
+  }
+
+  void run_detection(const cv::Mat& image, detection_result& ret) final {
+    wait(image.total() * image.elemSize());
+    ret.clear();
+  }
+
+  deferred_detection run_inference(const cv::Mat& image) final {
+    wait(image.total() * image.elemSize());
+    return [](detection_result& ret) { ret.clear(); };
+  }
+
+  void configure(const JSON& model) override {
+    inference_engine::configure(model);
+    latency_ms = model.get<double>("latency ms", latency_ms);
+    latency_ms_per_mb = model.get<double>("latency ms per mb", latency_ms_per_mb);
+    jitter = model.get<double>("jitter", jitter);
+    ie_log->info("Synthetic engine: {} ms + {} ms/MB, jitter {}", latency_ms,
+                 latency_ms_per_mb, jitter);
+  }
+
+  using ptr = std::shared_ptr<synthetic_inference_engine>;
+
+ private:
+  double latency_ms = 10;        //!< fixed latency
+  double latency_ms_per_mb = 0;  //!< latency per MB of input
+  double jitter = 0;             //!< relative jitter of the latency
+  std::minstd_rand rng;          //!< one engine is used by one worker
+  void wait(double bytes) {
+    double ms = latency_ms + latency_ms_per_mb * bytes / (1 << 20);
+    if (jitter > 0) {
+      std::uniform_real_distribution<double> u(-jitter, jitter);
+      ms *= 1 + u(rng);
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        static_cast<int64_t>(ms * 1000)));
+  }
+};
+
+}  // namespace ie
+}  // namespace st
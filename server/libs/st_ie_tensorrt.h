@@ -19,6 +19,8 @@
 #include "st_ie_base.h"
 #include "st_ie_buffer.h"
 #include "st_ie_common.h"
+#include "st_ie_detection_output.h"
+#include "st_ie_json.h"
 #include "st_logging.h"
 
 using namespace nvinfer1;
@@ -42,20 +44,68 @@ public:
   /*       Implement of inference engine public interface   */
   /**********************************************************/
 
-  std::vector<bbox> run_detection(const char* data, int size) final {
+  void run_detection(const char* data, int size,
+                     detection_result& ret) final {
     auto iobuf = do_infer(data,size);
-    return detection_parser(std::move(iobuf));
+    detection_parser(std::move(iobuf), ret);
+  }
+
+  deferred_detection run_inference(const char* data, int size) final {
+    // the IO buffers are allocated per call, so the parser can own them
+    std::shared_ptr<buffer_manager> iobuf = do_infer(data, size);
+    return [this, iobuf](detection_result& ret) {
+      detection_parser(iobuf, ret);
+    };
+  }
+
+  void run_detection(const cv::Mat& image, detection_result& ret) final {
+    auto iobuf = do_infer(image);
+    detection_parser(std::move(iobuf), ret);
+  }
+
+  deferred_detection run_inference(const cv::Mat& image) final {
+    std::shared_ptr<buffer_manager> iobuf = do_infer(image);
+    return [this, iobuf](detection_result& ret) {
+      detection_parser(iobuf, ret);
+    };
+  }
+
+  void run_detection_json(const char* data, int size,
+                          detection_result& ret) final {
+    auto iobuf = do_infer(data, size);
+    if (fused_json) {
+      json_parser(std::move(iobuf), ret);
+    } else {
+      detection_parser(std::move(iobuf), ret);
+    }
+  }
+
+  deferred_detection run_inference_json(const char* data, int size) final {
+    if (!fused_json) return run_inference(data, size);
+    std::shared_ptr<buffer_manager> iobuf = do_infer(data, size);
+    return [this, iobuf](detection_result& ret) { json_parser(iobuf, ret); };
   }
 
   /**
    * @brief Parse the output detection network
    * 
    * @param iobuf 
-   * @return std::vector<bbox> 
+   * @param ret replaced by the detections, its buffers are reused
    */
-  virtual std::vector<bbox> detection_parser(
-      std::unique_ptr<buffer_manager>&& iobuf) {
-    return {};
+  virtual void detection_parser(std::shared_ptr<buffer_manager> iobuf,
+                                detection_result& ret) {
+    reset_result(ret);
+  }
+
+  /**
+   * @brief Parse the output detection network into the JSON body
+   * @details By default, the arrays are parsed and serialized later
+   * @param iobuf
+   * @param ret replaced by the body, its buffers are reused
+   */
+  virtual void json_parser(std::shared_ptr<buffer_manager> iobuf,
+                           detection_result& ret) {
+    detection_parser(std::move(iobuf), ret);
   }
 
   using ptr = std::shared_ptr<tensorrt_inference_engine>;
@@ -101,9 +151,6 @@ protected:
    */
   virtual std::unique_ptr<buffer_manager> do_infer(const char* data, int size) {
     try {
-      // create execution context with memory allocation for all
-      // activations (laten features)
-      assert(context);
       std::chrono::time_point<std::chrono::system_clock> start;
       std::chrono::time_point<std::chrono::system_clock> end;
       std::chrono::duration<double, std::milli> elapsed_mil;
@@ -112,11 +159,35 @@ protected:
       cv::Mat frame =
           cv::imdecode(cv::Mat(1, size, CV_8UC3, (unsigned char*)data),
                         cv::IMREAD_UNCHANGED);
-      const int width = frame.size().width;
-      const int height = frame.size().height;
       end = std::chrono::system_clock::now();
       elapsed_mil = end - start;
       trt_log->debug("Decode image in {} ms", elapsed_mil.count());
+      return do_infer(frame);
+    }
+    catch(const cv::Exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return {};
+    }
+  }
+
+  /**
+   * @brief Do the inference on a decoded image
+   * @details The image can be a region of interest of a larger image, only
+   * its header is copied
+   * @param image
+   * @return std::unique_ptr<buffer_manager>
+   */
+  virtual std::unique_ptr<buffer_manager> do_infer(const cv::Mat& image) {
+    try {
+      // create execution context with memory allocation for all
+      // activations (laten features)
+      assert(context);
+      std::chrono::time_point<std::chrono::system_clock> start;
+      std::chrono::time_point<std::chrono::system_clock> end;
+      std::chrono::duration<double, std::milli> elapsed_mil;
+      cv::Mat frame = image;
+      const int width = frame.size().width;
+      const int height = frame.size().height;
       // prepare input and output buffer, just like in ovn
       // but here we need to handle it ourself, i.e. allocate and dealocate the
       // input and output blob memory --> RAII buffer
@@ -163,14 +234,30 @@ public:
     build_engine(serialized_model);
     set_labels(label);
   }
-  std::vector<bbox> detection_parser (std::unique_ptr<buffer_manager>&& _iobuf) final {
+  void detection_parser(std::shared_ptr<buffer_manager> _iobuf,
+                        detection_result& ret) final {
+    reset_result(ret);
+    parse_output(std::move(_iobuf), ret);
+  }
+  void json_parser(std::shared_ptr<buffer_manager> _iobuf,
+                   detection_result& ret) final {
+    ret.clear();
+    detection_json_writer out(ret.json, labels.get());
+    parse_output(std::move(_iobuf), out);
+    out.finish();
+  }
+  /**
+   * @brief Parse the output into the arrays or the JSON body
+   *
+   */
+  template <class Out>
+  void parse_output(std::shared_ptr<buffer_manager> _iobuf, Out& ret) {
     trt_log->debug("Parsing ssd output");
     std::chrono::time_point<std::chrono::system_clock> start;
     std::chrono::time_point<std::chrono::system_clock> end;
     std::chrono::duration<double, std::milli> elapsed_mil;
     start = std::chrono::system_clock::now();  // sync mode only
     auto iobuf = std::move(_iobuf);
-    std::vector<bbox> ret;
     // get the right output
     int ix = 0;
     for (ix = 0; ix < engine->getNbBindings(); ++ix) {
@@ -183,37 +270,11 @@ public:
     trt_log->trace("TopK {}, object size {}", maxProposalCount, objectSize);    
     auto sz = iobuf->get_im_size();
     const int width = sz.first, height = sz.second;
-    for (int i = 0; i < maxProposalCount; i++) {
-      float image_id = detections[i * objectSize + 0];
-      if (image_id < 0) {
-        break;
-      }
-      float confidence = detections[i * objectSize + 2];
-      auto label_id = static_cast<int>(detections[i * objectSize + 1]);
-      if (label_id <= 0) break;
-      int xmin = detections[i * objectSize + 3] * width;
-      int ymin = detections[i * objectSize + 4] * height;
-      int xmax = detections[i * objectSize + 5] * width;
-      int ymax = detections[i * objectSize + 6] * height;
-      trt_log->trace("{} {} {} {} {} {} {} {}", i, image_id, label_id, confidence, xmin, ymin, xmax, ymax);
-      auto label = labels[label_id-1];
-      trt_log->trace("Object: {}", label);
-      if (confidence > 0.45) {
-        bbox d;
-        d.prop = confidence;
-        d.label_id = label_id;
-        d.label = label;
-        d.c[0] = xmin;
-        d.c[1] = ymin;
-        d.c[2] = xmax;
-        d.c[3] = ymax;
-        ret.push_back(d);
-      }
-    }
+    detection_output_parser::parse(detections, maxProposalCount, objectSize,
+                                   width, height, confidence_threshold, ret);
     end = std::chrono::system_clock::now();  // sync mode only
     elapsed_mil = end - start;
     trt_log->debug("Parsing network output in {} ms", elapsed_mil.count());
-    return ret;
   }
 };
 
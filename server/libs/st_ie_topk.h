@@ -0,0 +1,140 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement top-k selection over classification scores,
+ * with an optional fused softmax. The scores are scanned with SIMD against the
+ * smallest score of a k-element min-heap, so only the few scores that can
+ * enter the heap are handled one by one.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief Top-k selector
+ * @details The selector owns its heap, so it does not allocate once warmed
+ * up. It's not thread-safe, use one selector per thread.
+ */
+class topk_selector {
+ public:
+  using item = std::pair<int, float>;  //!< class index, score
+  /**
+   * @brief Select the k best classes of one image
+   *
+   * @param scores scores of all classes
+   * @param n number of classes
+   * @param k number of classes to select
+   * @param min_score minimum score (probability if softmax) to be selected
+   * @param softmax scores are logits, report softmax probabilities
+   * @param first first class that can be selected, e.g. 1 to skip background
+   * @param out selected classes by decreasing score
+   */
+  void run(const float* scores, const int n, const int k,
+           const float min_score, const bool softmax, const int first,
+           std::vector<item>& out) {
+    out.clear();
+    heap.clear();
+    if (k <= 0 || first >= n) return;
+    // with softmax, selection is done on logits: p >= min_score
+    // <=> x >= max + log(min_score * sum)
+    float max_logit = 0, sum = 1;
+    float thr = min_score;
+    if (softmax) {
+      max_logit = max_scan(scores, n);
+      sum = 0;
+      for (int i = 0; i < n; ++i) sum += std::exp(scores[i] - max_logit);
+      thr = min_score > 0 ? max_logit + std::log(min_score * sum)
+                          : -std::numeric_limits<float>::infinity();
+    }
+    // scores strictly below thr never enter the heap
+    scan(scores, first, n, k, thr);
+    std::sort_heap(heap.begin(), heap.end(), greater);
+    for (auto& h : heap) {
+      float p = softmax ? std::exp(h.second - max_logit) / sum : h.second;
+      out.push_back({h.first, p});
+    }
+  }
+
+ private:
+  std::vector<item> heap;  //!< min-heap of the best k
+  static bool greater(const item& a, const item& b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  }
+  /**
+   * @brief Push i into the heap if it's in the k best
+   * @return the smallest score of the heap if it's full, else thr
+   */
+  float offer(const float* scores, int i, int k, float thr) {
+    if (scores[i] < thr) return thr;
+    if (static_cast<int>(heap.size()) < k) {
+      heap.push_back({i, scores[i]});
+      std::push_heap(heap.begin(), heap.end(), greater);
+    } else if (scores[i] > heap.front().second) {
+      std::pop_heap(heap.begin(), heap.end(), greater);
+      heap.back() = {i, scores[i]};
+      std::push_heap(heap.begin(), heap.end(), greater);
+    }
+    if (static_cast<int>(heap.size()) < k) return thr;
+    return std::max(thr, heap.front().second);
+  }
+  void scan(const float* scores, int b, int e, int k, float thr) {
+    int i = b;
+#if defined(__AVX__)
+    for (; i + 8 <= e; i += 8) {
+      unsigned m = _mm256_movemask_ps(_mm256_cmp_ps(
+          _mm256_loadu_ps(scores + i), _mm256_set1_ps(thr), _CMP_GE_OQ));
+      for (; m; m &= m - 1) thr = offer(scores, i + __builtin_ctz(m), k, thr);
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= e; i += 4) {
+      unsigned m = _mm_movemask_ps(
+          _mm_cmpge_ps(_mm_loadu_ps(scores + i), _mm_set1_ps(thr)));
+      for (; m; m &= m - 1) thr = offer(scores, i + __builtin_ctz(m), k, thr);
+    }
+#endif
+    for (; i < e; ++i) thr = offer(scores, i, k, thr);
+  }
+  static float max_scan(const float* scores, int n) {
+    int i = 0;
+    float ret = -std::numeric_limits<float>::infinity();
+#if defined(__AVX__)
+    if (n >= 8) {
+      __m256 m = _mm256_loadu_ps(scores);
+      for (i = 8; i + 8 <= n; i += 8) {
+        m = _mm256_max_ps(m, _mm256_loadu_ps(scores + i));
+      }
+      float lanes[8];
+      _mm256_storeu_ps(lanes, m);
+      ret = *std::max_element(lanes, lanes + 8);
+    }
+#elif defined(__SSE2__)
+    if (n >= 4) {
+      __m128 m = _mm_loadu_ps(scores);
+      for (i = 4; i + 4 <= n; i += 4) {
+        m = _mm_max_ps(m, _mm_loadu_ps(scores + i));
+      }
+      float lanes[4];
+      _mm_storeu_ps(lanes, m);
+      ret = *std::max_element(lanes, lanes + 4);
+    }
+#endif
+    for (; i < n; ++i) ret = std::max(ret, scores[i]);
+    return ret;
+  }
+};
+
+}  // namespace ie
+}  // namespace st
@@ -0,0 +1,173 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the decoder of YOLO v3 region outputs. The
+ * objectness planes are scanned with SIMD, and class scores are computed for
+ * a whole vector of cells at once, so the exponential is only evaluated for
+ * cells that pass the objectness threshold.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "st_ie_nms.h"
+
+namespace st {
+namespace ie {
+
+/**
+ * @brief Parameters of one YOLO region (one output scale)
+ * @details Layout of the region output is [anchor][entry][side_h][side_w]
+ * with entry = x, y, w, h, objectness, class scores; x, y, objectness and
+ * class scores are already activated by the network
+ */
+struct yolo_region {
+  int side_h = 0;              //!< grid height
+  int side_w = 0;              //!< grid width
+  int coords = 4;              //!< number of box coordinates
+  int classes = 0;             //!< number of classes
+  std::vector<float> anchors;  //!< (w, h) of the anchors of this scale
+  int num() const { return anchors.size() / 2; }
+};
+
+/**
+ * @brief Decoder of YOLO v3 region outputs
+ *
+ */
+class yolo_decoder {
+ public:
+  /**
+   * @brief Decode one region output
+   *
+   * @param out raw output of the region layer
+   * @param r region parameters
+   * @param resized_im_h input height of the network
+   * @param resized_im_w input width of the network
+   * @param original_im_h height of the original image
+   * @param original_im_w width of the original image
+   * @param threshold minimum objectness and class confidence
+   * @param objects candidates in original image coordinates, appended
+   */
+  static void decode(const float* out, const yolo_region& r,
+                     const float resized_im_h, const float resized_im_w,
+                     const float original_im_h, const float original_im_w,
+                     const float threshold, nms_boxes& objects) {
+    const int plane = r.side_h * r.side_w;
+    const int entries = r.coords + r.classes + 1;
+    // grid cell -> original image coordinate
+    const float gx = resized_im_w / r.side_w * (original_im_w / resized_im_w);
+    const float gy = resized_im_h / r.side_h * (original_im_h / resized_im_h);
+    const float sw = original_im_w / resized_im_w;
+    const float sh = original_im_h / resized_im_h;
+    cell_box box;
+    for (int n = 0; n < r.num(); ++n) {
+      const float* base = out + n * plane * entries;
+      const float* obj = base + r.coords * plane;
+      const float* cls = obj + plane;
+      const float aw = r.anchors[2 * n] * sw;
+      const float ah = r.anchors[2 * n + 1] * sh;
+      int loc = 0;
+      // whole vectors of cells
+      for (; loc + lanes <= plane; loc += lanes) {
+        unsigned mask = scan(obj + loc, threshold);
+        if (!mask) continue;
+        // boxes of the cells that pass the objectness threshold only
+        for (unsigned m = mask; m; m &= m - 1) {
+          int l = ctz(m);
+          box.set(l, base, plane, loc + l, r.side_w, gx, gy, aw, ah);
+        }
+        for (int j = 0; j < r.classes; ++j) {
+          unsigned hits =
+              mask & scan_product(obj + loc, cls + j * plane + loc, threshold);
+          for (; hits; hits &= hits - 1) {
+            int l = ctz(hits);
+            objects.push_back(box.x1[l], box.y1[l], box.x2[l], box.y2[l],
+                              obj[loc + l] * cls[j * plane + loc + l], j);
+          }
+        }
+      }
+      // the remaining cells
+      for (; loc < plane; ++loc) {
+        const float scale = obj[loc];
+        if (scale < threshold) continue;
+        box.set(0, base, plane, loc, r.side_w, gx, gy, aw, ah);
+        for (int j = 0; j < r.classes; ++j) {
+          float prob = scale * cls[j * plane + loc];
+          if (prob < threshold) continue;
+          objects.push_back(box.x1[0], box.y1[0], box.x2[0], box.y2[0], prob,
+                            j);
+        }
+      }
+    }
+  }
+
+ private:
+#if defined(__AVX__)
+  static constexpr int lanes = 8;
+#elif defined(__SSE2__)
+  static constexpr int lanes = 4;
+#else
+  static constexpr int lanes = 1;
+#endif
+  /**
+   * @brief Boxes of the cells in a vector, in original image coordinates
+   *
+   */
+  struct cell_box {
+    float x1[lanes], y1[lanes], x2[lanes], y2[lanes];
+    void set(int l, const float* base, int plane, int loc, int side_w,
+             float gx, float gy, float aw, float ah) {
+      const int row = loc / side_w;
+      const int col = loc % side_w;
+      const float x = (col + base[loc]) * gx;
+      const float y = (row + base[plane + loc]) * gy;
+      const float w = std::exp(base[2 * plane + loc]) * aw;
+      const float h = std::exp(base[3 * plane + loc]) * ah;
+      x1[l] = x - w / 2;
+      y1[l] = y - h / 2;
+      x2[l] = x + w / 2;
+      y2[l] = y + h / 2;
+    }
+  };
+  static int ctz(unsigned m) { return __builtin_ctz(m); }
+  /**
+   * @brief Bit mask of v[i] >= t
+   *
+   */
+  static unsigned scan(const float* v, float t) {
+#if defined(__AVX__)
+    return _mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(v), _mm256_set1_ps(t), _CMP_GE_OQ));
+#elif defined(__SSE2__)
+    return _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(v), _mm_set1_ps(t)));
+#else
+    return v[0] >= t;
+#endif
+  }
+  /**
+   * @brief Bit mask of a[i] * b[i] >= t
+   *
+   */
+  static unsigned scan_product(const float* a, const float* b, float t) {
+#if defined(__AVX__)
+    return _mm256_movemask_ps(_mm256_cmp_ps(
+        _mm256_mul_ps(_mm256_loadu_ps(a), _mm256_loadu_ps(b)),
+        _mm256_set1_ps(t), _CMP_GE_OQ));
+#elif defined(__SSE2__)
+    return _mm_movemask_ps(_mm_cmpge_ps(
+        _mm_mul_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)), _mm_set1_ps(t)));
+#else
+    return a[0] * b[0] >= t;
+#endif
+  }
+};
+
+}  // namespace ie
+}  // namespace st
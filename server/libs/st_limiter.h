@@ -0,0 +1,219 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the adaptive concurrency limiter of the
+ * server. The number of requests in flight is capped by a limit that
+ * follows the measured latency: it grows while the latency stays at its
+ * baseline and shrinks as soon as requests queue up, so the server finds
+ * its own capacity for the current mix of image sizes. Requests over the
+ * limit are rejected right away.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_metrics.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+
+/**
+ * @brief Parameters of the concurrency limiter
+ *
+ */
+struct limiter_param {
+  bool gradient = true;    //!< gradient algorithm, otherwise AIMD
+  int initial_limit = 20;  //!< limit before any measurement
+  int min_limit = 1;       //!< the limit never goes under it
+  int max_limit = 1000;    //!< the limit never goes over it
+  double tolerance = 1.5;  //!< latency over baseline that is not queueing
+  double smoothing = 0.2;  //!< weight of a new limit (gradient)
+  double backoff = 0.9;    //!< factor of a decrease, AIMD or expired
+  int window = 600;        //!< samples of the baseline latency average
+};
+
+/**
+ * @brief Adaptive concurrency limiter
+ * @details Thread-safe, one object is shared by all request threads.
+ * The baseline is a slow moving average of the latency, compared with each
+ * new sample:
+ * - gradient: limit = limit x min(1, tolerance x baseline / latency) +
+ * sqrt(limit), smoothed, i.e. the limit converges where the latency is
+ * tolerance x baseline, with room for a queue of sqrt(limit);
+ * - AIMD: the limit grows by one per limit of requests, and is cut by
+ * backoff when the latency goes over tolerance x baseline.
+ * With both, an expired request cuts the limit by backoff, at most once
+ * per limit of requests.
+ * The limit only grows when at least half of it is in use, so an idle
+ * server does not drift to the maximum.
+ */
+class concurrency_limiter {
+ public:
+  concurrency_limiter() = delete;
+  /**
+   * @brief Construct a new concurrency limiter object
+   *
+   * @param _param
+   */
+  explicit concurrency_limiter(const limiter_param& _param)
+      : param(_param),
+        limit(clamp(param.initial_limit)),
+        limit_metric(metrics::server_metrics().get_gauge("limiter.limit")),
+        inflight_metric(
+            metrics::server_metrics().get_gauge("limiter.inflight")),
+        baseline_metric(
+            metrics::server_metrics().get_gauge("limiter.baseline us")) {
+    current.store(static_cast<int>(limit));
+    limit_metric.set(current.load());
+  }
+  /**
+   * @brief Read the parameters from the "limiter" node of the configuration
+   *
+   * @param conf
+   * @return limiter_param
+   */
+  static limiter_param read_param(const JSON& conf) {
+    limiter_param p;
+    const auto algorithm = conf.get<std::string>("algorithm", "gradient");
+    if (algorithm != "gradient" && algorithm != "aimd") {
+      throw std::logic_error("Limiter: unknown algorithm " + algorithm);
+    }
+    p.gradient = algorithm == "gradient";
+    p.initial_limit = conf.get<int>("initial limit", p.initial_limit);
+    p.min_limit = conf.get<int>("min limit", p.min_limit);
+    p.max_limit = conf.get<int>("max limit", p.max_limit);
+    p.tolerance = conf.get<double>("tolerance", p.tolerance);
+    p.smoothing = conf.get<double>("smoothing", p.smoothing);
+    p.backoff = conf.get<double>("backoff", p.backoff);
+    p.window = conf.get<int>("window", p.window);
+    return p;
+  }
+  /**
+   * @brief Take a slot for a request, if under the limit
+   *
+   * @return true if the request may go on, then release() it
+   */
+  bool acquire() {
+    int cur = inflight.load();
+    do {
+      if (cur >= current.load(std::memory_order_relaxed)) return false;
+    } while (!inflight.compare_exchange_weak(cur, cur + 1));
+    inflight_metric.add(1);
+    return true;
+  }
+  /**
+   * @brief Give back the slot of a request that did not run, or whose
+   * latency tells nothing of the queue, e.g. cancelled by its client
+   *
+   */
+  void release() {
+    inflight.fetch_sub(1);
+    inflight_metric.add(-1);
+  }
+  /**
+   * @brief Give back the slot of a request that ran, and update the limit
+   *
+   * @param latency of the request
+   * @param expired the request expired before inference
+   */
+  void release(deadline_clock::duration latency, bool expired) {
+    const double us =
+        std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    const int used = inflight.fetch_sub(1);
+    inflight_metric.add(-1);
+    std::lock_guard<std::mutex> lk{mtx};
+    const bool busy = used * 2 >= limit;
+    // the baseline learns from the requests that did not queue much, so it
+    // does not drift up with the latency of an overload
+    if (!expired && (!busy || baseline == 0)) {
+      // a few samples to start with, then a slow moving average
+      if (samples < std::max(param.window, 1)) ++samples;
+      const double alpha = 1.0 / samples;
+      baseline = baseline > 0 ? (1 - alpha) * baseline + alpha * us : us;
+      baseline_metric.set(static_cast<int64_t>(baseline));
+    }
+    if (expired) {
+      // one cut per limit of requests, the others saw the same queue
+      if (since_backoff >= limit) {
+        update(limit * param.backoff);
+        since_backoff = 0;
+      }
+    } else if (param.gradient) {
+      const double gradient =
+          std::max(0.5, std::min(1.0, param.tolerance * baseline / us));
+      const double target = limit * gradient + std::sqrt(limit);
+      if (target < limit || busy) {
+        update((1 - param.smoothing) * limit + param.smoothing * target);
+      }
+      // the baseline must forget a latency regime the limit pushed it to
+      if (baseline > 2 * us) baseline *= 0.95;
+    } else if (us > param.tolerance * baseline) {
+      if (since_backoff >= limit) {
+        update(limit * param.backoff);
+        since_backoff = 0;
+      }
+    } else if (busy) {
+      update(limit + 1 / limit);
+    }
+    if (since_backoff < limit) ++since_backoff;
+  }
+  /**
+   * @brief Whether a request would get a slot now, nothing is taken
+   *
+   */
+  bool has_room() const {
+    return inflight.load() < current.load(std::memory_order_relaxed);
+  }
+  /**
+   * @brief The current limit
+   *
+   */
+  int get() const { return current.load(); }
+
+  using ptr = std::shared_ptr<concurrency_limiter>;
+
+ private:
+  limiter_param param;
+  std::atomic<int> inflight{0};  //!< requests in flight
+  std::atomic<int> current{0};   //!< the limit, as seen by acquire()
+  std::mutex mtx;                //!< protects the members below
+  double limit;                  //!< the limit, fractional
+  double baseline = 0;           //!< average latency, microseconds
+  int samples = 0;               //!< samples of the baseline, up to window
+  int since_backoff = 0;         //!< samples since the last cut, up to limit
+  metrics::gauge& limit_metric;     //!< exported limit
+  metrics::gauge& inflight_metric;  //!< exported inflight
+  metrics::gauge& baseline_metric;  //!< exported baseline
+  double clamp(double l) const {
+    return std::min<double>(std::max<double>(l, std::max(param.min_limit, 1)),
+                            std::max(param.max_limit, 1));
+  }
+  /**
+   * @brief Set the limit, under the lock
+   *
+   */
+  void update(double l) {
+    limit = clamp(l);
+    const int rounded = static_cast<int>(limit);
+    if (rounded != current.load(std::memory_order_relaxed)) {
+      server_log->debug("Concurrency limit {}", rounded);
+    }
+    current.store(rounded);
+    limit_metric.set(rounded);
+  }
+};  // class concurrency_limiter
+
+}  // namespace worker
+}  // namespace st
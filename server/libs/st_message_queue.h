@@ -6,12 +6,27 @@
  ***************************************************************************************/
 
 #pragma once
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "st_pool.h"
 
 namespace st {
 namespace sync {
@@ -87,6 +102,36 @@ class simple_bell {
     cv.wait(lk, [&]() { return (key == desired_state); });
     key = reset_state;
   }
+  /**
+   * @brief Wait for sb ring the bell, whatever the state
+   * @details Used when the consumer has several outcomes to report, e.g. done
+   * or dropped
+   * @return Key the state set by the consumer
+   */
+  Key wait_any() {
+    auto lk = lock();
+    cv.wait(lk, [&]() { return !(key == reset_state); });
+    Key ret = key;
+    key = reset_state;
+    return ret;
+  }
+  /**
+   * @brief Wait for sb ring the bell, whatever the state, up to a timeout
+   *
+   * @param timeout
+   * @return Key the state set by the consumer, reset_state on timeout
+   */
+  template <class Rep, class Period>
+  Key wait_any_for(const std::chrono::duration<Rep, Period>& timeout) {
+    auto lk = lock();
+    if (!cv.wait_for(lk, timeout,
+                     [&]() { return !(key == reset_state); })) {
+      return Key(reset_state);
+    }
+    Key ret = key;
+    key = reset_state;
+    return ret;
+  }
   /**
    * @brief Get the lock that associate with the mutex
    * @details We want to use mutext in the RAII manner to prevent resource leak,
@@ -109,12 +154,136 @@ class simple_bell {
   }
   using ptr = std::shared_ptr<simple_bell>;
 };
+/**
+ * @brief Bell on an atomic state word, for one waiter
+ * @details Drop-in replacement of simple_bell<int, int, 0>. The waiter spins
+ * on the state for a short budget, then parks on a futex; the ringer only
+ * makes a system call if somebody is parked. A handoff costs no lock, and
+ * often no system call at all when the answer comes within the spin budget
+ */
+class futex_bell {
+ private:
+  std::atomic<int> key{0};      //!< state set by the ringer, 0 = not rung
+  std::atomic<int> parked{0};   //!< number of parked waiters
+  static int futex(std::atomic<int>* addr, int op, int val,
+                   const timespec* timeout) {
+    return syscall(SYS_futex, reinterpret_cast<int*>(addr), op, val, timeout,
+                   nullptr, 0);
+  }
+  static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  /**
+   * @brief Wait until the key is rung, up to a time point
+   *
+   * @return int the key, 0 on timeout
+   */
+  template <class Pred>
+  int wait_until(Pred rung, std::chrono::steady_clock::time_point until) {
+    int k = key.load(std::memory_order_acquire);
+    for (int i = spin_budget(); !rung(k) && i > 0; --i) {
+      pause();
+      k = key.load(std::memory_order_acquire);
+    }
+    while (!rung(k)) {
+      timespec ts;
+      const timespec* timeout = nullptr;
+      if (until != std::chrono::steady_clock::time_point::max()) {
+        const auto left = until - std::chrono::steady_clock::now();
+        if (left <= std::chrono::steady_clock::duration::zero()) return 0;
+        const auto ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        timeout = &ts;
+      }
+      // the ringer reads parked after it sets the key, so either it sees us
+      // or the futex sees its key
+      parked.fetch_add(1);
+      futex(&key, FUTEX_WAIT_PRIVATE, k, timeout);
+      parked.fetch_sub(1);
+      k = key.load(std::memory_order_acquire);
+    }
+    key.store(0, std::memory_order_relaxed);
+    return k;
+  }
+
+ public:
+  futex_bell() = default;
+  futex_bell(const futex_bell& other) = delete;
+  futex_bell(futex_bell&& other) = delete;
+  futex_bell& operator=(const futex_bell& rhs) = delete;
+  futex_bell& operator=(const futex_bell&& rhs) = delete;
+  /**
+   * @brief Number of spins before parking, shared by all bells
+   * @details A spin is a load and a pause, i.e. some tens of nanoseconds;
+   * 0 parks right away, the default on a single core where the ringer
+   * cannot run while we spin
+   */
+  static std::atomic<int>& spin_budget() {
+    static std::atomic<int> budget{
+        std::thread::hardware_concurrency() > 1 ? 2000 : 0};
+    return budget;
+  }
+  /**
+   * @brief Wait for sb ring the bell with a state
+   *
+   * @param desired_state
+   */
+  void wait(int&& desired_state) {
+    const int desired = desired_state;
+    wait_until([desired](int k) { return k == desired; },
+               std::chrono::steady_clock::time_point::max());
+  }
+  /**
+   * @brief Wait for sb ring the bell, whatever the state
+   *
+   * @return int the state set by the consumer
+   */
+  int wait_any() {
+    return wait_until([](int k) { return k != 0; },
+                      std::chrono::steady_clock::time_point::max());
+  }
+  /**
+   * @brief Wait for sb ring the bell, whatever the state, up to a timeout
+   *
+   * @param timeout
+   * @return int the state set by the consumer, 0 on timeout
+   */
+  template <class Rep, class Period>
+  int wait_any_for(const std::chrono::duration<Rep, Period>& timeout) {
+    return wait_until(
+        [](int k) { return k != 0; },
+        std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                timeout));
+  }
+  /**
+   * @brief Ring the bell
+   *
+   * @param set_state not 0
+   */
+  void ring(int&& set_state) {
+    key.store(set_state);
+    if (parked.load() > 0) futex(&key, FUTEX_WAKE_PRIVATE, 1, nullptr);
+  }
+  using ptr = std::shared_ptr<futex_bell>;
+};
+
+/**
+ * @brief Bell of a mutex and a condition variable, for one waiter
+ *
+ */
+using condvar_bell = simple_bell<int, int, 0>;
+
 /**
  * @brief Single bell type
  * @details With single bell, each producer will have a bell and all user need
  * to do is ring the bell to notify the consumer
  */
-using single_bell = simple_bell<int, int, 0>;
+using single_bell = futex_bell;
 
 /**
  * @brief Shared bell type
@@ -125,14 +294,136 @@ using single_bell = simple_bell<int, int, 0>;
 template <const char* reset_state>
 using shared_bell = simple_bell<std::string, const char*, reset_state>;
 
+/**
+ * @brief Clock of the deadlines
+ *
+ */
+using deadline_clock = std::chrono::steady_clock;
+
+/**
+ * @brief Deadline of the messages without deadline
+ *
+ */
+inline deadline_clock::time_point no_deadline() {
+  return deadline_clock::time_point::max();
+}
+
+/**
+ * @brief Convert a wall clock deadline, e.g. from a client, to a deadline
+ * @details Deadlines more than a day ahead are considered as no deadline
+ * @param tp
+ * @return deadline_clock::time_point
+ */
+inline deadline_clock::time_point to_deadline(
+    std::chrono::system_clock::time_point tp) {
+  const auto now = std::chrono::system_clock::now();
+  if (tp > now + std::chrono::hours(24)) return no_deadline();
+  return deadline_clock::now() +
+         std::chrono::duration_cast<deadline_clock::duration>(tp - now);
+}
+
+/**
+ * @brief States of the claim flag of a message
+ *
+ */
+enum claim_state : int {
+  claim_free = 0,      //!< nobody answered the message yet
+  claim_answered = 1,  //!< a consumer answers the message
+  claim_cancelled = 2,  //!< the producer cancelled the message
+  claim_running = 3     //!< a consumer reads the data, e.g. infers it
+};
+
+/**
+ * @brief Completion of a request, see request_context
+ *
+ */
+class request_completion {
+ public:
+  virtual ~request_completion() {}
+  /**
+   * @brief Answer the producer
+   * @details Runs on the consumer thread, it must only hand the answer over,
+   * e.g. post it to the executor of the producer
+   * @param state
+   */
+  virtual void on_complete(int state) = 0;
+};
+
+/**
+ * @brief State of a request, shared by the copies of its message
+ * @details Pooled, see object_pool: the producer takes one per request and
+ * the last copy of the message gives it back, with the capacity of its
+ * buffers up to pooled_capacity, so the message path does not allocate in
+ * the steady state
+ * @tparam Response result storage
+ */
+template <class Response>
+struct request_context {
+  std::atomic<int> taken{claim_free};  //!< claim flag, see claim_state
+  Response predictions;                //!< result storage
+  std::string data;  //!< owned copy of the input, for the producers that may
+                     //! not outlive all copies, e.g. hedged requests
+  request_completion* completion = nullptr;  //!< answers the producer
+                                             //! instead of the bell, if set
+  std::shared_ptr<void> keep;  //!< keeps the completion alive
+  /**
+   * @brief Claim the right to answer the producer
+   * @details Only the first copy of a hedged message gets it, the others
+   * must not touch the predictions nor ring the bell. Nobody gets it after
+   * the producer cancelled the message
+   * @return true if the consumer may answer
+   */
+  bool claim() {
+    int cur = taken.load();
+    while (cur == claim_free || cur == claim_running) {
+      if (taken.compare_exchange_weak(cur, claim_answered)) return true;
+    }
+    return false;
+  }
+  /**
+   * @brief Start working on the message, on the consumer side
+   * @details From then on the producer cannot cancel it, so the data it
+   * points to stays valid until the message is answered. The copies of a
+   * hedged message may all run
+   * @return false if already answered or cancelled, skip it
+   */
+  bool start() {
+    int cur = claim_free;
+    return taken.compare_exchange_strong(cur, claim_running) ||
+           cur == claim_running;
+  }
+  /**
+   * @brief Cancel the request, on the producer side
+   *
+   * @return true if cancelled, false if a consumer runs or answers it
+   */
+  bool cancel() {
+    int free = claim_free;
+    return taken.compare_exchange_strong(free, claim_cancelled);
+  }
+  /**
+   * @brief Reset by the pool, for the next request
+   *
+   */
+  void recycle() {
+    taken.store(claim_free, std::memory_order_relaxed);
+    predictions.clear();
+    recycle_buffer(data);
+    completion = nullptr;
+    keep.reset();
+  }
+};
+
 /**
  * @brief A message template that producer and consumer will use to communicate
  * @tparam DataPtr
  * @tparam Ssize
  * @tparam ResponsePtr
  * @tparam BellPtr
+ * @tparam ImagePtr
  */
-template <class DataPtr, class Ssize, class ResponsePtr, class simple_bell>
+template <class DataPtr, class Ssize, class ResponsePtr, class simple_bell,
+          class ImagePtr = const void*>
 class message {
   using BellPtr = typename simple_bell::ptr;
 
@@ -142,11 +433,34 @@ class message {
   ResponsePtr predictions;  //!< The prediction, inference engine will write the
                             //! result here
   BellPtr bell;             //!< The bell object that consumer will used to notify producer
+  ImagePtr image;           //!< Already decoded data, if set the consumer
+                            //! ignores data and size
+  deadline_clock::time_point deadline;  //!< The consumer drops the message
+                                        //! after this point
+  using context_type =
+      request_context<typename std::remove_pointer<ResponsePtr>::type>;
+  pool_ptr<context_type> context;  //!< Pooled state shared by the copies of
+                                   //! a claimable message, optional
+  int priority;  //!< Class of service, 0 is the most urgent
+  int tenant;    //!< Tenant that sent the message, 0 = anonymous
+  bool json_body;  //!< The producer answers with the JSON body of the
+                   //! predictions, the consumer may write it instead
+  deadline_clock::time_point enqueued;  //!< Set by the queues that measure
+                                        //! the queue time
   /**
   * @brief Construct a new message object
   *
   */
-  message() : data(nullptr), size(-1), predictions(nullptr), bell(nullptr) {}
+  message()
+      : data(nullptr),
+        size(-1),
+        predictions(nullptr),
+        bell(nullptr),
+        image(nullptr),
+        deadline(no_deadline()),
+        priority(0),
+        tenant(0),
+        json_body(false) {}
   /**
    * @brief Construct a new message object
    *
@@ -157,7 +471,15 @@ class message {
    */
   message(DataPtr& _data, Ssize& _size, ResponsePtr _predictions,
           BellPtr& _bell)
-      : data(_data), size(_size), predictions(_predictions), bell(_bell) {}
+      : data(_data),
+        size(_size),
+        predictions(_predictions),
+        bell(_bell),
+        image(nullptr),
+        deadline(no_deadline()),
+        priority(0),
+        tenant(0),
+        json_body(false) {}
   /**
    * @brief
    *
@@ -170,6 +492,13 @@ class message {
       size = rhs.size;
       predictions = rhs.predictions;
       bell = rhs.bell;
+      image = rhs.image;
+      deadline = rhs.deadline;
+      context = rhs.context;
+      priority = rhs.priority;
+      tenant = rhs.tenant;
+      json_body = rhs.json_body;
+      enqueued = rhs.enqueued;
     }
     return *this;
   }
@@ -185,21 +514,88 @@ class message {
    * @param rhs
    * @return message&
    */
-  message& operator=(const message&& rhs) {
-    if (this != rhs) {
-      this = rhs;
+  message& operator=(message&& rhs) {
+    if (this != &rhs) {
+      // the shared handles are moved, without touching their counts
+      data = rhs.data;
+      size = rhs.size;
+      predictions = rhs.predictions;
+      bell = std::move(rhs.bell);
+      image = rhs.image;
+      deadline = rhs.deadline;
+      context = std::move(rhs.context);
+      priority = rhs.priority;
+      tenant = rhs.tenant;
+      json_body = rhs.json_body;
+      enqueued = rhs.enqueued;
       rhs.data = nullptr;
       rhs.size = -1;
       rhs.predictions = nullptr;
-      rhs.bell = nullptr;
+      rhs.image = nullptr;
     }
+    return *this;
   }
   /**
    * @brief Construct a new message object
    *
    * @param other
    */
-  message(const message&& other) { *this = other; }
+  message(message&& other) { *this = std::move(other); }
+  /**
+   * @brief Answer the producer, by the completion of its context or its bell
+   *
+   * @param state
+   */
+  void complete(int state) {
+    if (context && context->completion) {
+      context->completion->on_complete(state);
+    } else {
+      bell->ring(std::move(state));
+    }
+  }
+  /**
+   * @brief Give the message a context from the pool, so that it can be
+   * claimed and cancelled
+   *
+   */
+  void make_claimable() {
+    if (!context) context = object_pool<context_type>::acquire();
+  }
+  /**
+   * @brief Claim the right to answer the producer, see request_context
+   *
+   * @return true if the consumer may answer
+   */
+  bool claim() { return !context || context->claim(); }
+  /**
+   * @brief Start working on the message, see request_context
+   *
+   * @return false if already answered or cancelled, skip it
+   */
+  bool start() { return !context || context->start(); }
+  /**
+   * @brief Cancel a claimable message, on the producer side
+   *
+   * @return true if cancelled, false if a consumer runs or answers it
+   */
+  bool cancel() { return context && context->cancel(); }
+  /**
+   * @brief Another copy of the message already answered, or the producer
+   * cancelled it
+   *
+   */
+  bool claimed() const {
+    if (!context) return false;
+    const int cur = context->taken.load();
+    return cur == claim_answered || cur == claim_cancelled;
+  }
+  /**
+   * @brief The producer cancelled the message
+   *
+   */
+  bool cancelled() const {
+    return context && context->taken.load() == claim_cancelled;
+  }
 };
 
 /**
@@ -246,6 +642,38 @@ class blocking_queue {
     }
     cv.notify_one();
   }
+  /**
+   * @brief Push items to queue only if they all fit
+   * @details The check and the push are done under the same lock, so the
+   * queue never grows beyond max_size
+   * @param first
+   * @param last
+   * @param max_size maximum number of items in queue, 0 = unbounded
+   * @return true if the items were pushed
+   */
+  template <class It>
+  bool try_push(It first, It last, int max_size) {
+    {
+      Lock lk{mtx};
+      const int n = std::distance(first, last);
+      if (max_size > 0 && static_cast<int>(queue.size()) + n > max_size) {
+        return false;
+      }
+      for (; first != last; ++first) queue.push_back(*first);
+    }
+    cv.notify_all();
+    return true;
+  }
+  /**
+   * @brief Push an item to queue only if it fits
+   *
+   * @param item
+   * @param max_size maximum number of items in queue, 0 = unbounded
+   * @return true if the item was pushed
+   */
+  bool try_push(const Message& item, int max_size) {
+    return try_push(&item, &item + 1, max_size);
+  }
   /**
    * @brief Pop an item from queue
    *
@@ -269,5 +697,586 @@ class blocking_queue {
   }
   using ptr = std::shared_ptr<blocking_queue>;
 };
+
+/**
+ * @brief Earliest-deadline-first queue
+ * @details Drop-in replacement of the std::deque of blocking_queue, for
+ * messages with a deadline. Messages with the same deadline, e.g. without
+ * deadline, are served in FIFO order
+ * @tparam Message Message type
+ */
+template <class Message>
+class edf_queue {
+ public:
+  void push_back(const Message& item) {
+    heap.push_back({seq++, item});
+    std::push_heap(heap.begin(), heap.end(), later);
+  }
+  void push_back(Message&& item) {
+    heap.push_back({seq++, std::move(item)});
+    std::push_heap(heap.begin(), heap.end(), later);
+  }
+  Message& front() { return heap.front().item; }
+  void pop_front() {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    heap.pop_back();
+  }
+  /**
+   * @brief The message that would be served last, linear time
+   *
+   */
+  Message& back() { return heap[last()].item; }
+  void pop_back() {
+    // the last one is a leaf, the leaf that replaces it can only go up
+    const size_t i = last();
+    if (i + 1 < heap.size()) {
+      heap[i] = std::move(heap.back());
+      heap.pop_back();
+      std::push_heap(heap.begin(), heap.begin() + i + 1, later);
+    } else {
+      heap.pop_back();
+    }
+  }
+  size_t size() const { return heap.size(); }
+
+ private:
+  struct entry {
+    uint64_t seq;
+    Message item;
+  };
+  std::vector<entry> heap;  //!< min-heap on (deadline, seq)
+  uint64_t seq = 0;         //!< arrival order
+  static bool later(const entry& a, const entry& b) {
+    if (a.item.deadline != b.item.deadline) {
+      return a.item.deadline > b.item.deadline;
+    }
+    return a.seq > b.seq;
+  }
+  size_t last() const {
+    return std::max_element(heap.begin(), heap.end(),
+                            [](const entry& a, const entry& b) {
+                              return later(b, a);
+                            }) -
+           heap.begin();
+  }
+};
+
+/**
+ * @brief Queue of several classes of service, one sub-queue per class
+ * @details Drop-in replacement of the queue of a lane. Strict dispatch
+ * serves the most urgent non-empty class first; weighted dispatch shares
+ * the pops among the non-empty classes by weight (smooth weighted round
+ * robin). Either way, a class that has been waiting for max_wait is served
+ * next, so the lower classes never starve. Thieves take from the least
+ * urgent class. The class of a message is its priority member, out of
+ * range classes are clamped
+ * @tparam Message Message type
+ * @tparam Queue Queue of a class
+ */
+template <class Message, class Queue = std::deque<Message>>
+class class_queue {
+ public:
+  using queue_type = Queue;  //!< queue of a class
+  /**
+   * @brief Construct a queue of one class
+   *
+   */
+  class_queue() : class_queue(std::vector<int>{1}) {}
+  /**
+   * @brief Construct a new class queue object
+   *
+   * @param _weights weights of the classes, the most urgent first
+   * @param _strict strict priority instead of weighted dispatch
+   * @param _max_wait maximum time a non-empty class is not served
+   * @param proto the queue of each class is a copy of it
+   */
+  explicit class_queue(const std::vector<int>& _weights, bool _strict = false,
+                       deadline_clock::duration _max_wait =
+                           deadline_clock::duration::max(),
+                       const Queue& proto = Queue())
+      : weights(_weights),
+        strict(_strict),
+        max_wait(_max_wait),
+        queues(std::max<size_t>(_weights.size(), 1), proto),
+        credit(queues.size(), 0),
+        waiting_since(queues.size()) {
+    weights.resize(queues.size(), 1);
+  }
+  void push_back(const Message& item) {
+    const int c = clamp(item.priority);
+    if (queues[c].size() == 0) waiting_since[c] = deadline_clock::now();
+    queues[c].push_back(item);
+    picked = -1;
+  }
+  void push_back(Message&& item) {
+    const int c = clamp(item.priority);
+    if (queues[c].size() == 0) waiting_since[c] = deadline_clock::now();
+    queues[c].push_back(std::move(item));
+    picked = -1;
+  }
+  /**
+   * @brief The message to serve next, must be followed by pop_front()
+   *
+   */
+  Message& front() {
+    if (picked < 0) picked = pick();
+    return queues[picked].front();
+  }
+  void pop_front() {
+    const int c = picked < 0 ? pick() : picked;
+    picked = -1;
+    queues[c].pop_front();
+    waiting_since[c] = deadline_clock::now();
+    if (!strict) {
+      // smooth weighted round robin: the served class pays for the others
+      int sum = 0;
+      for (size_t i = 0; i < queues.size(); ++i) {
+        if (queues[i].size() > 0 || static_cast<int>(i) == c) {
+          credit[i] += weights[i];
+          sum += weights[i];
+        }
+      }
+      credit[c] -= sum;
+      // an idle class does not save credits for later
+      if (queues[c].size() == 0) credit[c] = 0;
+    }
+  }
+  /**
+   * @brief The message that would be served last, in the least urgent class
+   *
+   */
+  Message& back() { return queues[least_urgent()].back(); }
+  void pop_back() {
+    queues[least_urgent()].pop_back();
+    picked = -1;
+  }
+  size_t size() const {
+    size_t n = 0;
+    for (auto& q : queues) n += q.size();
+    return n;
+  }
+
+ private:
+  std::vector<int> weights;  //!< weights of the classes
+  bool strict;               //!< strict priority dispatch
+  deadline_clock::duration max_wait;  //!< starvation bound
+  std::vector<Queue> queues;          //!< one queue per class
+  std::vector<int> credit;            //!< credits of the weighted dispatch
+  std::vector<deadline_clock::time_point> waiting_since;  //!< last served
+  int picked = -1;  //!< class of front(), -1 = not picked yet
+  int clamp(int c) const {
+    return std::min(std::max(c, 0), static_cast<int>(queues.size()) - 1);
+  }
+  int least_urgent() const {
+    int c = queues.size() - 1;
+    while (c > 0 && queues[c].size() == 0) --c;
+    return c;
+  }
+  int pick() const {
+    const int n = queues.size();
+    if (max_wait != deadline_clock::duration::max()) {
+      // the class that starves the longest goes first
+      const auto now = deadline_clock::now();
+      int starving = -1;
+      for (int c = 0; c < n; ++c) {
+        if (queues[c].size() > 0 && now - waiting_since[c] > max_wait &&
+            (starving < 0 || waiting_since[c] < waiting_since[starving])) {
+          starving = c;
+        }
+      }
+      if (starving >= 0) return starving;
+    }
+    int best = -1;
+    for (int c = 0; c < n; ++c) {
+      if (queues[c].size() == 0) continue;
+      if (strict) return c;
+      if (best < 0 || credit[c] + weights[c] > credit[best] + weights[best]) {
+        best = c;
+      }
+    }
+    return best < 0 ? 0 : best;
+  }
+};
+
+/**
+ * @brief Fair queue of the messages of several tenants
+ * @details Drop-in replacement of a queue of messages: one virtual queue
+ * per tenant, served by deficit round robin. On its turn, a tenant earns
+ * its weight in credits, and each message costs one, so the tenants share
+ * the pops by weight whatever their arrival rate. Thieves take from the
+ * tenant with the longest queue. The tenant of a message is its tenant
+ * member; the queue stamps its enqueued member and reports each served
+ * message to an optional observer, e.g. for the queue time statistics
+ * @tparam Message Message type
+ * @tparam Queue Queue of a tenant
+ */
+template <class Message, class Queue = std::deque<Message>>
+class fair_queue {
+ public:
+  using weight_fn = std::function<int(int)>;  //!< tenant -> weight
+  using observer_fn = std::function<void(const Message&)>;  //!< on served
+  /**
+   * @brief Construct a fair queue where all tenants have the same weight
+   *
+   */
+  fair_queue() = default;
+  /**
+   * @brief Construct a new fair queue object
+   *
+   * @param _weight weight of a tenant, at least 1
+   * @param _observer called with each message that is served, i.e. that
+   * leaves from the front or is stolen from the back, optional
+   */
+  fair_queue(weight_fn _weight, observer_fn _observer)
+      : weight(_weight), observer(_observer) {}
+  void push_back(const Message& item) { push(Message(item)); }
+  void push_back(Message&& item) { push(std::move(item)); }
+  /**
+   * @brief The message to serve next, must be followed by pop_front()
+   *
+   */
+  Message& front() {
+    if (picked < 0) picked = pick();
+    return flows[picked].q.front();
+  }
+  void pop_front() {
+    const int t = picked < 0 ? pick() : picked;
+    picked = -1;
+    flow& f = flows[t];
+    if (observer) observer(f.q.front());
+    f.q.pop_front();
+    f.deficit -= 1;
+    --count;
+    if (f.q.size() == 0) deactivate(t);
+  }
+  /**
+   * @brief The message that would be served last, of the tenant with the
+   * longest queue
+   *
+   */
+  Message& back() { return flows[heaviest()].q.back(); }
+  void pop_back() {
+    const int t = heaviest();
+    flow& f = flows[t];
+    // a stolen message is served too, by another lane
+    if (observer) observer(f.q.back());
+    f.q.pop_back();
+    --count;
+    if (f.q.size() == 0) deactivate(t);
+    picked = -1;
+  }
+  size_t size() const { return count; }
+
+ private:
+  struct flow {
+    Queue q;          //!< messages of the tenant
+    int deficit = 0;  //!< credits of the tenant
+    bool turn = false;  //!< the tenant got its credits of this round
+  };
+  weight_fn weight;              //!< weights of the tenants, optional
+  observer_fn observer;          //!< observer of the served messages
+  std::map<int, flow> flows;     //!< virtual queues of the tenants
+  std::deque<int> active;        //!< round robin of the non-empty ones
+  size_t count = 0;              //!< number of messages
+  int picked = -1;               //!< tenant of front(), -1 = not picked yet
+  void push(Message&& item) {
+    item.enqueued = deadline_clock::now();
+    flow& f = flows[item.tenant];
+    if (f.q.size() == 0) active.push_back(item.tenant);
+    f.q.push_back(std::move(item));
+    ++count;
+  }
+  void deactivate(int t) {
+    // an idle tenant does not save credits for later
+    flow& f = flows[t];
+    f.deficit = 0;
+    f.turn = false;
+    active.erase(std::find(active.begin(), active.end(), t));
+  }
+  int pick() {
+    for (;;) {
+      const int t = active.front();
+      flow& f = flows[t];
+      if (!f.turn) {
+        f.deficit += weight ? std::max(weight(t), 1) : 1;
+        f.turn = true;
+      }
+      if (f.deficit >= 1) return t;
+      // the turn of the tenant is over
+      f.turn = false;
+      active.pop_front();
+      active.push_back(t);
+    }
+  }
+  int heaviest() {
+    int best = active.front();
+    for (int t : active) {
+      if (flows[t].q.size() > flows[best].q.size()) best = t;
+    }
+    return best;
+  }
+};
+
+/**
+ * @brief Per-consumer queues with work stealing
+ * @details Each consumer owns a lane, so consumers don't contend on one
+ * lock. Producers pick the shorter of two random lanes (power of two
+ * choices); a consumer whose lane is empty steals from the back of the
+ * busiest lane, or of another one if the steal filter rejects it, before
+ * going to sleep. With one lane, it's a shared queue.
+ * @tparam Message Message type
+ * @tparam Queue Queue of a lane, must have back() and pop_back()
+ * @tparam CondVar
+ * @tparam Mutex
+ * @tparam Lock
+ */
+template <class Message, class Queue = std::deque<Message>,
+          class CondVar = std::condition_variable, class Mutex = std::mutex,
+          class Lock = std::unique_lock<std::mutex>>
+class stealing_queue {
+ public:
+  /**
+   * @brief Construct a new stealing queue object
+   *
+   * @param num_lanes number of lanes, i.e. of consumers
+   */
+  explicit stealing_queue(int num_lanes = 1) {
+    for (int i = 0; i < std::max(num_lanes, 1); ++i) {
+      lanes.emplace_back(new lane);
+    }
+  }
+  /**
+   * @brief Construct a new stealing queue object with configured lanes
+   *
+   * @param num_lanes number of lanes, i.e. of consumers
+   * @param proto the queue of each lane is a copy of it, e.g. class_queue
+   */
+  stealing_queue(int num_lanes, const Queue& proto) {
+    for (int i = 0; i < std::max(num_lanes, 1); ++i) {
+      lanes.emplace_back(new lane(proto));
+    }
+  }
+  /**
+   * @brief Push an item to the shorter of two random lanes
+   *
+   * @param item
+   */
+  void push(const Message& item) {
+    total.fetch_add(1);
+    push_lane(Message(item));
+  }
+  /**
+   * @brief Push an rvalue item to the shorter of two random lanes
+   *
+   * @param item
+   */
+  void push(Message&& item) {
+    total.fetch_add(1);
+    push_lane(std::move(item));
+  }
+  /**
+   * @brief Push items only if they all fit
+   * @details With move iterators the items are moved in
+   * @param first
+   * @param last
+   * @param max_size maximum number of items in all lanes, 0 = unbounded
+   * @return true if the items were pushed
+   */
+  template <class It>
+  bool try_push(It first, It last, int max_size) {
+    const int n = std::distance(first, last);
+    int cur = total.load();
+    do {
+      if (max_size > 0 && cur + n > max_size) return false;
+    } while (!total.compare_exchange_weak(cur, cur + n));
+    for (; first != last; ++first) push_lane(Message(*first));
+    return true;
+  }
+  /**
+   * @brief Push an item only if it fits
+   *
+   */
+  bool try_push(const Message& item, int max_size) {
+    return try_push(&item, &item + 1, max_size);
+  }
+  /**
+   * @brief Push an item to a lane whose consumer sleeps, if any
+   * @details Used to run a copy of a late item on a free consumer, so it
+   * never waits behind other items
+   * @param item
+   * @return true if an idle consumer got the item
+   */
+  bool try_push_idle(const Message& item) {
+    for (auto& l : lanes) {
+      {
+        Lock lk{l->mtx};
+        if (!l->idle.load() || l->q.size() > 0) continue;
+        total.fetch_add(1);
+        l->q.push_back(item);
+        l->size.fetch_add(1);
+      }
+      l->cv.notify_one();
+      return true;
+    }
+    return false;
+  }
+  /**
+   * @brief Pop an item of a lane, steal one if the lane is empty
+   *
+   * @param i lane of the consumer
+   * @return Message
+   */
+  Message pop(int i = 0) {
+    const int self = i % lanes.size();
+    lane& l = *lanes[self];
+    Message ret;
+    for (;;) {
+      const uint64_t seen = pushes.load();
+      if (take_front(l, ret) || steal(self, ret)) {
+        total.fetch_sub(1);
+        return ret;
+      }
+      // nothing we may take anywhere: sleep until a producer pushes to our
+      // lane, or to another one since we looked, see push_lane
+      Lock lk{l.mtx};
+      l.idle.store(true);
+      l.cv.wait(lk, [&]() { return l.q.size() > 0 || pushes.load() != seen; });
+      l.idle.store(false);
+    }
+  }
+  /**
+   * @brief Get current number of item in all lanes
+   *
+   * @return int
+   */
+  int size() { return total.load(); }
+  /**
+   * @brief Number of items taken from another lane
+   *
+   * @return uint64_t
+   */
+  uint64_t stolen() const { return steals.load(); }
+  /**
+   * @brief Number of lanes
+   *
+   */
+  int num_lanes() const { return lanes.size(); }
+  /**
+   * @brief Number of items in a lane, without the one being served
+   *
+   */
+  int lane_size(int i) const { return lanes[i]->size.load(); }
+  /**
+   * @brief Lane chooser of the producers, replaces the power of two choices
+   * @details Not thread-safe, set it before the queue is used
+   */
+  using chooser_type = std::function<int(const Message&)>;
+  void set_chooser(chooser_type f) { chooser = f; }
+  /**
+   * @brief Filter of the steals: thief, victim, item -> may steal
+   * @details Not thread-safe, set it before the queue is used
+   */
+  using steal_filter_type = std::function<bool(int, int, const Message&)>;
+  void set_steal_filter(steal_filter_type f) { steal_filter = f; }
+  using ptr = std::shared_ptr<stealing_queue>;
+
+ private:
+  struct lane {
+    lane() = default;
+    explicit lane(const Queue& proto) : q(proto) {}
+    Queue q;
+    Mutex mtx;
+    CondVar cv;
+    std::atomic<int> size{0};      //!< size of q, read without the lock
+    std::atomic<bool> idle{false};  //!< the consumer sleeps
+  };
+  std::vector<std::unique_ptr<lane>> lanes;
+  std::atomic<int> total{0};        //!< items in all lanes
+  std::atomic<uint64_t> steals{0};  //!< items taken from another lane
+  std::atomic<uint64_t> pushes{0};  //!< items pushed so far
+  chooser_type chooser;             //!< optional lane chooser
+  steal_filter_type steal_filter;   //!< optional filter of the steals
+  /**
+   * @brief Power of two choices
+   *
+   */
+  lane& choose(const Message& item) {
+    const int n = lanes.size();
+    if (n == 1) return *lanes[0];
+    if (chooser) return *lanes[chooser(item) % n];
+    static thread_local std::minstd_rand rng{std::random_device{}()};
+    int a = rng() % n;
+    int b = rng() % (n - 1);
+    if (b >= a) ++b;
+    return lanes[a]->size.load() <= lanes[b]->size.load() ? *lanes[a]
+                                                          : *lanes[b];
+  }
+  void push_lane(Message&& item) {
+    lane& l = choose(item);
+    bool busy;
+    {
+      Lock lk{l.mtx};
+      l.q.push_back(std::move(item));
+      l.size.fetch_add(1);
+      busy = !l.idle.load();
+    }
+    pushes.fetch_add(1);
+    l.cv.notify_one();
+    if (!busy) return;
+    // the owner is busy, wake the idle consumers, those the steal filter
+    // lets take the item do. A consumer that goes idle after the count of
+    // pushes is bumped sees it changed and looks again; the others sleep
+    // under their lock until they wait, so the notify is not lost
+    for (auto& other : lanes) {
+      if (other.get() == &l || !other->idle.load()) continue;
+      Lock lk{other->mtx};
+      other->cv.notify_one();
+    }
+  }
+  bool take_front(lane& l, Message& out) {
+    Lock lk{l.mtx};
+    if (l.q.size() == 0) return false;
+    out = std::move(l.q.front());
+    l.q.pop_front();
+    l.size.fetch_sub(1);
+    return true;
+  }
+  /**
+   * @brief Steal from the busiest lane, or from the next ones if the steal
+   * filter rejects its item
+   *
+   */
+  bool steal(int thief, Message& out) {
+    const int n = lanes.size();
+    if (n == 1) return false;
+    int victim = -1;
+    int most = 0;
+    for (int i = 0; i < n; ++i) {
+      int sz = lanes[i]->size.load();
+      if (i != thief && sz > most) {
+        most = sz;
+        victim = i;
+      }
+    }
+    if (victim < 0) return false;
+    for (int k = 0; k < n; ++k) {
+      const int v = (victim + k) % n;
+      if (v == thief || lanes[v]->size.load() == 0) continue;
+      if (steal_from(thief, v, out)) return true;
+    }
+    return false;
+  }
+  bool steal_from(int thief, int victim, Message& out) {
+    lane& l = *lanes[victim];
+    Lock lk{l.mtx};
+    if (l.q.size() == 0) return false;
+    if (steal_filter && !steal_filter(thief, victim, l.q.back())) return false;
+    out = std::move(l.q.back());
+    l.q.pop_back();
+    l.size.fetch_sub(1);
+    steals.fetch_add(1);
+    return true;
+  }
+};
 } // namespace sync
 } // namespace st
\ No newline at end of file
@@ -0,0 +1,195 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file define the metrics of the server. Components register
+ * named counters and gauges once, then update them lock-free; the registry
+ * is dumped as JSON at GET /metrics. Names are property tree paths, so
+ * "admission.admitted" is reported as {"admission": {"admitted": ...}}.
+ * Histograms are reported as their count, sum and a few percentiles.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include "st_utils.h"
+
+namespace st {
+namespace metrics {
+
+/**
+ * @brief Monotonic counter
+ *
+ */
+class counter {
+ public:
+  void inc(uint64_t n = 1) { v.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return v.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> v{0};
+};
+
+/**
+ * @brief Gauge, i.e. a value that goes up and down
+ *
+ */
+class gauge {
+ public:
+  void set(int64_t n) { v.store(n, std::memory_order_relaxed); }
+  void add(int64_t n) { v.fetch_add(n, std::memory_order_relaxed); }
+  int64_t get() const { return v.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> v{0};
+};
+
+/**
+ * @brief Histogram of positive values, e.g. latencies in microseconds
+ * @details Log-linear buckets, 4 per power of two, so percentiles are
+ * within 25% of the true value
+ */
+class histogram {
+ public:
+  histogram() {
+    for (auto& b : buckets) b.store(0);
+  }
+  void observe(uint64_t v) {
+    buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    n.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(v, std::memory_order_relaxed);
+  }
+  uint64_t count() const { return n.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return total.load(std::memory_order_relaxed); }
+  /**
+   * @brief Upper bound of the bucket of a quantile
+   *
+   * @param q in [0, 1]
+   * @return uint64_t 0 if empty
+   */
+  uint64_t quantile(double q) const {
+    uint64_t counts[num_buckets];
+    uint64_t all = 0;
+    for (int b = 0; b < num_buckets; ++b) {
+      counts[b] = buckets[b].load(std::memory_order_relaxed);
+      all += counts[b];
+    }
+    if (all == 0) return 0;
+    const uint64_t rank = static_cast<uint64_t>(q * (all - 1)) + 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < num_buckets; ++b) {
+      seen += counts[b];
+      if (seen >= rank) return upper(b);
+    }
+    return upper(num_buckets - 1);
+  }
+
+ private:
+  static constexpr int num_buckets = 252;
+  std::atomic<uint64_t> buckets[num_buckets];
+  std::atomic<uint64_t> n{0};
+  std::atomic<uint64_t> total{0};
+  static int bucket(uint64_t v) {
+    if (v < 4) return v;
+    int e = 63 - __builtin_clzll(v);
+    return 4 * (e - 1) + ((v >> (e - 2)) & 3);
+  }
+  static uint64_t upper(int b) {
+    if (b < 4) return b;
+    const int e = b / 4 + 1;
+    const uint64_t lower = static_cast<uint64_t>(4 + b % 4) << (e - 2);
+    return lower + (uint64_t(1) << (e - 2)) - 1;
+  }
+};
+
+/**
+ * @brief Registry of the metrics
+ * @details Lookups take a lock, so components should keep the references
+ * they get; the references stay valid for the life time of the registry
+ */
+class registry {
+ public:
+  /**
+   * @brief Get or create a counter
+   *
+   * @param name
+   * @return counter&
+   */
+  counter& get_counter(const std::string& name) {
+    std::lock_guard<std::mutex> lk{mtx};
+    auto& p = counters[name];
+    if (!p) p.reset(new counter);
+    return *p;
+  }
+  /**
+   * @brief Get or create a gauge
+   *
+   * @param name
+   * @return gauge&
+   */
+  gauge& get_gauge(const std::string& name) {
+    std::lock_guard<std::mutex> lk{mtx};
+    auto& p = gauges[name];
+    if (!p) p.reset(new gauge);
+    return *p;
+  }
+  /**
+   * @brief Get or create a histogram
+   *
+   * @param name
+   * @return histogram&
+   */
+  histogram& get_histogram(const std::string& name) {
+    std::lock_guard<std::mutex> lk{mtx};
+    auto& p = histograms[name];
+    if (!p) p.reset(new histogram);
+    return *p;
+  }
+  /**
+   * @brief Dump all metrics in JSON
+   *
+   * @return std::string
+   */
+  std::string to_json() {
+    JSON res;
+    {
+      std::lock_guard<std::mutex> lk{mtx};
+      for (auto& c : counters) res.put<uint64_t>(c.first, c.second->get());
+      for (auto& g : gauges) res.put<int64_t>(g.first, g.second->get());
+      for (auto& h : histograms) {
+        res.put<uint64_t>(h.first + ".count", h.second->count());
+        res.put<uint64_t>(h.first + ".sum", h.second->sum());
+        res.put<uint64_t>(h.first + ".p50", h.second->quantile(0.5));
+        res.put<uint64_t>(h.first + ".p95", h.second->quantile(0.95));
+        res.put<uint64_t>(h.first + ".p99", h.second->quantile(0.99));
+      }
+    }
+    std::ostringstream ss;
+    bpt::write_json(ss, res);
+    return ss.str();
+  }
+
+ private:
+  std::mutex mtx;
+  std::map<std::string, std::unique_ptr<counter>> counters;
+  std::map<std::string, std::unique_ptr<gauge>> gauges;
+  std::map<std::string, std::unique_ptr<histogram>> histograms;
+};
+
+/**
+ * @brief The registry of the server
+ *
+ * @return registry&
+ */
+inline registry& server_metrics() {
+  static registry r;
+  return r;
+}
+
+}  // namespace metrics
+}  // namespace st
@@ -0,0 +1,396 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the object pools of the server, so the
+ * per-request objects of the message path are recycled instead of being
+ * allocated and freed for each request. Each thread keeps a small cache of
+ * free objects; the threads that only release objects, e.g. the inference
+ * workers, hand them back to the producers through the shared free list.
+ * The small blocks of the HTTP messages and the handlers of a session are
+ * recycled the same way.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace st {
+namespace sync {
+
+template <class T>
+class object_pool;
+
+/**
+ * @brief Handle of a pooled object, reference counted
+ * @details The count lives in the object, so a copy costs an atomic
+ * increment and no allocation. The last handle gives the object back to its
+ * pool
+ * @tparam T
+ */
+template <class T>
+class pool_ptr {
+ public:
+  pool_ptr() = default;
+  pool_ptr(std::nullptr_t) {}
+  pool_ptr(const pool_ptr& rhs) : n(rhs.n) {
+    if (n) n->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  pool_ptr(pool_ptr&& rhs) : n(rhs.n) { rhs.n = nullptr; }
+  ~pool_ptr() { reset(); }
+  pool_ptr& operator=(const pool_ptr& rhs) {
+    pool_ptr(rhs).swap(*this);
+    return *this;
+  }
+  pool_ptr& operator=(pool_ptr&& rhs) {
+    pool_ptr(std::move(rhs)).swap(*this);
+    return *this;
+  }
+  void swap(pool_ptr& rhs) { std::swap(n, rhs.n); }
+  /**
+   * @brief Drop the handle, recycle the object if it was the last one
+   *
+   */
+  void reset() {
+    if (n && n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      object_pool<T>::recycle(n);
+    }
+    n = nullptr;
+  }
+  T* get() const { return n ? &n->value : nullptr; }
+  T& operator*() const { return n->value; }
+  T* operator->() const { return &n->value; }
+  explicit operator bool() const { return n != nullptr; }
+
+ private:
+  friend class object_pool<T>;
+  struct node {
+    T value;
+    std::atomic<int> refs{0};
+  };
+  node* n = nullptr;
+  explicit pool_ptr(node* _n) : n(_n) {
+    n->refs.store(1, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * @brief Pool of objects of a type
+ * @details One pool per type, see instance(); it lives until the process
+ * exits, so the handles may outlive any thread. A recycled object is reset
+ * with T::recycle(), it keeps its buffers for the next user, up to
+ * pooled_capacity
+ * @tparam T default constructible, with a recycle() method
+ */
+template <class T>
+class object_pool {
+  using node = typename pool_ptr<T>::node;
+
+ public:
+  /**
+   * @brief Take an object, allocate one only if there is no free one
+   *
+   * @return pool_ptr<T>
+   */
+  static pool_ptr<T> acquire() {
+    auto& c = cache();
+    if (c.free.empty()) instance().refill(c.free);
+    if (c.free.empty()) {
+      instance().created.fetch_add(1, std::memory_order_relaxed);
+      return pool_ptr<T>(new node);
+    }
+    node* n = c.free.back();
+    c.free.pop_back();
+    return pool_ptr<T>(n);
+  }
+  /**
+   * @brief Number of objects allocated so far, flat in the steady state
+   *
+   */
+  static size_t allocated() { return instance().created.load(); }
+
+ private:
+  friend class pool_ptr<T>;
+  static constexpr size_t batch = 32;  //!< objects moved at once
+  std::mutex mtx;                      //!< protects shared
+  std::vector<node*> shared;           //!< free objects of all threads
+  std::atomic<size_t> created{0};      //!< objects allocated
+  /**
+   * @brief Free objects of a thread, given back to the pool on exit
+   *
+   */
+  struct thread_cache {
+    std::vector<node*> free;
+    thread_cache() { free.reserve(2 * batch); }
+    ~thread_cache() { instance().spill(free, 0); }
+  };
+  static object_pool& instance() {
+    // never destroyed, handles may be released after exit() began
+    static object_pool* pool = new object_pool;
+    return *pool;
+  }
+  static thread_cache& cache() {
+    static thread_local thread_cache c;
+    return c;
+  }
+  static void recycle(node* n) {
+    n->value.recycle();
+    auto& c = cache();
+    c.free.push_back(n);
+    if (c.free.size() >= 2 * batch) instance().spill(c.free, batch);
+  }
+  /**
+   * @brief Move free objects of a thread to the shared list
+   *
+   * @param free
+   * @param keep objects the thread keeps
+   */
+  void spill(std::vector<node*>& free, size_t keep) {
+    if (free.size() <= keep) return;
+    std::lock_guard<std::mutex> lk{mtx};
+    shared.insert(shared.end(), free.begin() + keep, free.end());
+    free.resize(keep);
+  }
+  /**
+   * @brief Take a batch of free objects from the shared list
+   *
+   */
+  void refill(std::vector<node*>& free) {
+    std::lock_guard<std::mutex> lk{mtx};
+    const size_t n = std::min(batch, shared.size());
+    free.insert(free.end(), shared.end() - n, shared.end());
+    shared.resize(shared.size() - n);
+  }
+};
+
+template <class T>
+constexpr size_t object_pool<T>::batch;
+
+/**
+ * @brief Capacity a buffer of a pooled object keeps when it is recycled
+ * @details Enough for the usual images. A buffer grown past it by a rare
+ * large request is freed instead: a pool caches up to 64 objects per thread,
+ * each could otherwise pin a body of the size limit for good
+ */
+constexpr size_t pooled_capacity = 4 << 20;
+
+/**
+ * @brief Empty a buffer of a pooled object, free it if over pooled_capacity
+ *
+ * @param buf
+ */
+inline void recycle_buffer(std::string& buf) {
+  if (buf.capacity() > pooled_capacity) {
+    std::string().swap(buf);
+  } else {
+    buf.clear();
+  }
+}
+
+/**
+ * @brief Memory of the handlers of a strand, reused by each operation
+ * @details A few blocks, each grown to the largest handler it held: a post
+ * to the strand takes two, the handler and the invoker of the strand, a
+ * read or a write of the session takes its state and the operation on the
+ * socket. Once the blocks fit the operations of the session, they stop
+ * allocating; other handlers fall back to the heap
+ */
+class handler_memory {
+ public:
+  handler_memory() = default;
+  handler_memory(const handler_memory&) = delete;
+  handler_memory& operator=(const handler_memory&) = delete;
+  ~handler_memory() {
+    for (auto& b : blocks) ::operator delete(b.data.load());
+  }
+  void* allocate(std::size_t size) {
+    // a free block that fits, else a free block to grow. The size read
+    // before taking a block is only a hint, it's checked again once held
+    for (int pass = 0; pass < 2; ++pass) {
+      for (auto& b : blocks) {
+        if (pass == 0 && b.size.load(std::memory_order_relaxed) < size) {
+          continue;
+        }
+        bool expected = false;
+        if (!b.in_use.compare_exchange_strong(expected, true,
+                                              std::memory_order_acquire)) {
+          continue;
+        }
+        if (b.size.load(std::memory_order_relaxed) < size) {
+          // cleared before it's freed: once the heap hands the old data out
+          // again, deallocate() must not take it for this block
+          ::operator delete(b.data.exchange(nullptr));
+          b.size.store(0, std::memory_order_relaxed);
+          const size_t grown = size < min_size ? size_t{min_size} : size;
+          b.data.store(::operator new(grown));
+          b.size.store(grown, std::memory_order_relaxed);
+        }
+        return b.data.load(std::memory_order_relaxed);
+      }
+    }
+    return ::operator new(size);
+  }
+  void deallocate(void* p) {
+    for (auto& b : blocks) {
+      if (p == b.data.load()) {
+        b.in_use.store(false, std::memory_order_release);
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+
+ private:
+  static constexpr int slots = 8;          //!< number of blocks
+  static constexpr size_t min_size = 256;  //!< bytes of a new block
+  /**
+   * @brief A block, its size and data are changed by the holder of in_use
+   * @details Both are atomic: the other threads read them while looking for
+   * a free block, or for the block of the memory they release
+   */
+  struct block {
+    std::atomic<void*> data{nullptr};
+    std::atomic<size_t> size{0};
+    std::atomic<bool> in_use{false};
+  };
+  block blocks[slots];  //!< the blocks
+};
+
+/**
+ * @brief Allocator of the handlers on a handler_memory
+ *
+ * @tparam T
+ */
+template <class T>
+class handler_allocator {
+ public:
+  using value_type = T;
+  explicit handler_allocator(handler_memory& _memory) : memory(_memory) {}
+  template <class U>
+  handler_allocator(const handler_allocator<U>& rhs) : memory(rhs.memory) {}
+  bool operator==(const handler_allocator& rhs) const {
+    return &memory == &rhs.memory;
+  }
+  bool operator!=(const handler_allocator& rhs) const {
+    return &memory != &rhs.memory;
+  }
+  T* allocate(std::size_t n) const {
+    return static_cast<T*>(memory.allocate(sizeof(T) * n));
+  }
+  void deallocate(T* p, std::size_t) const { memory.deallocate(p); }
+
+ private:
+  template <class>
+  friend class handler_allocator;
+  handler_memory& memory;
+};
+
+/**
+ * @brief Small blocks recycled by the threads
+ * @details Blocks are rounded up to a power of two; a freed block is kept
+ * for the next allocation of its size, so a steady stream of equal
+ * objects, e.g. the header fields of the HTTP messages, stops allocating.
+ * As in object_pool, each thread caches a few blocks of each size and
+ * trades batches with the others, a block may be freed by another thread
+ * than the one which took it. Blocks larger than the largest size go to
+ * the heap
+ */
+class block_cache {
+ public:
+  static void* allocate(std::size_t size) {
+    const int c = size_class(size);
+    if (c < 0) return ::operator new(size);
+    auto& free = cache().free[c];
+    if (free.empty()) instance().refill(c, free);
+    if (free.empty()) return ::operator new(min_size << c);
+    void* p = free.back();
+    free.pop_back();
+    return p;
+  }
+  static void deallocate(void* p, std::size_t size) {
+    const int c = size_class(size);
+    if (c < 0) return ::operator delete(p);
+    auto& free = cache().free[c];
+    free.push_back(p);
+    if (free.size() >= 2 * batch) instance().spill(c, free, batch);
+  }
+
+ private:
+  static constexpr size_t min_size = 32;  //!< bytes of the first size
+  static constexpr int classes = 6;       //!< sizes, up to 1KB
+  static constexpr size_t batch = 32;     //!< blocks moved at once
+  std::mutex mtx;                         //!< protects shared
+  std::vector<void*> shared[classes];     //!< free blocks of all threads
+  /**
+   * @brief Free blocks of a thread, given back to the cache on exit
+   *
+   */
+  struct thread_cache {
+    std::vector<void*> free[classes];
+    thread_cache() {
+      for (auto& f : free) f.reserve(2 * batch);
+    }
+    ~thread_cache() {
+      for (int c = 0; c < classes; ++c) instance().spill(c, free[c], 0);
+    }
+  };
+  static block_cache& instance() {
+    // never destroyed, blocks may be freed after exit() began
+    static block_cache* blocks = new block_cache;
+    return *blocks;
+  }
+  static thread_cache& cache() {
+    static thread_local thread_cache c;
+    return c;
+  }
+  static int size_class(std::size_t size) {
+    int c = 0;
+    while (c < classes && (min_size << c) < size) ++c;
+    return c < classes ? c : -1;
+  }
+  void spill(int c, std::vector<void*>& free, size_t keep) {
+    if (free.size() <= keep) return;
+    std::lock_guard<std::mutex> lk{mtx};
+    shared[c].insert(shared[c].end(), free.begin() + keep, free.end());
+    free.resize(keep);
+  }
+  void refill(int c, std::vector<void*>& free) {
+    std::lock_guard<std::mutex> lk{mtx};
+    const size_t n = shared[c].size() < batch ? shared[c].size() : batch;
+    free.insert(free.end(), shared[c].end() - n, shared[c].end());
+    shared[c].resize(shared[c].size() - n);
+  }
+};
+
+/**
+ * @brief Allocator on the block_cache, stateless
+ *
+ * @tparam T
+ */
+template <class T>
+class recycling_allocator {
+ public:
+  using value_type = T;
+  recycling_allocator() = default;
+  template <class U>
+  recycling_allocator(const recycling_allocator<U>&) {}
+  bool operator==(const recycling_allocator&) const { return true; }
+  bool operator!=(const recycling_allocator&) const { return false; }
+  T* allocate(std::size_t n) const {
+    return static_cast<T*>(block_cache::allocate(sizeof(T) * n));
+  }
+  void deallocate(T* p, std::size_t n) const {
+    block_cache::deallocate(p, sizeof(T) * n);
+  }
+};
+
+}  // namespace sync
+}  // namespace st
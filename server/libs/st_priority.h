@@ -0,0 +1,240 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the priority classes of the requests, e.g.
+ * interactive and bulk. A request gets its class from the X-Priority header,
+ * the x-priority gRPC metadata or the /{class}/ prefix of its endpoint.
+ * Each class has its own queue in every lane of the task queue, see
+ * class_queue, an optional limit of requests in flight, and its own latency
+ * metrics.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "st_ie_common.h"
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_metrics.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief Parameters of a priority class
+ *
+ */
+struct priority_class_param {
+  std::string name;      //!< name in headers, metadata and endpoints
+  int weight = 1;        //!< share of the weighted dispatch
+  int max_inflight = 0;  //!< maximum requests in flight, 0 = unlimited
+};
+
+/**
+ * @brief Parameters of the priority classes
+ *
+ */
+struct priority_param {
+  std::vector<priority_class_param> classes;  //!< the most urgent first
+  std::string default_class;  //!< class of the requests without class
+  bool strict = false;        //!< strict priority instead of weighted
+  int max_wait_ms = 1000;     //!< starvation bound of a class, 0 = none
+};
+
+/**
+ * @brief The priority classes of the server
+ * @details Thread-safe, one object is shared by all request threads
+ */
+class priority_classes {
+ public:
+  priority_classes() = delete;
+  /**
+   * @brief Construct a new priority classes object
+   *
+   * @param _param
+   */
+  explicit priority_classes(const priority_param& _param) : param(_param) {
+    if (param.classes.empty()) {
+      priority_class_param c;
+      c.name = "default";
+      param.classes.push_back(c);
+    }
+    default_id = param.default_class.empty() ? 0 : find(param.default_class);
+    if (default_id < 0) {
+      throw std::logic_error("Priority: unknown default class " +
+                             param.default_class);
+    }
+    const int n = param.classes.size();
+    inflight.reset(new std::atomic<int>[n]);
+    for (int c = 0; c < n; ++c) {
+      auto& m = metrics::server_metrics();
+      const std::string prefix = "priority." + param.classes[c].name;
+      inflight[c].store(0);
+      requests.push_back(&m.get_counter(prefix + ".requests"));
+      shed.push_back(&m.get_counter(prefix + ".shed"));
+      latency.push_back(&m.get_histogram(prefix + ".latency us"));
+    }
+  }
+  /**
+   * @brief Read the parameters from the "priority" node of the configuration
+   *
+   * @param conf
+   * @return priority_param
+   */
+  static priority_param read_param(const JSON& conf) {
+    priority_param p;
+    p.strict = conf.get<std::string>("dispatch", "weighted") == "strict";
+    p.max_wait_ms = conf.get<int>("max wait ms", p.max_wait_ms);
+    p.default_class = conf.get<std::string>("default", "");
+    auto classes = conf.get_child_optional("classes");
+    if (classes) {
+      for (auto& it : *classes) {
+        priority_class_param c;
+        c.name = it.second.get<std::string>("name");
+        c.weight = it.second.get<int>("weight", c.weight);
+        c.max_inflight = it.second.get<int>("max inflight", c.max_inflight);
+        p.classes.push_back(c);
+      }
+    }
+    return p;
+  }
+  /**
+   * @brief A queue of a lane of the task queue, one sub-queue per class
+   *
+   * @tparam Queue a class_queue
+   * @param proto the queue of each class is a copy of it
+   * @return Queue
+   */
+  template <class Queue>
+  Queue make_queue(const typename Queue::queue_type& proto =
+                       typename Queue::queue_type()) const {
+    std::vector<int> weights;
+    for (auto& c : param.classes) weights.push_back(std::max(c.weight, 1));
+    auto max_wait = param.max_wait_ms > 0
+                        ? std::chrono::duration_cast<deadline_clock::duration>(
+                              std::chrono::milliseconds(param.max_wait_ms))
+                        : deadline_clock::duration::max();
+    return Queue(weights, param.strict, max_wait, proto);
+  }
+  /**
+   * @brief Number of classes
+   *
+   */
+  int size() const { return param.classes.size(); }
+  /**
+   * @brief Name of a class
+   *
+   */
+  const std::string& name(int c) const { return param.classes[c].name; }
+  /**
+   * @brief Class of a name
+   *
+   * @param name
+   * @return int -1 if unknown
+   */
+  int find(beast::string_view name) const {
+    for (size_t c = 0; c < param.classes.size(); ++c) {
+      if (name == param.classes[c].name) return c;
+    }
+    return -1;
+  }
+  /**
+   * @brief Class of a request from its header or metadata value
+   *
+   * @param value empty if not set
+   * @return int the default class if not set or unknown
+   */
+  int classify(beast::string_view value) const {
+    const int c = value.empty() ? -1 : find(value);
+    return c < 0 ? default_id : c;
+  }
+  /**
+   * @brief Class of a request from the prefix of its target, i.e.
+   * /{class}/{resource}; the prefix is removed from the target
+   *
+   * @param target
+   * @return int -1 if the target has no class prefix
+   */
+  int strip_prefix(beast::string_view& target) const {
+    if (target.size() < 2 || target[0] != '/') return -1;
+    const auto end = target.find('/', 1);
+    if (end == beast::string_view::npos) return -1;
+    const int c = find(target.substr(1, end - 1));
+    if (c >= 0) target.remove_prefix(end);
+    return c;
+  }
+  /**
+   * @brief A request of a class enters the server, if its class has room
+   *
+   * @param c
+   * @return true if admitted
+   */
+  bool enter(int c) {
+    c = clamp(c);
+    requests[c]->inc();
+    const int limit = param.classes[c].max_inflight;
+    int cur = inflight[c].load();
+    do {
+      if (limit > 0 && cur >= limit) {
+        shed[c]->inc();
+        return false;
+      }
+    } while (!inflight[c].compare_exchange_weak(cur, cur + 1));
+    return true;
+  }
+  /**
+   * @brief Whether a request of a class would enter now, nothing is taken
+   *
+   * @param c
+   */
+  bool has_room(int c) const {
+    c = clamp(c);
+    const int limit = param.classes[c].max_inflight;
+    return limit <= 0 || inflight[c].load() < limit;
+  }
+  /**
+   * @brief A request of a class that entered leaves the server
+   *
+   * @param c
+   */
+  void leave(int c) { inflight[clamp(c)].fetch_sub(1); }
+  /**
+   * @brief A request of a class is shed by the admission control
+   *
+   * @param c
+   */
+  void count_shed(int c) { shed[clamp(c)]->inc(); }
+  /**
+   * @brief Record the latency of a served request
+   *
+   * @param c
+   * @param us
+   */
+  void record(int c, uint64_t us) { latency[clamp(c)]->observe(us); }
+
+  using ptr = std::shared_ptr<priority_classes>;
+
+ private:
+  priority_param param;                         //!< the classes
+  int default_id = 0;                           //!< the default class
+  std::unique_ptr<std::atomic<int>[]> inflight;  //!< requests in flight
+  std::vector<metrics::counter*> requests;       //!< requests per class
+  std::vector<metrics::counter*> shed;           //!< shed requests per class
+  std::vector<metrics::histogram*> latency;      //!< latency per class
+  int clamp(int c) const {
+    return std::min(std::max(c, 0), static_cast<int>(param.classes.size()) - 1);
+  }
+};  // class priority_classes
+
+}  // namespace worker
+}  // namespace st
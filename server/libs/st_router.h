@@ -0,0 +1,172 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the latency-model router of heterogeneous
+ * inference engines. Each engine keeps an online estimate of its service
+ * time by input size, and a request goes to the engine with the earliest
+ * expected completion, i.e. (queued + in service + 1) x service time.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "st_ie_common.h"
+#include "st_message_queue.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::ie;
+
+/**
+ * @brief Latency-model router
+ * @details Estimates are moving averages of the service time, per engine
+ * and per power of two of the input size. Each engine is served by one
+ * worker, so each estimate has a single writer; producers only read.
+ */
+class latency_router {
+ public:
+  /**
+   * @brief Construct a new latency router object
+   *
+   * @param _taskq task queue, one lane per engine
+   * @param _alpha weight of a new sample in the moving average
+   */
+  latency_router(object_detection_mq<single_bell>::ptr& _taskq,
+                 double _alpha = 0.2)
+      : taskq(_taskq), alpha(_alpha) {
+    const int n = taskq->num_lanes();
+    for (int i = 0; i < n; ++i) {
+      engines.emplace_back(new engine_model);
+    }
+  }
+  /**
+   * @brief Install the router as lane chooser and steal filter of the queue
+   *
+   */
+  void attach() {
+    taskq->set_chooser(
+        [this](const obj_detection_msg<single_bell>& m) { return route(m); });
+    taskq->set_steal_filter([this](int thief, int victim,
+                                   const obj_detection_msg<single_bell>& m) {
+      return may_steal(thief, victim, m);
+    });
+  }
+  /**
+   * @brief Engine with the earliest expected completion of a message
+   *
+   * @param m
+   * @return int
+   */
+  int route(const obj_detection_msg<single_bell>& m) const {
+    const int b = bucket(input_size(m));
+    int best = 0;
+    double best_time = std::numeric_limits<double>::max();
+    for (int e = 0; e < static_cast<int>(engines.size()); ++e) {
+      const int ahead = taskq->lane_size(e) + engines[e]->busy.load();
+      const double t = (ahead + 1) * estimate(e, b);
+      if (t < best_time) {
+        best_time = t;
+        best = e;
+      }
+    }
+    return best;
+  }
+  /**
+   * @brief An idle engine may steal a message if it completes it before the
+   * engine it was routed to would
+   *
+   */
+  bool may_steal(int thief, int victim,
+                 const obj_detection_msg<single_bell>& m) const {
+    const int b = bucket(input_size(m));
+    const int ahead = taskq->lane_size(victim) + engines[victim]->busy.load();
+    return estimate(thief, b) < ahead * estimate(victim, b);
+  }
+  /**
+   * @brief An engine starts serving a message
+   *
+   * @param e
+   */
+  void begin(int e) { engines[e]->busy.fetch_add(1); }
+  /**
+   * @brief An engine is done with a message
+   *
+   * @param e
+   * @param m
+   * @param us service time in microseconds
+   */
+  void end(int e, const obj_detection_msg<single_bell>& m, double us) {
+    auto& model = *engines[e];
+    model.busy.fetch_sub(1);
+    auto& est = model.us[bucket(input_size(m))];
+    const double old = est.load(std::memory_order_relaxed);
+    est.store(old > 0 ? (1 - alpha) * old + alpha * us : us,
+              std::memory_order_relaxed);
+  }
+  /**
+   * @brief An engine failed on a message, its time is not a sample
+   *
+   * @param e
+   */
+  void fail(int e) { engines[e]->busy.fetch_sub(1); }
+  /**
+   * @brief Input size of a message: bytes of the encoded image, or of the
+   * decoded image (tile)
+   *
+   */
+  static int64_t input_size(const obj_detection_msg<single_bell>& m) {
+    if (m.image) return m.image->total() * m.image->elemSize();
+    return m.size;
+  }
+
+  using ptr = std::shared_ptr<latency_router>;
+
+ private:
+  static constexpr int num_buckets = 48;
+  struct engine_model {
+    std::atomic<double> us[num_buckets];  //!< service time, 0 = unknown
+    std::atomic<int> busy{0};              //!< messages in service
+    engine_model() {
+      for (auto& u : us) u.store(0);
+    }
+  };
+  object_detection_mq<single_bell>::ptr taskq;
+  std::vector<std::unique_ptr<engine_model>> engines;
+  double alpha;
+  static int bucket(int64_t size) {
+    int b = 0;
+    while (size > 1 && b + 1 < num_buckets) {
+      size >>= 1;
+      ++b;
+    }
+    return b;
+  }
+  /**
+   * @brief Service time of an engine for a bucket
+   * @details Unknown sizes are extrapolated linearly from the nearest known
+   * bucket. An engine that never served anything is estimated at 1 us, so
+   * it gets traffic and learns; ties are then broken by queue length.
+   */
+  double estimate(int e, int b) const {
+    const auto& us = engines[e]->us;
+    for (int d = 0; d < num_buckets; ++d) {
+      if (b - d >= 0) {
+        const double v = us[b - d].load(std::memory_order_relaxed);
+        if (v > 0) return v * (int64_t(1) << d);
+      }
+      if (b + d < num_buckets) {
+        const double v = us[b + d].load(std::memory_order_relaxed);
+        if (v > 0) return v / (int64_t(1) << d);
+      }
+    }
+    return 1.0;
+  }
+};  // class latency_router
+
+}  // namespace worker
+}  // namespace st
@@ -14,6 +14,7 @@
 #include "st_ie_base.h"
 #include "st_ie_factory.h"
 #include "st_worker.h"
+#include "st_async_http.h"
 #include "st_utils.h"
 #include "st_grpc_impl.h"
 #include "st_logging.h"
@@ -40,20 +41,15 @@ public:
 protected:
   JSON config;
   server(JSON& _config): config(_config) {};
-private:
-  server *actual; // the actual server
-};
-
-// HTTP server
-class http_server : public server {
-public:
-  http_server(JSON &_config) : server(_config) {};
-  virtual void run() override {
-    try {
-    // server
-    auto ip = config.get<std::string>("ip");
-    auto port = config.get<std::string>("port");
-    // inference engine
+  /**
+   * @brief Create all inference engines in the configuration
+   * @details FPGA inference worker cannot run outside of main threads
+   * Therefore, current version of inference server can run at most
+   * one FPGA inference worker. By convention, the FPGA inference engine
+   * is always the first one in the returned vector
+   * @return std::vector<inference_engine::ptr>
+   */
+  std::vector<inference_engine::ptr> create_inference_engines() {
     server_log->info("Creating inference engines");
     std::vector<inference_engine::ptr> IEs;
     const auto& ie_array = config.get_child("inference engines");
@@ -90,34 +86,249 @@ public:
         }
       }
     }
-
-    // task queue - Not necessary used with CPU inference
-    object_detection_mq<single_bell>::ptr TaskQueue =
-        std::make_shared<object_detection_mq<single_bell>>();
-
-    // listening worker
-    server_log->info("Spawning listener threads");
-    sync_listen_worker listener{TaskQueue};
+    return IEs;
+  }
+  /**
+   * @brief Create the task queue of the inference workers
+   * @details By default, each inference worker has its own lane and steals
+   * from the others when idle; "task queue": "shared" makes all workers pop
+   * from the same lane. Each lane has one queue per priority class, and
+   * each class one virtual queue per tenant
+   * @param num_workers
+   * @param Classes
+   * @param Tenants
+   * @return object_detection_mq<single_bell>::ptr
+   */
+  object_detection_mq<single_bell>::ptr create_task_queue(
+      int num_workers, priority_classes::ptr& Classes,
+      tenant_table::ptr& Tenants) {
+    using msg = obj_detection_msg<single_bell>;
+    using tenant_queue = fair_queue<msg, edf_queue<msg>>;
+    using lane_queue = class_queue<msg, tenant_queue>;
+    const bool shared = config.get<std::string>("task queue", "") == "shared";
+    const int lanes = shared ? 1 : num_workers;
+    server_log->info("Task queue with {} lanes", lanes);
+    // spins of a request thread before it parks, waiting for its answer
+    single_bell::spin_budget().store(
+        config.get<int>("bell spin", single_bell::spin_budget().load()));
+    return std::make_shared<object_detection_mq<single_bell>>(
+        lanes, Classes->make_queue<lane_queue>(
+                   Tenants->make_queue<tenant_queue>()));
+  }
+  /**
+   * @brief Create the tenants of the server
+   * @details Read from the optional "tenants" node; without it, all
+   * requests are of one tenant
+   * @return tenant_table::ptr
+   */
+  tenant_table::ptr create_tenant_table() {
+    tenant_param param;
+    auto tenants = config.get_child_optional("tenants");
+    if (tenants) {
+      param = tenant_table::read_param(*tenants);
+      server_log->info("Fair queueing of the tenants by {}",
+                       param.by_api_key ? "API key" : "client IP");
+    }
+    return std::make_shared<tenant_table>(param);
+  }
+  /**
+   * @brief Create the priority classes of the requests
+   * @details Read from the optional "priority" node; without it, there is
+   * one class
+   * @return priority_classes::ptr
+   */
+  priority_classes::ptr create_priority_classes() {
+    priority_param param;
+    auto priority = config.get_child_optional("priority");
+    if (priority) {
+      param = priority_classes::read_param(*priority);
+    }
+    auto Classes = std::make_shared<priority_classes>(param);
+    for (int c = 0; c < Classes->size(); ++c) {
+      server_log->info("Priority class {}: {}", c, Classes->name(c));
+    }
+    return Classes;
+  }
+  /**
+   * @brief Create the router of the engines
+   * @details With "router": "latency", requests go to the engine with the
+   * earliest expected completion instead of the shorter of two random
+   * queues. Needs one queue per engine
+   * @param TaskQueue
+   * @return latency_router::ptr, null if not configured
+   */
+  latency_router::ptr create_router(
+      object_detection_mq<single_bell>::ptr& TaskQueue) {
+    if (config.get<std::string>("router", "") != "latency") return nullptr;
+    if (TaskQueue->num_lanes() == 1) {
+      server_log->warn("Latency router needs one task queue per engine");
+      return nullptr;
+    }
+    server_log->info("Routing requests by expected completion time");
+    auto Router = std::make_shared<latency_router>(TaskQueue);
+    Router->attach();
+    return Router;
+  }
+  /**
+   * @brief Create the admission control of the inference requests
+   * @details Limits are read from the optional "admission" node, unlimited
+   * by default, and the adaptive concurrency limit from the optional
+   * "limiter" node
+   * @param Classes
+   * @return admission_control::ptr
+   */
+  admission_control::ptr create_admission_control(
+      priority_classes::ptr& Classes) {
+    admission_param param;
+    auto admission = config.get_child_optional("admission");
+    if (admission) {
+      param = admission_control::read_param(*admission);
+    }
+    server_log->info("Admission control: max queue depth {}, max inflight "
+                     "bytes {} (0 = unlimited)",
+                     param.max_queue_depth, param.max_inflight_bytes);
+    auto Admission = std::make_shared<admission_control>(param);
+    Admission->set_classes(Classes);
+    auto limiter = config.get_child_optional("limiter");
+    if (limiter) {
+      auto Limiter = std::make_shared<concurrency_limiter>(
+          concurrency_limiter::read_param(*limiter));
+      server_log->info("Adaptive concurrency limit, starting at {}",
+                       Limiter->get());
+      Admission->set_limiter(Limiter);
+    }
+    return Admission;
+  }
+  /**
+   * @brief Create the tiled detector of large images
+   * @details Tiling parameters are read from the optional "tiling" node
+   * @param TaskQueue
+   * @param Admission
+   * @return tiled_detector::ptr
+   */
+  tiled_detector::ptr create_tiled_detector(
+      object_detection_mq<single_bell>::ptr& TaskQueue,
+      admission_control::ptr& Admission) {
+    tiling_param param;
+    auto tiling = config.get_child_optional("tiling");
+    if (tiling) {
+      param = tiled_detector::read_param(*tiling);
+    }
+    server_log->info("Tiled inference: {}px tiles, {}px overlap",
+                     param.tile_size, param.overlap);
+    return std::make_shared<tiled_detector>(TaskQueue, Admission, param);
+  }
+  /**
+   * @brief Create the hedging of late requests
+   * @details Opt-in, with the "hedging" node of the configuration
+   * @param TaskQueue
+   * @return request_hedger::ptr, null if not configured
+   */
+  request_hedger::ptr create_hedger(
+      object_detection_mq<single_bell>::ptr& TaskQueue) {
+    auto hedging = config.get_child_optional("hedging");
+    if (!hedging) return nullptr;
+    auto param = request_hedger::read_param(*hedging);
+    server_log->info("Hedging requests after p{}, budget {}", param.percentile,
+                     param.budget);
+    return std::make_shared<request_hedger>(TaskQueue, param);
+  }
+  /**
+   * @brief Run the inference workers, block the calling thread
+   * @details The first inference engine runs in the calling thread, i.e.
+   * the main thread, the others run in their own threads. If "post
+   * processing workers" is set in the configuration, the network outputs
+   * are parsed in a separate pool so the inference workers never wait for
+   * the parsers.
+   * @param IEs
+   * @param TaskQueue
+   */
+  void run_inference_workers(std::vector<inference_engine::ptr>& IEs,
+                             object_detection_mq<single_bell>::ptr& TaskQueue) {
+    // post-processing pool, disabled by default
+    const int num_pp_workers = config.get<int>("post processing workers", 0);
+    post_processing_mq::ptr PPQueue;
+    if (num_pp_workers > 0) {
+      server_log->info("Spawning {} post-processing threads", num_pp_workers);
+      PPQueue = std::make_shared<post_processing_mq>();
+      for (int i = 0; i < num_pp_workers; ++i) {
+        sync_pp_worker pp{PPQueue};
+        std::thread{std::bind(pp)}.detach();
+      }
+    }
 
     // inference work group
     server_log->info("Spawning inference engine threads");
-    std::thread{std::bind(listener, ip, port)}.detach();
-
     // FPGA inference worker cannot run outside of main threads
     // Therefore, current version of inference server can run at most
     // one FPGA inference worker. By convention, we assume that if there
     // is a FPGA inferencer, it would be the first IE in the configuration
     // file
     int num_workers = IEs.size() - 1;
+    auto Router = create_router(TaskQueue);
     std::vector<std::thread> ie_workers(num_workers);
     for (int i = 0; i < num_workers; ++i) {
-      sync_inference_worker<inference_engine::ptr> inferencer{IEs[i + 1],
-                                                              TaskQueue};
+      sync_inference_worker<inference_engine::ptr> inferencer{
+          IEs[i + 1], TaskQueue, i + 1, PPQueue};
+      inferencer.set_router(Router);
       ie_workers[i] = std::thread{std::bind(inferencer)};
       ie_workers[i].detach();
     }
-    sync_inference_worker<inference_engine::ptr> inferencer{IEs[0], TaskQueue};
+    sync_inference_worker<inference_engine::ptr> inferencer{IEs[0], TaskQueue,
+                                                            0, PPQueue};
+    inferencer.set_router(Router);
     inferencer();
+  }
+private:
+  server *actual; // the actual server
+};
+
+// HTTP server
+class http_server : public server {
+public:
+  http_server(JSON &_config) : server(_config) {};
+  virtual void run() override {
+    try {
+    // server
+    auto ip = config.get<std::string>("ip");
+    auto port = config.get<std::string>("port");
+    // inference engine
+    auto IEs = create_inference_engines();
+
+    // priority classes and tenants of the requests
+    auto Classes = create_priority_classes();
+    auto Tenants = create_tenant_table();
+
+    // task queue - Not necessary used with CPU inference
+    auto TaskQueue = create_task_queue(IEs.size(), Classes, Tenants);
+
+    // load shedding, tiled inference of large images and hedging
+    auto Admission = create_admission_control(Classes);
+    auto Tiler = create_tiled_detector(TaskQueue, Admission);
+    auto Hedger = create_hedger(TaskQueue);
+
+    // listening worker
+    server_log->info("Spawning listener threads");
+    http_param http;
+    auto http_conf = config.get_child_optional("http");
+    if (http_conf) http = read_http_param(*http_conf);
+    const auto front_end = config.get<std::string>("front end", "async");
+    if (front_end == "sync") {
+      // one blocking thread per connection
+      sync_listen_worker listener{TaskQueue, Admission, Tiler, Hedger,
+                                  Classes, Tenants, http};
+      std::thread{std::bind(listener, ip, port)}.detach();
+    } else if (front_end == "async") {
+      http_context ctx{TaskQueue, Admission, Tiler, Hedger,
+                       Classes, Tenants, http};
+      async_listen_worker listener{ctx, config.get<int>("http threads", 0)};
+      std::thread{std::bind(listener, ip, port)}.detach();
+    } else {
+      throw std::logic_error("Unknown front end " + front_end);
+    }
+
+    // inference work group
+    run_inference_workers(IEs, TaskQueue);
   } 
   catch (const std::exception& e) {
     std::cerr << e.what() << '\n';
@@ -137,70 +348,28 @@ public:
       auto ip = config.get<std::string>("ip");
       auto port = config.get<std::string>("port");
       // inference engine
-      std::vector<inference_engine::ptr> IEs;
-      server_log->info("Creating inference engines");
-      const auto& ie_array = config.get_child("inference engines");
-      ie_factory factory;
-      // iterate over all devices
-      for (auto it = ie_array.begin(); it != ie_array.end(); ++it) {
-        // get the configuration of each device
-        auto conf = it->second;
-        const std::string& device = conf.get<std::string>("device");
-        // get the models list, pass if there is no models
-        auto& model = conf.get_child("model");
-        if (model.size() == 0) continue;
-        const int replicas = conf.get<int>("replicas");
-        bool is_fpga = device.find("fpga") != std::string::npos;
-        if (is_fpga) {
-          // FPGA inference worker cannot run outside of main threads
-          // Therefore, current version of inference server can run at most
-          // one FPGA inference worker.
-          if (replicas > 1) {
-            throw std::logic_error("FPGA inference engine: expected 1, got " + std::to_string(replicas));
-          }
-          // bitstream
-          const std::string& bitstream = conf.get<std::string>("bitstream");
-          setenv("DLA_AOCX", bitstream.c_str(), 0);
-          // setenv("CL_CONTEXT_COMPILER_MODE_INTELFPGA","3",0);
-        }
-        // create inference engines
-        for (int i = 0; i < replicas; ++i) {
-          if (is_fpga) {
-            IEs.insert(IEs.begin(), factory.create_inference_engine(conf));
-          } else {
-            IEs.push_back(
-                factory.create_inference_engine(conf));
-          }
-        }
-      }
+      auto IEs = create_inference_engines();
+
+      // priority classes and tenants of the requests
+      auto Classes = create_priority_classes();
+      auto Tenants = create_tenant_table();
 
       // task queue - Not necessary used with CPU inference
-      object_detection_mq<single_bell>::ptr TaskQueue =
-          std::make_shared<object_detection_mq<single_bell>>();
+      auto TaskQueue = create_task_queue(IEs.size(), Classes, Tenants);
+
+      // load shedding, tiled inference of large images and hedging
+      auto Admission = create_admission_control(Classes);
+      auto Tiler = create_tiled_detector(TaskQueue, Admission);
+      auto Hedger = create_hedger(TaskQueue);
 
       // listening worker
       server_log->info("Spawning listener threads");
-      rpc_listen_worker listener{TaskQueue};
-
-      // inference work group
-      server_log->info("Spawning inference engine threads");
+      rpc_listen_worker listener{TaskQueue, Admission, Tiler, Hedger,
+                                 Classes, Tenants};
       std::thread{std::bind(listener, ip, port)}.detach();
 
-      // FPGA inference worker cannot run outside of main threads
-      // Therefore, current version of inference server can run at most
-      // one FPGA inference worker. By convention, we assume that if there
-      // is a FPGA inferencer, it would be the first IE in the configuration
-      // file
-      int num_workers = IEs.size() - 1;
-      std::vector<std::thread> ie_workers(num_workers);
-      for (int i = 0; i < num_workers; ++i) {
-        sync_inference_worker<inference_engine::ptr> inferencer{IEs[i + 1],
-                                                                TaskQueue};
-        ie_workers[i] = std::thread{std::bind(inferencer)};
-        ie_workers[i].detach();
-      }
-      sync_inference_worker<inference_engine::ptr> inferencer{IEs[0], TaskQueue};
-      inferencer();
+      // inference work group
+      run_inference_workers(IEs, TaskQueue);
     } catch (const std::exception& e) {
       std::cerr << e.what() << '\n';
     }
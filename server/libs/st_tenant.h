@@ -0,0 +1,251 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement the tenants of the server, i.e. the teams
+ * that share it. A request is identified by its API key or its client IP,
+ * each tenant has a virtual queue in every queue of the task queue, see
+ * fair_queue, so an aggressive client cannot take all the engine time.
+ * Tenants have a configurable weight, and their throughput and queue time
+ * are reported at GET /metrics.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "st_ie_common.h"
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_metrics.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief Parameters of the tenants
+ *
+ */
+struct tenant_param {
+  bool enabled = false;  //!< identify the tenants, otherwise all are one
+  bool by_api_key = false;  //!< identify by API key, then by client IP
+  std::map<std::string, int> weights;  //!< weights of known tenants
+  std::map<std::string, std::string> labels;  //!< names of known API keys
+  int default_weight = 1;              //!< weight of the other tenants
+  int max_tenants = 1024;  //!< tenants over this limit share one queue
+};
+
+/**
+ * @brief The tenants of the server
+ * @details Thread-safe, one object is shared by all request threads. Ids
+ * are stable, so the queues and the metrics of a tenant are found without
+ * lock; tenant 0 is for the anonymous requests and the ones over the limit
+ */
+class tenant_table {
+ public:
+  tenant_table() = delete;
+  /**
+   * @brief Construct a new tenant table object
+   *
+   * @param _param
+   */
+  explicit tenant_table(const tenant_param& _param)
+      : param(_param), tenants(new tenant[std::max(param.max_tenants, 0) + 1]) {
+    add("other", "other");
+  }
+  /**
+   * @brief Read the parameters from the "tenants" node of the configuration
+   *
+   * @param conf
+   * @return tenant_param
+   */
+  static tenant_param read_param(const JSON& conf) {
+    tenant_param p;
+    p.enabled = true;
+    p.by_api_key = conf.get<std::string>("key", "ip") == "api key";
+    p.default_weight = conf.get<int>("default weight", p.default_weight);
+    p.max_tenants = conf.get<int>("max tenants", p.max_tenants);
+    auto weights = conf.get_child_optional("weights");
+    if (weights) {
+      for (auto& it : *weights) {
+        if (it.second.empty()) {
+          p.weights[it.first] = it.second.get_value<int>();
+          continue;
+        }
+        // {"weight": "4", "label": "team-a"}, the label names an API key
+        p.weights[it.first] = it.second.get<int>("weight", p.default_weight);
+        auto label = it.second.get<std::string>("label", "");
+        if (!label.empty()) p.labels[it.first] = label;
+      }
+    }
+    return p;
+  }
+  /**
+   * @brief A queue of the task queue, one virtual queue per tenant
+   *
+   * @tparam Queue a fair_queue
+   * @return Queue
+   */
+  template <class Queue>
+  Queue make_queue() const {
+    const tenant_table* self = this;
+    return Queue([self](int t) { return self->weight(t); },
+                 [self](const obj_detection_msg<single_bell>& m) {
+                   self->served(m.tenant, deadline_clock::now() - m.enqueued);
+                 });
+  }
+  /**
+   * @brief Tenant of a request
+   *
+   * @param api_key value of the API key header or metadata, may be empty
+   * @param ip address of the client
+   * @return int
+   */
+  int identify(beast::string_view api_key, beast::string_view ip) {
+    if (!param.enabled) return 0;
+    const bool by_key = param.by_api_key && !api_key.empty();
+    beast::string_view key = by_key ? api_key : ip;
+    if (key.empty()) return 0;
+    // the name keeps its capacity, a known tenant costs no allocation
+    static thread_local std::string name;
+    name.assign(key.data(), key.size());
+    std::lock_guard<std::mutex> lk{mtx};
+    auto it = ids.find(name);
+    if (it != ids.end()) return it->second;
+    if (count.load() > param.max_tenants) return 0;
+    // an API key is a credential, it's never logged nor exported
+    const int id = add(name, by_key ? key_label(name) : name);
+    ids[name] = id;
+    server_log->info("New tenant {}: {}, weight {}", id, tenants[id].label,
+                     weight(id));
+    return id;
+  }
+  /**
+   * @brief Address of a gRPC peer, e.g. ipv4:127.0.0.1:5000 -> 127.0.0.1
+   *
+   * @param peer
+   * @return std::string
+   */
+  static std::string peer_address(const std::string& peer) {
+    auto begin = peer.find(':');
+    auto end = peer.rfind(':');
+    if (begin == std::string::npos || end <= begin) return peer;
+    std::string ret = peer.substr(begin + 1, end - begin - 1);
+    // ipv6 addresses are in brackets
+    if (ret.size() > 1 && ret.front() == '[' && ret.back() == ']') {
+      ret = ret.substr(1, ret.size() - 2);
+    }
+    return ret;
+  }
+  /**
+   * @brief Weight of a tenant
+   *
+   */
+  int weight(int t) const { return tenants[t].weight; }
+  /**
+   * @brief A message of a tenant was served after waiting in queue
+   *
+   * @param t
+   * @param queued
+   */
+  void served(int t, deadline_clock::duration queued) const {
+    tenants[t].served->inc();
+    tenants[t].queue_time->observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(queued).count());
+  }
+
+  using ptr = std::shared_ptr<tenant_table>;
+
+ private:
+  struct tenant {
+    int weight = 1;
+    std::string label;                         //!< name in logs and metrics
+    metrics::counter* served = nullptr;       //!< tasks served
+    metrics::histogram* queue_time = nullptr;  //!< queue time of the tasks
+  };
+  tenant_param param;
+  std::unique_ptr<tenant[]> tenants;  //!< tenants by id, never moves
+  std::atomic<int> count{0};          //!< number of tenants
+  std::mutex mtx;                     //!< protects ids
+  std::unordered_map<std::string, int> ids;  //!< tenants by name
+  /**
+   * @brief Name of the tenant of an API key
+   * @details The label of the configuration, otherwise a short hash of the
+   * key (32-bit FNV-1a)
+   * @param key
+   * @return std::string e.g. "key 9b2c41d0"
+   */
+  std::string key_label(const std::string& key) const {
+    auto l = param.labels.find(key);
+    if (l != param.labels.end()) return l->second;
+    uint32_t h = 2166136261u;
+    for (unsigned char c : key) h = (h ^ c) * 16777619u;
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "key %08x", h);
+    return buf;
+  }
+  /**
+   * @brief Add a tenant, under the lock
+   *
+   * @param name API key or address, looked up in the weights
+   * @param label name of the tenant in the logs and the metrics
+   */
+  int add(const std::string& name, const std::string& label) {
+    const int id = count.load();
+    auto w = param.weights.find(name);
+    tenants[id].weight =
+        std::max(w == param.weights.end() ? param.default_weight : w->second, 1);
+    tenants[id].label = label;
+    // metric names are property tree paths, IPv4 dots must not split them
+    std::string metric = label;
+    std::replace(metric.begin(), metric.end(), '.', '_');
+    auto& m = metrics::server_metrics();
+    tenants[id].served = &m.get_counter("tenant." + metric + ".served");
+    tenants[id].queue_time =
+        &m.get_histogram("tenant." + metric + ".queue time us");
+    count.store(id + 1);
+    return id;
+  }
+};  // class tenant_table
+
+/**
+ * @brief Tenant of the requests of a connection
+ * @details The address of a connection does not change, and its requests
+ * usually carry the same API key: the table is only asked again when the
+ * key changes
+ */
+class tenant_cache {
+ public:
+  /**
+   * @brief Tenant of a request of the connection, see tenant_table
+   *
+   * @param table
+   * @param api_key
+   * @param ip address of the connection
+   * @return int
+   */
+  int identify(tenant_table& table, beast::string_view api_key,
+               beast::string_view ip) {
+    if (id >= 0 && api_key == beast::string_view(key)) return id;
+    key.assign(api_key.data(), api_key.size());
+    id = table.identify(api_key, ip);
+    return id;
+  }
+
+ private:
+  std::string key;  //!< API key of the last request
+  int id = -1;      //!< its tenant, -1 = none yet
+};
+
+}  // namespace worker
+}  // namespace st
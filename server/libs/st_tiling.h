@@ -0,0 +1,393 @@
+/***************************************************************************************
+ * Copyright (C) 2020 canhld@.kaist.ac.kr
+ * SPDX-License-Identifier: Apache-2.0
+ * @b About: This file implement server-side tiled inference of large images,
+ * e.g. DOTA aerial images. The image is decoded once, the tiles are regions
+ * of interest of the decoded buffer, so they are not copied. All tiles are
+ * queued at once so every inference engine replica works on them, then the
+ * detections are merged with a cross-tile NMS in original image coordinates.
+ ***************************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "st_admission.h"
+#include "st_cancel.h"
+#include "st_ie_common.h"
+#include "st_ie_nms.h"
+#include "st_logging.h"
+#include "st_message_queue.h"
+#include "st_utils.h"
+
+namespace st {
+namespace worker {
+using st::ie::detection_result;
+using namespace st::sync;
+using namespace st::log;
+using namespace st::ie;
+
+/**
+ * @brief Parameters of the tiled inference
+ *
+ */
+struct tiling_param {
+  int tile_size = 1024;        //!< width and height of a tile
+  int overlap = 128;           //!< overlap of two neighbour tiles
+  float iou_threshold = 0.4f;  //!< IoU of the cross-tile NMS
+};
+
+/**
+ * @brief Outcome of a tiled request, from the outcomes of its tiles
+ *
+ */
+inline request_status tiled_status(bool expired, bool cancelled,
+                                   bool failed) {
+  return cancelled ? request_status::cancelled
+         : expired ? request_status::expired
+         : failed  ? request_status::failed
+                   : request_status::done;
+}
+
+/**
+ * @brief Tiled detector
+ * @details Stateless except for its configuration, so one detector can be
+ * shared by all request threads
+ */
+class tiled_detector {
+ public:
+  tiled_detector() = delete;
+  /**
+   * @brief Construct a new tiled detector object
+   *
+   * @param _taskq
+   * @param _admission
+   * @param _param
+   */
+  tiled_detector(object_detection_mq<single_bell>::ptr& _taskq,
+                 admission_control::ptr& _admission,
+                 const tiling_param& _param)
+      : taskq(_taskq), admission(_admission), param(_param) {
+    if (param.tile_size <= 0 || param.overlap < 0 ||
+        param.overlap >= param.tile_size) {
+      throw std::logic_error("Tiling: overlap must be in [0, tile size)");
+    }
+  }
+  /**
+   * @brief Read the parameters from the "tiling" node of the configuration
+   *
+   * @param conf
+   * @return tiling_param
+   */
+  static tiling_param read_param(const JSON& conf) {
+    tiling_param p;
+    p.tile_size = conf.get<int>("tile size", p.tile_size);
+    p.overlap = conf.get<int>("overlap", p.overlap);
+    p.iou_threshold = conf.get<float>("iou", p.iou_threshold);
+    return p;
+  }
+  /**
+   * @brief Split the image in tiles
+   * @details Tiles are tile_size apart minus the overlap; the last tile of
+   * each row and column is moved back to the image border, so all tiles
+   * are full size unless the image is smaller than a tile
+   * @param width
+   * @param height
+   * @return std::vector<cv::Rect>
+   */
+  std::vector<cv::Rect> make_tiles(const int width, const int height) const {
+    std::vector<cv::Rect> tiles;
+    const std::vector<int> xs = offsets(width);
+    const std::vector<int> ys = offsets(height);
+    const int w = std::min(param.tile_size, width);
+    const int h = std::min(param.tile_size, height);
+    for (int y : ys) {
+      for (int x : xs) {
+        tiles.emplace_back(x, y, w, h);
+      }
+    }
+    return tiles;
+  }
+  /**
+   * @brief Run the detection on an encoded image
+   * @details All tiles are admitted at once, or the request is shed. The
+   * request expires if any of its tiles expires. Once the client is gone,
+   * the tiles that are not answered yet are cancelled
+   * @param request encoded image, deadline, priority class and tenant of the
+   * request; the tiles get the same deadline, class and tenant
+   * @param ret detections in original image coordinates
+   * @param gone probe of the client, optional
+   * @return request_status
+   */
+  request_status run(const obj_detection_msg<single_bell>& request,
+                     detection_result& ret,
+                     const client_probe& gone = nullptr) {
+    const char* data = request.data;
+    const int size = request.size;
+    std::chrono::time_point<std::chrono::system_clock> start;
+    std::chrono::time_point<std::chrono::system_clock> end;
+    std::chrono::duration<double, std::milli> elapsed_mil;
+    start = std::chrono::system_clock::now();
+    cv::Mat frame;
+    try {
+      frame = cv::imdecode(cv::Mat(1, size, CV_8UC3, (unsigned char*)data),
+                           cv::IMREAD_COLOR);
+    } catch (const cv::Exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return request_status::done;
+    }
+    if (frame.empty()) return request_status::done;
+    auto tiles = make_tiles(frame.cols, frame.rows);
+    const int n = tiles.size();
+    // the tiles are views of the decoded frame
+    std::vector<cv::Mat> views(n);
+    std::vector<detection_result> predictions(n);
+    std::vector<single_bell::ptr> bells(n);
+    std::vector<obj_detection_msg<single_bell>> msgs(n);
+    for (int i = 0; i < n; ++i) {
+      views[i] = frame(tiles[i]);
+      bells[i] = std::make_shared<single_bell>();
+      msgs[i].predictions = &predictions[i];
+      msgs[i].bell = bells[i];
+      msgs[i].image = &views[i];
+      msgs[i].deadline = request.deadline;
+      msgs[i].priority = request.priority;
+      msgs[i].tenant = request.tenant;
+      if (gone) msgs[i].make_claimable();
+    }
+    // the decoded frame is what we hold in memory
+    const uint64_t bytes = frame.total() * frame.elemSize();
+    const auto submitted = deadline_clock::now();
+    if (!admission->submit(*taskq, msgs.begin(), msgs.end(), bytes)) {
+      server_log->debug("Shed {} tiles of {}x{} image", n, frame.cols,
+                        frame.rows);
+      return request_status::shed;
+    }
+    server_log->debug("Enqueue {} tiles of {}x{} image", n, frame.cols,
+                      frame.rows);
+    bool expired = false;
+    bool cancelled = false;
+    bool failed = false;
+    for (int i = 0; i < n; ++i) {
+      if (cancelled) {
+        if (!msgs[i].cancel()) bells[i]->wait_any();
+        continue;
+      }
+      const int state = wait_answer(msgs[i], gone);
+      expired |= state == msg_expired;
+      cancelled |= state == msg_cancelled;
+      failed |= state == msg_failed;
+    }
+    const auto status = tiled_status(expired, cancelled, failed);
+    admission->done(bytes, request.priority, deadline_clock::now() - submitted,
+                    status);
+    if (status != request_status::done) return status;
+    merge(tiles, predictions, ret);
+    end = std::chrono::system_clock::now();
+    elapsed_mil = end - start;
+    server_log->debug("Tiled detection of {} tiles in {} ms", n,
+                      elapsed_mil.count());
+    return request_status::done;
+  }
+
+  /**
+   * @brief Called once when a tiled request is over
+   *
+   */
+  using tiled_completion = std::function<void(request_status)>;
+  /**
+   * @brief A tiled request in flight, completed by its tiles
+   * @details The caller keeps the call until its completion, the tiles point
+   * to its decoded frame
+   */
+  class tiled_call : public request_completion {
+   public:
+    /**
+     * @brief Cancel the tiles that are not answered yet, e.g. the client is
+     * gone; the completion is still called once
+     *
+     */
+    void cancel() {
+      for (auto& c : claims) {
+        if (c->cancel()) tile_done(msg_cancelled);
+      }
+    }
+    void on_complete(int state) override { tile_done(state); }
+    using ptr = std::shared_ptr<tiled_call>;
+
+   private:
+    friend class tiled_detector;
+    cv::Mat frame;                                //!< decoded image
+    std::vector<cv::Rect> tiles;                  //!< regions of the tiles
+    std::vector<cv::Mat> views;                   //!< tiles of the frame
+    std::vector<detection_result> predictions;    //!< detections per tile
+    std::vector<pool_ptr<detection_context>> claims;  //!< contexts of the
+                                                      //! tiles
+    std::atomic<int> left{0};            //!< tiles not answered yet
+    std::atomic<bool> expired{false};    //!< a tile expired
+    std::atomic<bool> cancelled{false};  //!< a tile was cancelled
+    std::atomic<bool> failed{false};     //!< the engine failed on a tile
+    uint64_t bytes = 0;                  //!< admitted bytes
+    int priority = 0;                    //!< class of the request
+    deadline_clock::time_point submitted;  //!< admission time
+    admission_control::ptr admission;      //!< admission control
+    tiled_completion done;                 //!< completion of the request
+    void tile_done(int state) {
+      if (state == msg_expired) expired = true;
+      if (state == msg_cancelled) cancelled = true;
+      if (state == msg_failed) failed = true;
+      if (left.fetch_sub(1) != 1) return;
+      const auto status = tiled_status(expired, cancelled, failed);
+      admission->done(bytes, priority, deadline_clock::now() - submitted,
+                      status);
+      done(status);
+    }
+  };
+  /**
+   * @brief Submit the detection on an encoded image, without waiting
+   * @details As run(), but the tiles answer by completion, on the
+   * inference worker threads; the completion should only hand the status
+   * over to the executor of the caller, which then gets the detections from
+   * result(). If the request is shed, or the image cannot be decoded, the
+   * completion is called before submit returns. The caller keeps the call
+   * until then
+   * @param request encoded image, deadline, priority class and tenant
+   * @param done completion of the request
+   * @return tiled_call::ptr the call, nullptr if it's already complete
+   */
+  tiled_call::ptr submit(const obj_detection_msg<single_bell>& request,
+                         tiled_completion done) {
+    cv::Mat frame;
+    try {
+      frame = cv::imdecode(
+          cv::Mat(1, request.size, CV_8UC3, (unsigned char*)request.data),
+          cv::IMREAD_COLOR);
+    } catch (const cv::Exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+    }
+    if (frame.empty()) {
+      done(request_status::done);
+      return nullptr;
+    }
+    auto call = std::make_shared<tiled_call>();
+    call->frame = frame;
+    call->tiles = make_tiles(frame.cols, frame.rows);
+    const int n = call->tiles.size();
+    call->views.resize(n);
+    call->predictions.resize(n);
+    call->claims.resize(n);
+    std::vector<obj_detection_msg<single_bell>> msgs(n);
+    for (int i = 0; i < n; ++i) {
+      auto& m = msgs[i];
+      call->views[i] = frame(call->tiles[i]);
+      m.predictions = &call->predictions[i];
+      m.image = &call->views[i];
+      m.deadline = request.deadline;
+      m.priority = request.priority;
+      m.tenant = request.tenant;
+      m.make_claimable();
+      m.context->completion = call.get();
+      call->claims[i] = m.context;
+    }
+    call->left = n;
+    call->bytes = frame.total() * frame.elemSize();
+    call->priority = request.priority;
+    call->admission = admission;
+    call->done = done;
+    call->submitted = deadline_clock::now();
+    if (!admission->submit(*taskq, std::make_move_iterator(msgs.begin()),
+                           std::make_move_iterator(msgs.end()), call->bytes)) {
+      server_log->debug("Shed {} tiles of {}x{} image", n, frame.cols,
+                        frame.rows);
+      done(request_status::shed);
+      return nullptr;
+    }
+    server_log->debug("Enqueue {} tiles of {}x{} image", n, frame.cols,
+                      frame.rows);
+    return call;
+  }
+  /**
+   * @brief Detections of a complete call, in original image coordinates
+   *
+   * @param call
+   * @param ret replaced by the detections
+   */
+  void result(tiled_call& call, detection_result& ret) {
+    merge(call.tiles, call.predictions, ret);
+  }
+
+  using ptr = std::shared_ptr<tiled_detector>;
+
+ private:
+  object_detection_mq<single_bell>::ptr taskq;  //!< task queue
+  admission_control::ptr admission;             //!< admission control
+  tiling_param param;                           //!< tiling parameters
+  /**
+   * @brief Offsets of the tiles along one side of the image
+   *
+   * @param length
+   * @return std::vector<int>
+   */
+  std::vector<int> offsets(const int length) const {
+    std::vector<int> ret;
+    const int stride = param.tile_size - param.overlap;
+    for (int o = 0;; o += stride) {
+      if (o + param.tile_size >= length) {
+        ret.push_back(std::max(length - param.tile_size, 0));
+        break;
+      }
+      ret.push_back(o);
+    }
+    return ret;
+  }
+  /**
+   * @brief Move the detections to original image coordinates and suppress
+   * the duplicates of the overlaps
+   * @details Detections without box, i.e. classification, are not moved
+   * @param tiles
+   * @param predictions
+   * @param ret replaced by the detections
+   */
+  void merge(const std::vector<cv::Rect>& tiles,
+             std::vector<detection_result>& predictions,
+             detection_result& ret) {
+    detection_result all;
+    nms_boxes boxes;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+      auto& d = predictions[t];
+      if (!all.labels) all.labels = d.labels;
+      for (size_t i = 0; i < d.size(); ++i) {
+        if (d.has_box(i)) {
+          d.x1[i] += tiles[t].x;
+          d.y1[i] += tiles[t].y;
+          d.x2[i] += tiles[t].x;
+          d.y2[i] += tiles[t].y;
+        }
+        boxes.push_back(d.x1[i], d.y1[i], d.x2[i], d.y2[i], d.score[i],
+                        d.label_id[i]);
+        all.push_back(d, i);
+      }
+    }
+    nms_param p;
+    p.iou_threshold = param.iou_threshold;
+    std::vector<int> keep;
+    nms_suppressor nms;
+    nms.run(boxes, p, keep);
+    ret.clear();
+    ret.labels = all.labels;
+    ret.reserve(keep.size());
+    for (int k : keep) {
+      ret.push_back(all, k);
+    }
+  }
+};  // class tiled_detector
+
+}  // namespace worker
+}  // namespace st
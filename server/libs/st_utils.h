@@ -23,6 +23,8 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/property_tree/json_parser.hpp>
+#include "st_http_body.h"
+#include "st_pool.h"
 
 namespace beast = boost::beast;        // from <boost/beast.hpp>
 namespace http = beast::http;          // from <boost/beast/http.hpp>
@@ -31,9 +33,15 @@ namespace net = boost::asio;           // from <boost/asio.hpp>
 namespace bpt = boost::property_tree;  // from <boots/property_tree>
 namespace fs = boost::filesystem;      // from <boots/filesystem>
 typedef bpt::ptree JSON;               // just hiding the ugly name
-using beast_basic_request = http::request<http::string_body>;
-using beast_basic_response = http::response<http::string_body>;
-using beast_empty_response = http::response<http::empty_body>;
+// header fields on recycled blocks, a request allocates none in the steady
+// state
+using beast_fields = http::basic_fields<st::sync::recycling_allocator<char>>;
+// the body of a request is read into a pooled buffer
+using beast_basic_request = http::request<st::sync::pooled_body, beast_fields>;
+using beast_request_parser =
+    http::request_parser<st::sync::pooled_body, beast_fields::allocator_type>;
+using beast_basic_response = http::response<http::string_body, beast_fields>;
+using beast_empty_response = http::response<http::empty_body, beast_fields>;
 
 /**
  * @brief This is the C++11 equivalent of a generic lambda.
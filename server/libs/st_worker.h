@@ -14,14 +14,25 @@
 #include <thread>
 #include <vector>
 #include "st_ie_base.h"
+#include "st_admission.h"
+#include "st_alloc.h"
+#include "st_cancel.h"
+#include "st_connection.h"
+#include "st_hedging.h"
+#include "st_http.h"
 #include "st_message_queue.h"
+#include "st_metrics.h"
+#include "st_priority.h"
+#include "st_router.h"
+#include "st_tenant.h"
+#include "st_tiling.h"
 #include "st_utils.h"
 #include "st_logging.h"
 
 
 namespace st {
 namespace worker {
-using st::ie::bbox;
+using st::ie::detection_result;
 using namespace st::sync;
 using namespace st::log;
 using namespace st::ie;
@@ -48,6 +59,22 @@ public:
   virtual void operator()() = 0;
 };
 
+/**
+ * @brief Post-processing task
+ * @details The inference worker hands the deferred parser of a finished
+ * inference request together with the original message to the
+ * post-processing workers, so it can take the next task right away
+ */
+struct post_processing_task {
+  inference_engine::deferred_detection parse;  //!< parser of the raw output
+  obj_detection_msg<single_bell> msg;          //!< message of the producer
+};
+
+/**
+ * @brief Queue between inference workers and post-processing workers
+ */
+using post_processing_mq = blocking_queue<post_processing_task>;
+
 /**
  * @brief Inference worker that will run the inference engine
  * @details
@@ -65,15 +92,55 @@ public:
    *
    * @param _Ie
    * @param _taskq
-   * @param _cv
-   * @param _mtx
-   * @param _key
+   * @param _lane lane of the worker in the task queue
    */
   sync_inference_worker(IEPtr& _Ie,
-                        object_detection_mq<single_bell>::ptr& _taskq)
-      : Ie(_Ie), taskq(_taskq) {
+                        object_detection_mq<single_bell>::ptr& _taskq,
+                        int _lane = 0)
+      : Ie(_Ie),
+        taskq(_taskq),
+        lane(_lane),
+        expired(metrics::server_metrics().get_counter("scheduler.expired")),
+        saved_us(metrics::server_metrics().get_counter(
+            "scheduler.saved engine us")),
+        discarded(metrics::server_metrics().get_counter("hedging.discarded")),
+        cancelled(
+            metrics::server_metrics().get_counter("scheduler.cancelled")),
+        failed(metrics::server_metrics().get_counter("engine.failed")) {
     ie_log->info("Init inference worker!");
   }
+  /**
+   * @brief Construct a new inference worker object that offloads the output
+   * parsing to the post-processing workers
+   *
+   * @param _Ie
+   * @param _taskq
+   * @param _lane lane of the worker in the task queue
+   * @param _ppq
+   */
+  sync_inference_worker(IEPtr& _Ie,
+                        object_detection_mq<single_bell>::ptr& _taskq,
+                        int _lane, post_processing_mq::ptr& _ppq)
+      : Ie(_Ie),
+        taskq(_taskq),
+        lane(_lane),
+        ppq(_ppq),
+        expired(metrics::server_metrics().get_counter("scheduler.expired")),
+        saved_us(metrics::server_metrics().get_counter(
+            "scheduler.saved engine us")),
+        discarded(metrics::server_metrics().get_counter("hedging.discarded")),
+        cancelled(
+            metrics::server_metrics().get_counter("scheduler.cancelled")),
+        failed(metrics::server_metrics().get_counter("engine.failed")) {
+    ie_log->info("Init inference worker{}!",
+                 ppq ? " with post-processing pool" : "");
+  }
+  /**
+   * @brief Report the service times of the worker to a router
+   *
+   * @param _router
+   */
+  void set_router(latency_router::ptr& _router) { router = _router; }
   /**
    * @brief Destroy the inference worker object
    *
@@ -83,20 +150,19 @@ public:
   void operator()() final {
     pthread_setname_np(pthread_self(), "IE worker");
     // start listening to the queue
-    try {
-      for (;;) {
-        ie_log->debug("Waiting for new task");
-        auto m = taskq->pop();
-        ie_log->debug("Recieve task, invoke inference engine, remaining in queue {}", taskq->size());
-        *m.predictions = Ie->run_detection(m.data, m.size);
-        ie_log->debug("Done inferencing, predidiction size = {}",
-                      m.predictions->size());
-        // Push to queue and notify the sync_http_worker
-        ie_log->debug("Signaling request thread");
-        m.bell->ring(1);
+    for (;;) {
+      ie_log->debug("Waiting for new task");
+      auto m = taskq->pop(lane);
+      metrics::alloc_scope counted{alloc_stage};
+      inference_engine::deferred_detection parse;
+      try {
+        parse = serve(m);
+      } catch (const std::exception& e) {
+        fail(m, e);
+        continue;
       }
-    } catch (const std::exception& e) {
-      std::cerr << e.what() << '\n';
+      // parse and notify in the post-processing pool
+      if (parse) ppq->push({std::move(parse), std::move(m)});
     }
   }
 
@@ -104,6 +170,188 @@ private:
   IEPtr Ie;  //!< pointer to inference engine
   object_detection_mq<single_bell>::ptr
       taskq;  //!< task queue, will get job in this queue
+  int lane;   //!< own lane of the task queue
+  post_processing_mq::ptr ppq;  //!< post-processing queue, optional
+  detection_result result;      //!< parsed output, swapped with the answer
+  metrics::counter& expired;    //!< tasks dropped after their deadline
+  metrics::counter& saved_us;   //!< engine time saved by the drops
+  metrics::counter& discarded;  //!< copies of hedged tasks that lost
+  metrics::counter& cancelled;  //!< tasks whose client went away
+  metrics::counter* alloc_stage = metrics::alloc_counter(
+      "worker.inference");  //!< allocations of the tasks, if counted
+  metrics::counter& failed;     //!< tasks the engine failed on
+  /**
+   * @brief Count a task that is not answered, its claim went elsewhere
+   *
+   */
+  void skip(const obj_detection_msg<single_bell>& m) {
+    (m.cancelled() ? cancelled : discarded).inc();
+  }
+  /**
+   * @brief Run a task, answer it unless it's post-processed
+   *
+   * @param m
+   * @return inference_engine::deferred_detection the parser of the output,
+   * for the post-processing pool, if any
+   */
+  inference_engine::deferred_detection serve(
+      obj_detection_msg<single_bell>& m) {
+    ie_log->debug(
+        "Recieve task, invoke inference engine, remaining in queue {}",
+        taskq->size());
+    if (!m.start()) {
+      // another copy of a hedged task already answered, or the client
+      // went away
+      skip(m);
+      return nullptr;
+    }
+    auto start = deadline_clock::now();
+    if (start > m.deadline) {
+      // nobody waits for the result anymore, don't waste the engine
+      ie_log->debug("Drop expired task");
+      expired.inc();
+      saved_us.inc(static_cast<uint64_t>(service_us));
+      if (m.claim()) m.complete(msg_expired);
+      return nullptr;
+    }
+    if (router) router->begin(lane);
+    busy = true;
+    if (ppq) {
+      auto parse = m.image       ? Ie->run_inference(*m.image)
+                   : m.json_body ? Ie->run_inference_json(m.data, m.size)
+                                 : Ie->run_inference(m.data, m.size);
+      update_service_time(m, start);
+      return parse;
+    }
+    if (m.image) {
+      Ie->run_detection(*m.image, result);
+    } else if (m.json_body) {
+      Ie->run_detection_json(m.data, m.size, result);
+    } else {
+      Ie->run_detection(m.data, m.size, result);
+    }
+    update_service_time(m, start);
+    if (!m.claim()) {
+      skip(m);
+      return nullptr;
+    }
+    // the buffers the producer had are reused by the next inference
+    m.predictions->swap(result);
+    ie_log->debug("Done inferencing, predidiction size = {}",
+                  m.predictions->size());
+    // Push to queue and notify the sync_http_worker
+    ie_log->debug("Signaling request thread");
+    m.complete(msg_done);
+    return nullptr;
+  }
+  /**
+   * @brief Answer a task the engine or its parser threw on, the worker goes
+   * on with the next one
+   *
+   * @param m
+   * @param e
+   */
+  void fail(obj_detection_msg<single_bell>& m, const std::exception& e) {
+    ie_log->error("Inference failed: {}", e.what());
+    failed.inc();
+    if (router && busy) router->fail(lane);
+    busy = false;
+    if (m.claim()) m.complete(msg_failed);
+  }
+  double service_us = 0;        //!< moving average of the engine time
+  bool busy = false;            //!< the engine runs a task
+  latency_router::ptr router;   //!< router of the engines, optional
+  /**
+   * @brief Update the moving averages of the engine time of a task
+   *
+   * @param m
+   * @param start
+   */
+  void update_service_time(const obj_detection_msg<single_bell>& m,
+                           deadline_clock::time_point start) {
+    const double us = std::chrono::duration_cast<std::chrono::microseconds>(
+                          deadline_clock::now() - start)
+                          .count();
+    service_us = service_us > 0 ? 0.9 * service_us + 0.1 * us : us;
+    busy = false;
+    if (router) router->end(lane, m, us);
+  }
+};
+
+/**
+ * @brief Post-processing worker that parses the network output
+ * @details Run the parser that was deferred by the inference worker, then
+ * ring the bell of the producer. Post-processing workers only touch the
+ * output of finished requests, so there can be as many as we want
+ */
+class sync_pp_worker : public sync_worker {
+public:
+  sync_pp_worker() = delete;
+  /**
+   * @brief Construct a new post-processing worker object
+   *
+   * @param _ppq
+   */
+  sync_pp_worker(post_processing_mq::ptr& _ppq)
+      : ppq(_ppq),
+        discarded(metrics::server_metrics().get_counter("hedging.discarded")),
+        cancelled(
+            metrics::server_metrics().get_counter("scheduler.cancelled")),
+        failed(metrics::server_metrics().get_counter("engine.failed")) {
+    ie_log->info("Init post-processing worker!");
+  }
+  /**
+   * @brief Destroy the post-processing worker object
+   *
+   */
+  ~sync_pp_worker() {}
+  // sync worker public interface implementation
+  void operator()() final {
+    pthread_setname_np(pthread_self(), "pp worker");
+    for (;;) {
+      auto t = ppq->pop();
+      metrics::alloc_scope counted{alloc_stage};
+      auto& m = t.msg;
+      if (m.claimed()) {
+        skip(m);
+        continue;
+      }
+      try {
+        t.parse(result);
+      } catch (const std::exception& e) {
+        // the worker goes on with the next task
+        ie_log->error("Post-processing failed: {}", e.what());
+        failed.inc();
+        if (m.claim()) m.complete(msg_failed);
+        continue;
+      }
+      if (!m.claim()) {
+        skip(m);
+        continue;
+      }
+      // the buffers the producer had are reused by the next parse
+      m.predictions->swap(result);
+      ie_log->debug("Done post-processing, predidiction size = {}",
+                    m.predictions->size());
+      m.complete(msg_done);
+    }
+  }
+
+private:
+  post_processing_mq::ptr ppq;  //!< post-processing queue
+  detection_result result;      //!< parsed output, swapped with the answer
+  metrics::counter& discarded;  //!< copies of hedged tasks that lost
+  metrics::counter& cancelled;  //!< tasks whose client went away
+  metrics::counter& failed;     //!< tasks the parser failed on
+  metrics::counter* alloc_stage = metrics::alloc_counter(
+      "worker.post");  //!< allocations of the tasks, if counted
+  /**
+   * @brief Count a task that is not answered, its claim went elsewhere
+   *
+   */
+  void skip(const obj_detection_msg<single_bell>& m) {
+    (m.cancelled() ? cancelled : discarded).inc();
+  }
 };
 
 /**
@@ -124,14 +372,36 @@ public:
    * @param _sock
    * @param _data
    * @param _taskq
+   * @param _admission
+   * @param _tiler
+   * @param _hedger hedging of late requests, optional
+   * @param _classes priority classes
+   * @param _tenants tenants of the server
+   * @param _http parameters of the front end
+   * @param _connections open connections, this one entered it
    */
   sync_http_worker(tcp::acceptor& _acceptor, tcp::socket&& _sock, void* _data,
-                   object_detection_mq<single_bell>::ptr& _taskq)
+                   object_detection_mq<single_bell>::ptr& _taskq,
+                   admission_control::ptr& _admission,
+                   tiled_detector::ptr& _tiler,
+                   request_hedger::ptr& _hedger,
+                   priority_classes::ptr& _classes,
+                   tenant_table::ptr& _tenants, const http_param& _http,
+                   connection_limit::ptr& _connections)
       : acceptor(_acceptor),
         sock(std::move(_sock)),
         data(_data),
-        taskq(_taskq) {
-    bell = std::make_shared<single_bell>();
+        taskq(_taskq),
+        admission(_admission),
+        tiler(_tiler),
+        hedger(_hedger),
+        classes(_classes),
+        tenants(_tenants),
+        http_conf(_http),
+        connections(_connections) {
+    beast::error_code ec;
+    auto peer = sock.remote_endpoint(ec);
+    if (!ec) client_ip = peer.address().to_string();
     http_log->info("Init new http worker!");
   }
   /**
@@ -139,7 +409,7 @@ public:
    *
    * @return * Default
    */
-  ~sync_http_worker() {}
+  ~sync_http_worker() { connections->leave(); }
   // sync worker public interface implementation
   void operator()() final {
     pthread_setname_np(pthread_self(), "http worker");
@@ -154,292 +424,365 @@ private:
           .get_executor()};  //!< the endpoint socket, passed from main thread
   void* data;                //!< pointer to data, i.e dashboard
   object_detection_mq<single_bell>::ptr taskq;  //!< task queue
-  single_bell::ptr bell;                        //!< notify bell
+  admission_control::ptr admission;             //!< admission control
+  tiled_detector::ptr tiler;                    //!< tiled inference
+  request_hedger::ptr hedger;                   //!< hedging, optional
+  priority_classes::ptr classes;                //!< priority classes
+  tenant_table::ptr tenants;                    //!< tenants
+  http_param http_conf;                         //!< parameters
+  connection_limit::ptr connections;            //!< open connections
+  timed_socket stream{sock};                    //!< the socket, with timeouts
+  std::string client_ip;                        //!< address of the client
+  tenant_cache tenant;                          //!< tenant of the requests
+  beast::flat_buffer buffer;                    //!< read buffer
+  static constexpr size_t first_read = 1024;    //!< bytes read when idle
+  static constexpr size_t header_read = 8192;   //!< bytes of a header, at
+                                                //! most, read ahead
+  bool reading = true;                          //!< more requests are read
+  bool unread = false;  //!< a refused body is left in the socket
+  /**
+  * @brief A request of the pipeline of the connection, from its header to
+  * its response
+  *
+  */
+  struct pipelined {
+    boost::optional<beast_request_parser> parser;  //!< parser of the request
+    beast_basic_request req;                       //!< the request, once read
+    beast_basic_response res;  //!< its response, once ready
+    bool ready = false;        //!< the response is ready
+    bool unread = false;       //!< the body waits for 100 Continue
+    bool deferred = false;     //!< the body is read at its turn
+    bool tiled = false;        //!< a tiled inference, run in turn
+    bool pending = false;      //!< admitted, its answer is awaited
+    int priority = 0;          //!< class of the request
+    obj_detection_msg<single_bell> m;  //!< message of the inference
+    detection_result prediction;       //!< answer of the inference
+    single_bell::ptr bell = std::make_shared<single_bell>();  //!< its bell
+    deadline_clock::time_point start;      //!< the request was read
+    deadline_clock::time_point submitted;  //!< admission time
+  };
+  /**
+  * @brief Keeps the response of a pipelined request until its turn
+  *
+  */
+  struct response_keeper {
+    pipelined& p;
+    void operator()(beast_basic_response&& res) const {
+      p.res = std::move(res);
+      p.ready = true;
+    }
+    void operator()(beast_empty_response&& res) const {
+      // the response to HEAD, a header only
+      p.res = beast_basic_response{std::move(res.base())};
+      p.ready = true;
+    }
+  };
   // private method
   /**
-  * @brief This funtion generate error response
-  * @details Depend on the type of error status, different responses messages
-  * are generated
-  * @tparam Body
-  * @tparam Alocator
-  * @param req
-  * @param status
-  * @param why
-  * @return http::response<http::string_body>
+  * @brief Whether the whole header of a next request is there, without
+  * waiting for it
+  * @details What the socket holds is read into the buffer, up to the size
+  * of a header; the socket is non-blocking. A read error is left to the
+  * read of the request
   */
-  http::response<http::string_body> error_message(beast_basic_request& req,
-                                                  http::status status,
-                                                  beast::string_view why) {
-    beast_basic_response res{status, req.version()};
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, "text/html");
-    res.keep_alive(req.keep_alive());
-    res.body() = std::string(why);
-    res.prepare_payload();
-    return res;
-  }  // error_message
+  bool header_waiting() {
+    for (;;) {
+      const beast::string_view bytes(
+          static_cast<const char*>(buffer.data().data()), buffer.size());
+      if (bytes.find("\r\n\r\n") != beast::string_view::npos) return true;
+      if (buffer.size() >= header_read) return false;
+      beast::error_code ec;
+      buffer.commit(sock.read_some(buffer.prepare(first_read), ec));
+      if (ec) return false;
+    }
+  }
   /**
- * @brief This function resolve the request target to route it to proper
- * resource.
- *
- * @param target
- * @param ec
- * @return std::string
- * @exception raise ec::no_such_file if the resource doesn't exist
- */
-  std::string request_resolve(beast::string_view const& target,
-                              beast::error_code& ec) {
-    // Now do it as simple as possible
-    // Assume the request to the server is always in form `/{resource}`
-    // current supported resources
-    static const std::set<std::string> resources = {"/",
-                                                    "v1"
-                                                    "metadata",
-                                                    "inference"};
-    if (target.empty() || target[0] != '/' ||
-        target.find("..") != beast::string_view::npos)
-      return "";
-    std::string ret;
-    if (target.size() == 1) {  // send header
-      ret = "/";
-    } else {
-      // string_view has no null-terminated, therefore it cannot implicitly
-      // convert from string_view to string
-      ret = static_cast<std::string>(target.substr(1, target.size()));
+  * @brief Whether the rest of the body of a request is there already
+  *
+  */
+  bool body_waiting(pipelined& p) {
+    if (p.parser->is_done()) return true;
+    const auto left = p.parser->content_length_remaining();
+    return left && buffer.size() >= *left;
+  }
+  /**
+  * @brief Read the header of a request, then its body unless the client
+  * waits for 100 Continue out of turn, or the body is not all there out of
+  * turn
+  * @details An inference that is not an image, over the body limit or that
+  * would be shed is refused from its header; its body is left unread and no
+  * request is read after it
+  * @param p a free slot of the pipeline
+  * @param first no response is due before this one, the connection is idle
+  * until the request comes
+  * @return true if the request entered the pipeline
+  */
+  bool read_request(pipelined& p, bool first) {
+    beast::error_code ec;
+    if (first && buffer.size() == 0) {
+      // idle until the first bytes come
+      stream.expires_after(http_conf.idle_timeout);
+      buffer.commit(stream.read_some(buffer.prepare(first_read), ec));
+      if (ec == net::error::eof) ec = http::error::end_of_stream;
+      if (ec) return stop(ec, connection_phase::idle);
     }
-    if (resources.find(ret) == resources.end()) {
-      // raise no_such_file error
-      ec = beast::errc::make_error_code(beast::errc::no_such_file_or_directory);
+    // a new parser for each request, its body comes from the pool
+    p.parser.emplace();
+    p.parser->body_limit(http_conf.body_limit);
+    stream.expires_after(http_conf.header_timeout);
+    http::read_header(stream, buffer, *p.parser, ec);
+    response_keeper keeper{p};
+    if (ec == http::error::body_limit) {
+      keeper(body_too_large(p.parser->get()));
+    } else if (ec) {
+      return stop(ec, connection_phase::header);
+    } else if (!refuse_early(p.parser->get(), p.parser->content_length(),
+                             *admission, *taskq, *classes, keeper)) {
+      p.unread = !p.parser->is_done() && expects_continue(p.parser->get());
+      // 100 Continue is a response too, it waits for the ones before; a
+      // body still on its way is read at its turn, so the responses before
+      // are not held back by its upload
+      p.deferred = !first && !p.unread && !body_waiting(p);
+      return !first && (p.unread || p.deferred) ? true : read_body(p);
     }
-    return ret;
-  }  // request_sovle
-     /**
-      * @brief
-      *
-      */
-  std::string greeting() {
-    JSON res;
-    res.put<std::string>("type", "greeting");
-    res.put<std::string>("from", "canhld@kaist.ac.kr");
-    res.put<std::string>("message",
-                         "welcome to NCL inference server version 1");
-    JSON what_next;
-    what_next.put<std::string>("API", "GET /v1/ for supported API");
-    what_next.put<std::string>("INFO", "GET /metadata/ for model information");
-    res.put_child("what next", what_next);
-    std::ostringstream ss;
-    bpt::write_json(ss, res);
-    return ss.str();
-  }  // greeting
-     /**
-      * @brief
-      *
-      *
-      * TODO: Implement the function with proper resource
-     */
-  std::string metadata_request_handler() {
-    std::ostringstream ss;
-    ss.str("");
-    ss << std::fixed << "{\n"
-       << "\"from\": \"canhld@kaist.ac.kr\",\n"
-       << "\"message\": \"this is metadata request\"\n"
-       << "}\n";
-    return ss.str();
-  }  // metadata_request_handler
+    reading = false;
+    unread = true;
+    return true;
+  }
   /**
-  * @brief This funtion handles the inference request at POST /inference
-  * ?All request return string body, so its return type is std::string should
-  * we format it with JSON?
+  * @brief Read the body of a request, and submit it
+  *
+  * @param p
+  * @return true if the request entered the pipeline
   */
-  std::string inference_request_handler(beast_basic_request& req) {
-    // we know this is the post method
-    // now, first extact the content-type
-
-    // boost::beast::http::header<true,
-    // boost::beast::http::basic_fields<std::allocator<char> > >&
-    auto& header = req.base();
-    // string body --> basic_string
-    auto& body = req.body();
-    beast::string_view const& content_type = header["content-type"];
-    if (content_type.find("image/") == std::string::npos) {
-      return "{\n\"message\":\"not an image\"\n}";
+  bool read_body(pipelined& p) {
+    beast::error_code ec;
+    p.deferred = false;
+    if (p.unread) {
+      p.unread = false;
+      stream.expires_after(http_conf.write_timeout);
+      http::write(stream,
+                  beast_empty_response{http::status::continue_,
+                                       p.parser->get().version()},
+                  ec);
+      if (ec) return stop(ec, connection_phase::write);
     }
-
+    stream.expires_after(http_conf.body_timeout);
+    http::read(stream, buffer, *p.parser, ec);
+    // the rest of a body over the limit is not read
+    if (ec == http::error::body_limit) {
+      response_keeper{p}(body_too_large(p.parser->get()));
+      reading = false;
+      unread = true;
+      return true;
+    }
+    if (ec) return stop(ec, connection_phase::body);
+    p.req = p.parser->release();
+    start(p);
+    return true;
+  }
+  /**
+  * @brief No request is read anymore after an error or at the end of the
+  * stream
+  *
+  * @param ec
+  * @param phase of the connection, for a timeout
+  * @return false
+  */
+  bool stop(beast::error_code ec, connection_phase phase) {
+    reading = false;
+    if (ec == beast::error::timeout) {
+      http_log->debug("Timeout, close the connection of {}", client_ip);
+      connections->reap(phase);
+    } else if (ec != http::error::end_of_stream) {
+      fail(ec, phase == connection_phase::write ? "write" : "read");
+    }
+    return false;
+  }
+  /**
+  * @brief Route a request, and submit it if it's an inference
+  * @details The answers of the submitted requests are computed at once, the
+  * session waits for them in turn. With tiled, i.e. POST /inference/tiled,
+  * the image is split in tiles on the server and the detections are merged;
+  * a tiled inference runs in turn. If the client sets X-Request-Deadline,
+  * i.e. a Unix time in milliseconds, the request is dropped once the
+  * deadline passes
+  * @param p
+  */
+  void start(pipelined& p) {
+    static metrics::counter* const requests =
+        metrics::alloc_counter("requests");
+    static metrics::counter* const routed =
+        metrics::alloc_counter("http.route");
+    if (requests) requests->inc();
+    metrics::alloc_scope counted{routed};
+    response_keeper keeper{p};
+    p.start = deadline_clock::now();
+    const auto route = route_request(p.req, *classes, p.priority, keeper);
+    if (route == inference_route::none) return;
+    // its content-type is checked with the header
+    auto& header = p.req.base();
+    // the body, in a pooled buffer
+    auto& body = p.req.body();
     auto data = body.data();
     int size = body.size();
-    std::vector<bbox> prediction;
-    // exception handling in run, no need to santiny check
-    // push to queue
-    obj_detection_msg<single_bell> m{data, size, &prediction, bell};
-    http_log->debug("Enqueue my task, current queue size {}",
-                  taskq->size());
-    taskq->push(m);
-    http_log->debug("Waiting for inference engine");
-    bell->wait(1);
-    http_log->debug("Recieved data");
-    int n = prediction.size();
-    // create property tree and write to json
-    JSON res;     // our response
-    JSON bboxes;  // predicion
-    for (int i = 0; i < n; ++i) {
-      // parse prediction[i] to p[i]
-      bbox& pred = prediction[i];
-      JSON p;
-      p.put<int>("label_id", pred.label_id);
-      p.put<std::string>("label", pred.label);
-      p.put<float>("confidences", pred.prop);
-      JSON tmp;
-      if (pred.c[3]) { // ymax should never be zero
-        for (int i = 0; i < 4; ++i) {
-          JSON v;
-          v.put<int>("", pred.c[i]);
-          tmp.push_back({"", v});
-        }
-        p.put_child("detection_box", std::move(tmp));
-      }
-      bboxes.push_back({"", std::move(p)});
+    p.m = obj_detection_msg<single_bell>{data, size, &p.prediction, p.bell};
+    p.m.json_body = true;
+    p.m.deadline = request_deadline(header["x-request-deadline"]);
+    p.m.priority = p.priority;
+    p.m.tenant = tenant.identify(*tenants, header["x-api-key"], client_ip);
+    p.tiled = route == inference_route::tiled;
+    if (p.tiled) return;
+    http_log->debug("Enqueue my task, current queue size {}", taskq->size());
+    p.m.make_claimable();
+    if (hedger) {
+      // the copies share the body, handed over to the context as is
+      body.hand_over(p.m.context->data);
+      p.m.data = p.m.context->data.data();
+      hedger->prepare(p.m);
     }
-    res.put_child("predictions", std::move(bboxes));
-    std::ostringstream ss;
-    bpt::write_json(ss, res);
-    return ss.str();
-  }  // inferennce_request_handler
+    p.submitted = deadline_clock::now();
+    p.pending = admission->submit(*taskq, p.m, p.m.size);
+  }  // start
   /**
-  * @brief this is our handler
-  *
-  * @param req
-  * @param sender
-  * @return * Request
+  * @brief Wait for the answer of a request, and make its response
+  * @details Nothing is made for a cancelled request, nobody waits for it
+  * @param p the oldest request of the pipeline
+  * @param gone probe of the client
+  * @param abandon the client won't read the response, cancel the inference
   */
-  template <class Send>
-  void request_handler(beast_basic_request&& req, Send& sender) {
-    // Make sure we can handle the method
-    if (req.method() != http::verb::get && req.method() != http::verb::head &&
-        req.method() != http::verb::post)
-      return sender(
-          error_message(req, http::status::bad_request, "Unknown HTTP-method"));
-
-    // Request path must be absolute and not contain "..".
-    beast::error_code ec;
-    std::string target = request_resolve(req.target(), ec);
-    if (target.size() == 0) {
-      return sender(error_message(req, http::status::bad_request,
-                                  "Illegal request-target"));
+  void finish(pipelined& p, const client_probe& gone, bool abandon) {
+    static metrics::counter* const responded =
+        metrics::alloc_counter("http.respond");
+    if (p.ready) return;
+    request_status status = request_status::shed;
+    if (p.tiled) {
+      status = abandon ? request_status::cancelled
+                       : tiler->run(p.m, p.prediction, gone);
+    } else if (p.pending) {
+      http_log->debug("Waiting for inference engine");
+      int state = hedger ? hedger->wait(p.m, gone) : wait_answer(p.m, gone);
+      status = answer_status(state);
+      admission->done(p.m.size, p.priority,
+                      deadline_clock::now() - p.submitted, status);
     }
-
-    // Handle the case where the resource doesn't exist
-    if (ec == beast::errc::no_such_file_or_directory)
-      return sender(error_message(req, http::status::not_found, "Not found"));
-
-    // Creating our response with string_body
-    http::string_body::value_type body;
-
-    // Handle an unknown error
-    if (ec)
-      return sender(error_message(req, http::status::unknown, ec.message()));
-
-    // Respond to HEAD request, alway just send the basic information of the
-    // server
-    if (req.method() == http::verb::head) {
-      beast_empty_response res{http::status::ok, req.version()};
-      res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-      res.set(http::field::content_type, mime_type(target));
-      res.content_length(0);
-      res.keep_alive(req.keep_alive());
-      return sender(std::move(res));
-    } else if (req.method() == http::verb::get) {
-      // Respond to GET request
-      if (target == "/") {
-        body = greeting();
-      } else if (target == "metadata") {
-        body = metadata_request_handler();
-      } else {
-        return sender(error_message(req, http::status::bad_request,
-                                    "Illegal HTTP method"));
-      }
-      // Cache the size since we need it after the move
-      auto const size = body.size();
-      beast_basic_response res{
-          std::piecewise_construct, std::make_tuple(std::move(body)),
-          std::make_tuple(http::status::ok, req.version())};
-      res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-      res.set(http::field::content_type, "application/json");
-      res.content_length(size);
-      res.keep_alive(req.keep_alive());
-      return sender(std::move(res));
-    } else {
-      // Respond to POST request
-      if (target == "inference") {
-        body = inference_request_handler(req);
-      } else {
-        return sender(error_message(req, http::status::bad_request,
-                                    "Illegal HTTP method"));
-      }
-      // Cache the size since we need it after the move
-      auto const size = body.size();
-      beast_basic_response res{
-          std::piecewise_construct, std::make_tuple(std::move(body)),
-          std::make_tuple(http::status::ok, req.version())};
-      res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-      res.set(http::field::content_type, "application/json");
-      res.content_length(size);
-      res.keep_alive(req.keep_alive());
-      sender(std::move(res));
+    p.pending = false;
+    p.tiled = false;
+    p.m = {};
+    if (status == request_status::cancelled) {
+      http_log->debug("Client went away, cancel the request");
+      return;
+    }
+    if (status == request_status::shed) {
+      http_log->debug("Server is overloaded, shed the request");
+    } else if (status == request_status::expired) {
+      http_log->debug("Deadline exceeded, drop the request");
+    } else if (status == request_status::failed) {
+      http_log->debug("Inference failed, drop the request");
+    }
+    std::string body;
+    if (status == request_status::done) {
+      classes->record(p.priority,
+                      std::chrono::duration_cast<std::chrono::microseconds>(
+                          deadline_clock::now() - p.start)
+                          .count());
+      body = predictions_body(p.prediction);
     }
-  }  // request_handler
+    metrics::alloc_scope counted{responded};
+    response_keeper keeper{p};
+    respond_inference(p.req, status, std::move(body), admission->retry_after(),
+                      keeper);
+  }  // finish
   /**
   * @brief handler the session
-  *
-  * @return * Session
+  * @details Pipelined requests, i.e. sent before the response of the
+  * previous one, are read ahead up to the pipeline depth and submitted at
+  * once; the responses are written in the order of the requests. A request
+  * is read ahead only if its whole header is there already, and its body
+  * only if it's all there too: a response that is ready is never held back
+  * by a blocking read
   */
   void session_handler() {
     bool close = false;
     beast::error_code ec;
 
-    // send-receive buffer
-    beast::flat_buffer buffer;
-
     // init sender, associate it with an error code that we can read later
-    send_lambda<tcp::socket> sender{sock, close, ec};
-    std::chrono::time_point<std::chrono::system_clock> start;
-    std::chrono::time_point<std::chrono::system_clock> end;
+    send_lambda<timed_socket> sender{stream, close, ec};
+    // the requests in flight, oldest first, in a ring
+    const int depth = http_conf.pipeline_depth;
+    std::vector<pipelined> pipeline(depth);
+    int head = 0, count = 0;
+    // the client may time out and close the connection while we wait
+    const int fd = sock.native_handle();
+    const client_probe gone = [fd]() { return socket_closed(fd); };
+    const client_probe away = []() { return true; };
+    // no response is written anymore, the rest of the pipeline is cancelled
+    bool abandon = false;
 
-    for (;;) {
-      // read from socket
-      start = std::chrono::system_clock::now();  // sync mode only
-      beast_basic_request req;
-      http::read(sock, buffer, req, ec);
-      end = std::chrono::system_clock::now(); 
-      std::chrono::duration<double, std::milli> elapsed_mil0 = end-start;
-      // if read indicates end of stream, stop reading
-      if (ec == http::error::end_of_stream) {
-        break;
-      }
-      // if other read error, stop doing session
-      if (ec) {
-        return fail(ec, "read");
+    static metrics::counter* const stage = metrics::alloc_counter("http.io");
+    while (count > 0 || (reading && !abandon)) {
+      metrics::alloc_scope counted{stage};
+      while (reading && !abandon && count < depth &&
+             (count == 0 ||
+              (!pipeline[(head + count - 1) % depth].unread &&
+               !pipeline[(head + count - 1) % depth].deferred &&
+               header_waiting()))) {
+        if (!read_request(pipeline[(head + count) % depth], count == 0)) break;
+        ++count;
       }
-      // handle request
-      start = std::chrono::system_clock::now();  // sync mode only
-      request_handler(std::move(req), sender);
-      end = std::chrono::system_clock::now(); 
-      std::chrono::duration<double, std::milli> elapsed_mil1 = end-start;
-      http_log->debug("Read from socket in {} ms, handle request in {} ms",
-                      elapsed_mil0.count(), elapsed_mil1.count());
-      // handler write error report by sender
-      if (ec) {
-        return fail(ec, "write");
-      }
-      if (close) {
-        break;
+      if (count == 0) break;
+      auto& p = pipeline[head];
+      // its turn came, the client gets 100 Continue
+      if ((!p.unread && !p.deferred) || (!abandon && read_body(p))) {
+        finish(p, abandon ? away : gone, abandon);
+        // nothing is sent if cancelled, the client is gone
+        if (!p.ready) abandon = true;
+        if (!abandon) {
+          stream.expires_after(http_conf.write_timeout);
+          sender(std::move(p.res));
+          // handler write error report by sender
+          if (ec) stop(ec, connection_phase::write);
+          // the body goes back to the engine with the next inference
+          p.prediction.json.swap(p.res.body());
+          p.prediction.json.clear();
+          abandon = ec || close;
+        }
       }
+      p.ready = false;
+      p.unread = false;
+      p.deferred = false;
+      p.req = {};
+      p.parser.reset();
+      head = (head + 1) % depth;
+      --count;
     }
     // If we can reach here, the the request is successful
     // Shut down the socket and return
     http_log->info("Shutdown my socket!");
     sock.shutdown(tcp::socket::shutdown_send, ec);
+    if (unread && !ec) linger();
     return;
   }  // session_handler
+  /**
+  * @brief Discard a refused body for a while before closing
+  * @details Closed with unread bytes, the socket would be reset, and the
+  * client might lose the response before reading it. The blocking reads of
+  * asio ignore the socket timeouts, hence the poll
+  */
+  void linger() {
+    char discard[4096];
+    const auto until = deadline_clock::now() + std::chrono::seconds(1);
+    pollfd p{sock.native_handle(), POLLIN, 0};
+    for (;;) {
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            until - deadline_clock::now())
+                            .count();
+      if (left <= 0 || poll(&p, 1, static_cast<int>(left)) <= 0) return;
+      beast::error_code ec;
+      sock.read_some(net::buffer(discard), ec);
+      if (ec) return;
+    }
+  }  // linger
 };   // class sync_http_worker
 
 /**
@@ -453,9 +796,29 @@ class sync_listen_worker : public sync_worker {
    * @brief Construct a new listen worker object
    *
    * @param _taskq
+   * @param _admission
+   * @param _tiler
+   * @param _hedger
+   * @param _classes
+   * @param _tenants
+   * @param _http parameters of the front end, e.g. the maximum number of
+   * connections
    */
-  sync_listen_worker(object_detection_mq<single_bell>::ptr& _taskq)
-      : taskq(_taskq) {}
+  sync_listen_worker(object_detection_mq<single_bell>::ptr& _taskq,
+                     admission_control::ptr& _admission,
+                     tiled_detector::ptr& _tiler,
+                     request_hedger::ptr& _hedger,
+                     priority_classes::ptr& _classes,
+                     tenant_table::ptr& _tenants, const http_param& _http)
+      : taskq(_taskq),
+        admission(_admission),
+        tiler(_tiler),
+        hedger(_hedger),
+        classes(_classes),
+        tenants(_tenants),
+        http_conf(_http),
+        connections(
+            std::make_shared<connection_limit>(_http.max_connections)) {}
   /**
    * @brief Destroy the listen worker object
    *
@@ -482,6 +845,13 @@ class sync_listen_worker : public sync_worker {
 
 private:
   object_detection_mq<single_bell>::ptr taskq;  //!< task queue
+  admission_control::ptr admission;             //!< admission control
+  tiled_detector::ptr tiler;                    //!< tiled inference
+  request_hedger::ptr hedger;                   //!< hedging, optional
+  priority_classes::ptr classes;                //!< priority classes
+  tenant_table::ptr tenants;                    //!< tenants
+  http_param http_conf;                         //!< parameters
+  connection_limit::ptr connections;            //!< open connections
   /**
    * @brief
    *
@@ -501,11 +871,20 @@ private:
       tcp::socket sock{ioc};
       // accep, blocking until new connection
       acceptor.accept(sock);
+      // over the maximum, the connection is closed before a thread is spawned
+      if (!connections->enter()) {
+        http_log->debug("Too many connections, refuse a client");
+        beast::error_code ec;
+        sock.close(ec);
+        continue;
+      }
       http_log->info("New client: {}",sock.remote_endpoint().address().to_string());
       // launch new http worker to handle new request
       // transfer ownership of socket to the worker
       auto f = [&](tcp::socket& _sock) {
-        sync_http_worker httper{acceptor, std::move(_sock), nullptr, taskq};
+        sync_http_worker httper{acceptor, std::move(_sock), nullptr, taskq,
+                                admission, tiler, hedger, classes,
+                                tenants, http_conf, connections};
         httper();
       };
       std::thread{std::bind(f, std::move(sock))}.detach();